@@ -0,0 +1,688 @@
+#include "machine.h"
+#include "static_machine.h"
+#include "transition_table.h"
+#include "parallel.h"
+#include "mailbox.h"
+#include "scheduler.h"
+#include "timing_wheel.h"
+#include "image.h"
+#include "statistics.h"
+#include "examples/generated/player.h"
+#ifdef __cpp_impl_coroutine
+#include "coroutine.h"
+#endif
+
+#include <chrono>
+#include <sstream>
+
+/* Benchmarks */
+
+template <typename F>
+void benchmark(const char *name, std::size_t iterations, F f) {
+    f(iterations / 10); // warm up
+    auto start = std::chrono::steady_clock::now();
+    f(iterations);
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    std::cout << name << ": " << ns / iterations << " ns/op\n";
+}
+
+enum class State { Off, On, Count };
+enum class Trigger { Switch, Count };
+
+void benchmarkSwitch() {
+    Machine<State, Trigger> m(State::Off);
+    m.configure(State::Off).permit(Trigger::Switch, State::On);
+    m.configure(State::On).permit(Trigger::Switch, State::Off);
+    m.freeze();
+    benchmark("switch", 10000000, [&m](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire(Trigger::Switch);
+        }
+    });
+}
+
+void benchmarkGuardedSwitch() {
+    bool powered = true;
+    Machine<State, Trigger> m(State::Off);
+    m.configure(State::Off)
+        .permitIf(Trigger::Switch, State::On, [&powered](){ return powered; })
+        .ignoreIf(Trigger::Switch, [&powered](){ return !powered; });
+    m.configure(State::On).permit(Trigger::Switch, State::Off);
+    m.freeze();
+    benchmark("guarded switch", 10000000, [&m](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire(Trigger::Switch);
+        }
+    });
+}
+
+void benchmarkStringSwitch() {
+    Machine<std::string, std::string> m("Off");
+    m.configure("Off").permit("Switch", "On");
+    m.configure("On").permit("Switch", "Off");
+    m.freeze();
+    benchmark("string switch", 10000000, [&m](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire("Switch");
+        }
+    });
+}
+
+void benchmarkInstrumentation() {
+    // The switch counted by MachineStatistics, then a switch with entry callbacks with and without the histograms
+    Machine<State, Trigger, MachineStatistics> counted(State::Off);
+    counted.configure(State::Off).permit(Trigger::Switch, State::On);
+    counted.configure(State::On).permit(Trigger::Switch, State::Off);
+    counted.freeze();
+    benchmark("instrumented switch", 10000000, [&counted](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            counted.fire(Trigger::Switch);
+        }
+    });
+
+    std::size_t entered = 0;
+    Machine<State, Trigger> plain(State::Off);
+    Machine<State, Trigger, MachineStatistics> timed(State::Off);
+    auto configure = [&entered](auto &machine) {
+        machine.configure(State::Off).permit(Trigger::Switch, State::On).onEntry([&entered](){ entered++; });
+        machine.configure(State::On).permit(Trigger::Switch, State::Off).onEntry([&entered](){ entered++; });
+        machine.freeze();
+    };
+    configure(plain);
+    configure(timed);
+    benchmark("switch with callbacks", 10000000, [&plain](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            plain.fire(Trigger::Switch);
+        }
+    });
+    benchmark("instrumented switch with callbacks", 10000000, [&timed](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            timed.fire(Trigger::Switch);
+        }
+    });
+}
+
+void benchmarkDeferred() {
+    // Both states defer Work, every switch checks the deferred triggers against the mask of the state entered
+    Machine<State, std::string> m(State::Off);
+    auto work = m.getTriggerHandle("Work");
+    auto change = m.getTriggerHandle("Switch");
+    m.configure(State::Off).permit("Switch", State::On).defer("Work");
+    m.configure(State::On).permit("Switch", State::Off).defer("Work");
+    m.freeze();
+    for (int i = 0; i < 1000; i++) {
+        m.fire(work);
+    }
+    benchmark("switch, 1000 deferred triggers", 10000000, [&m, change](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire(change);
+        }
+    });
+}
+
+void benchmarkHierarchy() {
+    /*
+        A   E
+        |
+        B
+        |
+        C
+        |
+        D
+    */
+    Machine<std::string, std::string> m("D");
+    m.configure("A").permit("X", "E");
+    m.configure("B").substateOf("A");
+    m.configure("C").substateOf("B");
+    m.configure("D").substateOf("C");
+    m.configure("E").permit("X", "D");
+    m.freeze();
+    benchmark("hierarchy", 10000000, [&m](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire("X");
+        }
+    });
+}
+
+void benchmarkHistory() {
+    /*
+        A   E
+        |
+        B
+        |
+        C
+        |
+        D
+    */
+    // Same as the hierarchy, but E goes back to A, which restores D from its deep history
+    Machine<std::string, std::string> m("D");
+    m.configure("A").initialTransition("B").deepHistory().permit("X", "E");
+    m.configure("B").substateOf("A");
+    m.configure("C").substateOf("B");
+    m.configure("D").substateOf("C");
+    m.configure("E").permit("X", "A");
+    m.freeze();
+    benchmark("deep history", 10000000, [&m](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire("X");
+        }
+    });
+}
+
+void benchmarkOrthogonal() {
+    // Two regions switching on every trigger, compared with two machines fired one after the other
+    OrthogonalMachine<std::string, std::string> m("Both");
+    m.configure("Both").orthogonal();
+    for (std::string region : {"A", "B"}) {
+        m.configure(region).substateOf("Both").initialTransition(region + "Off");
+        m.configure(region + "Off").substateOf(region).permit("Switch", region + "On");
+        m.configure(region + "On").substateOf(region).permit("Switch", region + "Off");
+    }
+    m.freeze();
+    auto trigger = m.getTriggerHandle("Switch");
+    benchmark("orthogonal switch, 2 regions", 10000000, [&m, trigger](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire(trigger);
+        }
+    });
+
+    Machine<State, Trigger> a(State::Off), b(State::Off);
+    for (auto machine : {&a, &b}) {
+        machine->configure(State::Off).permit(Trigger::Switch, State::On);
+        machine->configure(State::On).permit(Trigger::Switch, State::Off);
+        machine->freeze();
+    }
+    benchmark("switch, 2 machines", 10000000, [&a, &b](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            a.fire(Trigger::Switch);
+            b.fire(Trigger::Switch);
+        }
+    });
+}
+
+void benchmarkIsInState() {
+    enum class Deep { A, B, C, D, E, F, G, H, Count };
+    Machine<Deep, Trigger> m(Deep::H);
+    for (int i = 1; i < static_cast<int>(Deep::Count); i++) {
+        m.configure(static_cast<Deep>(i)).substateOf(static_cast<Deep>(i - 1));
+    }
+    m.freeze();
+    std::size_t count = 0;
+    benchmark("isInState", 10000000, [&m, &count](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            count += m.isInState(static_cast<Deep>(i % static_cast<std::size_t>(Deep::Count)));
+        }
+    });
+    assert(count == 11000000);
+}
+
+void benchmarkDynamic() {
+    Machine<State, Trigger> m(State::Off);
+    m.configure(State::Off).permitDynamic<int>(Trigger::Switch, [](int i){ return i > 0 ? State::On : State::Off; });
+    m.configure(State::On).permitDynamic<int>(Trigger::Switch, [](int i){ return i > 0 ? State::Off : State::On; });
+    m.freeze();
+    benchmark("dynamic", 10000000, [&m](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire(Trigger::Switch, 1);
+        }
+    });
+}
+
+void benchmarkStaticSwitch() {
+    using Switch = StaticMachine<State, Trigger,
+        def::state<State::Off, def::permit<Trigger::Switch, State::On>>,
+        def::state<State::On, def::permit<Trigger::Switch, State::Off>>>;
+    Switch m(State::Off);
+    benchmark("static switch", 10000000, [&m](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire(Trigger::Switch);
+        }
+    });
+}
+
+// The generated player of the tests, going through its hierarchy with callbacks
+struct PlayerCallbacks {
+    void onEntry_Active() { fCount++; }
+    void onExit_Active() { fCount++; }
+    void action_Active_Seek_0() { fCount++; }
+    void onEntry_Buffering() { fCount++; }
+    bool guard_Buffering_Tick_0() { return true; }
+    bool guard_Buffering_Tick_1() { return false; }
+    void onExit_Streaming() { fCount++; }
+    void action_Streaming_Seek_0() { fCount++; }
+    bool guard_Streaming_Seek_0() { return true; }
+
+    std::size_t fCount = 0;
+};
+
+void benchmarkGenerated() {
+    PlayerCallbacks callbacks;
+    player::Machine<PlayerCallbacks> m(callbacks, player::State::Stopped);
+    const player::Trigger triggers[] = {player::Trigger::Play, player::Trigger::Tick, player::Trigger::Seek, player::Trigger::Stop};
+    benchmark("generated player", 10000000, [&m, &triggers](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire(triggers[i % 4]);
+        }
+    });
+}
+
+// The hand written equivalent of the static switch
+void benchmarkHandWrittenSwitch() {
+    struct Switch {
+        State fState = State::Off;
+        std::function<void(State, State, Trigger)> fOnTransitioned;
+
+        void fire(Trigger trigger) {
+            switch (fState) {
+                case State::Off:
+                    if (trigger == Trigger::Switch) {
+                        fState = State::On;
+                        if (fOnTransitioned) fOnTransitioned(State::Off, State::On, trigger);
+                        return;
+                    }
+                    break;
+                case State::On:
+                    if (trigger == Trigger::Switch) {
+                        fState = State::Off;
+                        if (fOnTransitioned) fOnTransitioned(State::On, State::Off, trigger);
+                        return;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            assert(false);
+        }
+    } m;
+    benchmark("hand written switch", 10000000, [&m](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire(Trigger::Switch);
+        }
+    });
+}
+
+void benchmarkInstances() {
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::Off).permit(Trigger::Switch, State::On);
+    definition.configure(State::On).permit(Trigger::Switch, State::Off);
+    std::vector<MachineInstance<State>> instances(1000000, definition.createInstance(State::Off));
+    definition.freeze();
+    benchmark("fire per instance", 10000000, [&definition, &instances](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            definition.fire(instances[i % instances.size()], Trigger::Switch);
+        }
+    });
+    benchmark("fireAll", 10000000, [&definition, &instances](std::size_t n){
+        for (std::size_t i = 0; i < n; i += instances.size()) {
+            definition.fireAll(instances.data(), std::min(n - i, instances.size()), Trigger::Switch);
+        }
+    });
+}
+
+void benchmarkSnapshot() {
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::Off).permit(Trigger::Switch, State::On);
+    definition.configure(State::On).permit(Trigger::Switch, State::Off);
+    std::vector<MachineInstance<State>> instances(10000000, definition.createInstance(State::Off));
+    definition.freeze();
+    for (std::size_t i = 0; i < instances.size(); i += 3) {
+        definition.fire(instances[i], Trigger::Switch);
+    }
+    // Per instance, into and out of a stream already holding the whole array, so only the snapshot is measured
+    std::stringstream stream;
+    definition.snapshot(instances.data(), instances.size(), stream);
+    benchmark("snapshot", instances.size(), [&definition, &instances, &stream](std::size_t n){
+        stream.seekp(0);
+        definition.snapshot(instances.data(), n, stream);
+    });
+    std::vector<MachineInstance<State>> restored;
+    benchmark("restore", instances.size(), [&definition, &restored, &stream](std::size_t){
+        stream.seekg(0);
+        definition.restore(restored, stream);
+    });
+    assert(restored.size() == instances.size() && definition.isInState(restored[3], State::On));
+}
+
+void benchmarkImage() {
+    // A ring of generated states, built through configure or loaded from an image
+    const std::size_t count = 20000;
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < count; i++) {
+        names.push_back("S" + std::to_string(i));
+    }
+    std::size_t entered = 0;
+    auto configure = [&names, &entered](MachineDefinition<std::string, std::string> &definition) {
+        for (std::size_t i = 0; i < names.size(); i++) {
+            auto &state = definition.configure(names[i]).permit("Next", names[(i + 1) % names.size()]);
+            if (i % 100 == 0) {
+                state.onEntry([&entered](){ entered++; });
+            }
+        }
+        definition.freeze();
+    };
+    benchmark("configure per state", count, [&configure](std::size_t){
+        MachineDefinition<std::string, std::string> definition;
+        configure(definition);
+    });
+
+    MachineDefinition<std::string, std::string> definition;
+    configure(definition);
+    std::stringstream stream;
+    MachineImage::write(definition, stream);
+    auto bytes = stream.str();
+    std::vector<std::uint64_t> data(bytes.size() / sizeof(std::uint64_t) + 1);
+    std::memcpy(data.data(), bytes.data(), bytes.size());
+    CallbackRegistry registry;
+    for (std::size_t i = 0; i < count; i += 100) {
+        registry.onEntry(names[i], [&entered](){ entered++; });
+    }
+    benchmark("image load per state", count, [&data, &bytes, &registry](std::size_t){
+        MachineImage image(data.data(), bytes.size());
+        image.bind(registry);
+    });
+
+    MachineImage image(data.data(), bytes.size());
+    image.bind(registry);
+    auto next = *image.findTrigger("Next");
+    auto instance = image.createInstance(*image.findState("S0"));
+    benchmark("image fire", 10000000, [&image, &instance, next](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            image.fire(instance, next);
+        }
+    });
+    auto handle = *definition.findTrigger("Next");
+    auto definitionInstance = definition.createInstance("S0");
+    benchmark("definition fire", 10000000, [&definition, &definitionInstance, handle](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            definition.fire(definitionInstance, handle);
+        }
+    });
+}
+
+void benchmarkTransitionTable() {
+    // A population of simple agents, 16 states which each permit 4 triggers
+    enum class Agent { Count = 16 };
+    enum class Stimulus { Count = 4 };
+    MachineDefinition<Agent, Stimulus> definition;
+    for (int state = 0; state < 16; state++) {
+        for (int trigger = 0; trigger < 4; trigger++) {
+            definition.configure(static_cast<Agent>(state))
+                .permit(static_cast<Stimulus>(trigger), static_cast<Agent>((state * 5 + trigger * 4 + 1) % 16));
+        }
+    }
+    definition.freeze();
+    const std::size_t population = 1000000;
+    std::vector<MachineInstance<Agent>> instances(population, definition.createInstance(Agent()));
+    std::vector<Stimulus> stimuli(population);
+    std::vector<std::uint8_t> states(population), triggers(population);
+    for (std::size_t i = 0; i < population; i++) {
+        triggers[i] = static_cast<std::uint8_t>(i * 2654435761u >> 7 & 3);
+        stimuli[i] = static_cast<Stimulus>(triggers[i]);
+    }
+    benchmark("population fire", 10000000, [&](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            definition.fire(instances[i % population], stimuli[i % population]);
+        }
+    });
+    benchmark("population fireAll", 10000000, [&](std::size_t n){
+        for (std::size_t i = 0; i < n; i += population) {
+            definition.fireAll(instances.data(), stimuli.data(), std::min(n - i, population));
+        }
+    });
+    auto table = *TransitionTable<std::uint8_t>::tryCreate(definition);
+    for (auto kernel : {TransitionTable<std::uint8_t>::Kernel::Scalar, TransitionTable<std::uint8_t>::Kernel::AVX2, TransitionTable<std::uint8_t>::Kernel::AVX512}) {
+        if (!table.isSupported(kernel)) {
+            continue;
+        }
+        table.setKernel(kernel);
+        const char *names[] = {"table scalar", "table AVX2", "table AVX-512"};
+        benchmark(names[static_cast<int>(kernel)], 100000000, [&](std::size_t n){
+            for (std::size_t i = 0; i < n; i += population) {
+                table.fireAll(states.data(), triggers.data(), std::min(n - i, population));
+            }
+        });
+    }
+}
+
+void benchmarkParallel() {
+    // Guarded transitions take the full fire path, which is where threads pay off
+    bool powered = true;
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::Off).permitIf(Trigger::Switch, State::On, [&powered](){ return powered; });
+    definition.configure(State::On).permitIf(Trigger::Switch, State::Off, [&powered](){ return powered; });
+    const std::size_t population = 1000000;
+    std::vector<MachineInstance<State>> instances(population, definition.createInstance(State::Off));
+    definition.freeze();
+    for (std::size_t threads = 1; threads <= 2 * std::thread::hardware_concurrency(); threads *= 2) {
+        ThreadPool pool(threads);
+        std::string name = "parallel fireAll, " + std::to_string(threads) + " threads";
+        benchmark(name.c_str(), 20000000, [&](std::size_t n){
+            for (std::size_t i = 0; i < n; i += population) {
+                fireAll(pool, definition, instances.data(), std::min(n - i, population), Trigger::Switch);
+            }
+        });
+    }
+}
+
+void benchmarkConcurrent() {
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::Off).permit(Trigger::Switch, State::On);
+    definition.configure(State::On).permit(Trigger::Switch, State::Off);
+    ConcurrentMachineInstance<State> concurrent(definition.createInstance(State::Off));
+    auto instance = definition.createInstance(State::Off);
+    definition.freeze();
+    std::mutex mutex;
+    benchmark("mutex fire", 10000000, [&](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            std::lock_guard<std::mutex> lock(mutex);
+            definition.fire(instance, Trigger::Switch);
+        }
+    });
+    benchmark("concurrent fire", 10000000, [&](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            definition.fire(concurrent, Trigger::Switch);
+        }
+    });
+}
+
+void benchmarkMailbox() {
+    // Batches of posts dispatched at once, against a mutex protected vector swapped out by the owner
+    MailboxMachine<State, Trigger> m(State::Off);
+    m.configure(State::Off).permit<int>(Trigger::Switch, State::On);
+    m.configure(State::On).permit<int>(Trigger::Switch, State::Off);
+    m.freeze();
+    const std::size_t batch = 32;
+    benchmark("mutex queue post and fire", 10000000, [&m, batch](std::size_t n){
+        std::mutex mutex;
+        std::vector<std::pair<Trigger, int>> queue, pending;
+        for (std::size_t i = 0; i < n; i += batch) {
+            for (std::size_t j = 0; j < batch; j++) {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.emplace_back(Trigger::Switch, int(j));
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::swap(queue, pending);
+            }
+            for (auto &[trigger, value] : pending) {
+                m.fire(trigger, value);
+            }
+            pending.clear();
+        }
+    });
+    benchmark("mailbox post and dispatch", 10000000, [&m, batch](std::size_t n){
+        for (std::size_t i = 0; i < n; i += batch) {
+            for (std::size_t j = 0; j < batch; j++) {
+                m.post(Trigger::Switch, int(j));
+            }
+            m.dispatchPending();
+        }
+    });
+    benchmark("mailbox, producer thread", 1000000, [&m](std::size_t n){
+        std::thread producer([&m, n](){
+            for (std::size_t i = 0; i < n; i++) {
+                while (!m.post(Trigger::Switch, int(i))) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+        for (std::size_t dispatched = 0; dispatched < n; ) {
+            if (auto count = m.dispatchPending()) {
+                dispatched += count;
+            }
+            else {
+                std::this_thread::yield();
+            }
+        }
+        producer.join();
+    });
+}
+
+void benchmarkScheduler() {
+    // A million actors sharing one definition, every actor gets a few triggers per round
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::Off).permit(Trigger::Switch, State::On);
+    definition.configure(State::On).permit(Trigger::Switch, State::Off);
+    definition.freeze();
+    const std::size_t population = 1000000;
+    for (std::size_t threads = 1; threads <= 2 * std::thread::hardware_concurrency(); threads *= 2) {
+        Scheduler scheduler(threads);
+        std::deque<Actor<State, Trigger>> actors;
+        for (std::size_t i = 0; i < population; i++) {
+            actors.emplace_back(scheduler, definition, definition.createInstance(State::Off));
+        }
+        for (std::size_t events = 1; events <= MACHINE_ACTOR_CAPACITY; events *= MACHINE_ACTOR_CAPACITY) {
+            std::string name = "actors, " + std::to_string(events) + " triggers each, " + std::to_string(threads) + " threads";
+            benchmark(name.c_str(), 10000000, [&](std::size_t n){
+                for (std::size_t i = 0; i < n; i += population * events) {
+                    for (auto &actor : actors) {
+                        for (std::size_t j = 0; j < events; j++) {
+                            actor.post(Trigger::Switch);
+                        }
+                    }
+                    scheduler.waitIdle();
+                }
+            });
+        }
+        auto stats = scheduler.getStats();
+        std::cout << "  " << stats.fSlices << " slices, " << stats.fSteals << " steals, run queue depth " << stats.fMaxRunQueueDepth << ", mailbox depth " << stats.fMaxMailboxDepth << "\n";
+    }
+}
+
+void benchmarkTimers() {
+    using namespace std::chrono;
+    // Scheduling and cancelling among a million pending timers, spread over every level of the wheel
+    TimingWheel wheel(milliseconds(1), TimingWheel::Clock::time_point());
+    std::uint64_t seed = 1;
+    auto random = [&seed](){
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        return milliseconds((seed >> 33) % (std::uint64_t(1) << 28));
+    };
+    for (std::size_t i = 0; i < 1000000; i++) {
+        wheel.schedule(random(), [](){});
+    }
+    benchmark("timer schedule and cancel, 1M pending", 10000000, [&](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            wheel.cancel(wheel.schedule(random(), [](){}));
+        }
+    });
+
+    // Timers running out, a thousand per tick
+    std::size_t fired = 0;
+    benchmark("timer schedule and fire", 10000000, [&](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            wheel.schedule(milliseconds(1), [&fired](){ fired++; });
+            if (i % 1000 == 999) {
+                wheel.advance(wheel.now() + milliseconds(1));
+            }
+        }
+    });
+
+    // Every transition cancels the timer of the state it leaves, or arms the one of the state it enters
+    TimedMachine<State, Trigger> m(wheel, State::Off);
+    m.configure(State::Off).permitAfter(Trigger::Switch, seconds(1), State::On);
+    m.configure(State::On).permit(Trigger::Switch, State::Off);
+    m.freeze();
+    benchmark("timed switch", 10000000, [&m](std::size_t n){
+        for (std::size_t i = 0; i < n; i++) {
+            m.fire(Trigger::Switch);
+        }
+    });
+}
+
+#ifdef __cpp_impl_coroutine
+void benchmarkAsync() {
+    AsyncMachine<State, Trigger> m(State::Off);
+    m.configure(State::Off).permit(Trigger::Switch, State::On);
+    m.configure(State::On).permit(Trigger::Switch, State::Off);
+    m.freeze();
+    benchmark("async fire", 10000000, [&m](std::size_t n){
+        auto loop = [&m, n]() -> Task {
+            for (std::size_t i = 0; i < n; i++) {
+                co_await m.fireAsync(Trigger::Switch);
+            }
+        };
+        loop();
+    });
+
+    // Every machine waits for an operation when entering On, all of them are completed at once like an event loop would
+    std::vector<std::coroutine_handle<>> pending;
+    struct Operation {
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> awaiting) { fPending.push_back(awaiting); }
+        void await_resume() {}
+        std::vector<std::coroutine_handle<>> &fPending;
+    };
+    const std::size_t population = 10000;
+    std::deque<AsyncMachine<State, Trigger>> machines;
+    for (std::size_t i = 0; i < population; i++) {
+        auto &machine = machines.emplace_back(State::Off);
+        machine.configure(State::Off).permit(Trigger::Switch, State::On);
+        machine.configure(State::On)
+            .onEntry(machine.async([&pending]() -> Task { co_await Operation{pending}; }))
+            .permit(Trigger::Switch, State::Off);
+        machine.freeze();
+    }
+    benchmark("async fire with I/O, 10000 machines", 10000000, [&](std::size_t n){
+        for (std::size_t i = 0; i < n; i += population) {
+            for (auto &machine : machines) {
+                machine.fire(Trigger::Switch);
+            }
+            auto resumed = std::move(pending);
+            pending.clear();
+            for (auto &awaiting : resumed) {
+                awaiting.resume();
+            }
+        }
+    });
+}
+#endif
+
+int main() {
+    benchmarkSwitch();
+    benchmarkGuardedSwitch();
+    benchmarkStringSwitch();
+    benchmarkInstrumentation();
+    benchmarkDeferred();
+    benchmarkHierarchy();
+    benchmarkHistory();
+    benchmarkOrthogonal();
+    benchmarkDynamic();
+    benchmarkIsInState();
+    benchmarkStaticSwitch();
+    benchmarkGenerated();
+    benchmarkHandWrittenSwitch();
+    benchmarkInstances();
+    benchmarkSnapshot();
+    benchmarkImage();
+    benchmarkTransitionTable();
+    benchmarkParallel();
+    benchmarkConcurrent();
+    benchmarkMailbox();
+    benchmarkScheduler();
+    benchmarkTimers();
+#ifdef __cpp_impl_coroutine
+    benchmarkAsync();
+#endif
+}
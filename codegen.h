@@ -0,0 +1,321 @@
+#pragma once
+
+#include "image.h"
+
+#include <cctype>
+#include <unordered_set>
+
+// Generates a standalone C++ header from a frozen definition, or from its image, for machines configured at run time
+// which ship fixed. States and triggers become enums, and fire becomes nested switch statements on the state and
+// the trigger, with the exit and entry callbacks of each transition inlined in the order the definition calls them.
+// Callbacks are member functions of a type given as template argument, named after their state and trigger:
+//
+//   void onEntry_Playing();             entry and exit callbacks
+//   void onExit_Playing();
+//   bool guard_Playing_Pause_0();       predicate of the first action configured on Playing for Pause
+//   void action_Playing_Seek_1();       internal transition, the second action configured on Playing for Seek
+//
+// Names are made identifiers by replacing other characters with underscores. Generating fails when that makes a
+// keyword, a reserved identifier, or the same identifier twice. The generated machine returns false from fire for
+// unhandled triggers instead of calling back, and callbacks can't fire triggers on it. The header declares a
+// Checksum of its text, so a program including it can tell whether it is still up to date.
+class CodeGenerator {
+public:
+    template <typename S, typename T>
+    static bool generate(const MachineDefinition<S, T> &definition, std::string_view name, std::ostream &stream) {
+        std::stringstream image;
+        if (!MachineImage::write(definition, image)) {
+            return false;
+        }
+        auto bytes = image.str();
+        std::vector<std::uint64_t> data(bytes.size() / sizeof(std::uint64_t) + 1);
+        std::memcpy(data.data(), bytes.data(), bytes.size());
+        return generate(MachineImage(data.data(), bytes.size()), name, stream);
+    }
+
+    // Writes the header, with everything in the namespace name. Returns false, having written nothing, when a name
+    // makes a keyword or a reserved identifier, or when two states, two triggers or two callbacks make the same one.
+    static bool generate(const MachineImage &image, std::string_view name, std::ostream &stream) {
+        assert(image.isValid());
+        CodeGenerator generator(image);
+        if (!generator.nameAll()) {
+            return false;
+        }
+        stream << generator.emit(name);
+        return static_cast<bool>(stream);
+    }
+
+private:
+    explicit CodeGenerator(const MachineImage &image) :
+    fImage(image) {
+
+    }
+
+    static std::string identifier(std::string_view name) {
+        std::string result;
+        for (auto c : name) {
+            result += std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+        }
+        if (result.empty() || std::isdigit(static_cast<unsigned char>(result[0]))) {
+            result.insert(result.begin(), '_');
+        }
+        return result;
+    }
+
+    // Keywords, alternative tokens, and names taken by a double underscore or an underscore and a capital
+    static bool isReserved(const std::string &name) {
+        static const std::unordered_set<std::string> keywords = {
+            "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break", "case", "catch",
+            "char", "char8_t", "char16_t", "char32_t", "class", "compl", "concept", "const", "consteval", "constexpr",
+            "constinit", "const_cast", "continue", "co_await", "co_return", "co_yield", "decltype", "default", "delete",
+            "do", "double", "dynamic_cast", "else", "enum", "explicit", "export", "extern", "false", "float", "for",
+            "friend", "goto", "if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq",
+            "nullptr", "operator", "or", "or_eq", "private", "protected", "public", "register", "reinterpret_cast",
+            "requires", "return", "short", "signed", "sizeof", "static", "static_assert", "static_cast", "struct",
+            "switch", "template", "this", "thread_local", "throw", "true", "try", "typedef", "typeid", "typename",
+            "union", "unsigned", "using", "virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq"
+        };
+        return keywords.count(name) || name.find("__") != std::string::npos ||
+            (name.size() > 1 && name[0] == '_' && std::isupper(static_cast<unsigned char>(name[1])));
+    }
+
+    bool nameAll() {
+        std::unordered_set<std::string> used;
+        for (std::size_t i = 0; i < fImage.getStateCount(); i++) {
+            auto &state = fImage.fStates[i];
+            fStates.push_back(state.fConfigured ? identifier(fImage.name(state.fName)) : std::string());
+            if (state.fConfigured && (isReserved(fStates.back()) || !used.insert(fStates.back()).second)) {
+                return false;
+            }
+        }
+        used.clear();
+        for (std::size_t i = 0; i < fImage.getTriggerCount(); i++) {
+            fTriggers.push_back(identifier(fImage.name(fImage.fTriggers[i])));
+            if (isReserved(fTriggers.back()) || !used.insert(fTriggers.back()).second) {
+                return false;
+            }
+        }
+        // Underscores in names can still make two callbacks the same, A_B with C and A with B_C, or make a double
+        // underscore, A_ with B
+        used.clear();
+        return nameSlots("action", detail::ImageSection::Callbacks, used) && nameSlots("guard", detail::ImageSection::Predicates, used);
+    }
+
+    bool nameSlots(const char *prefix, detail::ImageSection section, std::unordered_set<std::string> &used) const {
+        for (std::uint32_t slot = 0; slot < fImage.getCount(section); slot++) {
+            auto name = slotName(prefix, section, slot);
+            if (isReserved(name) || !used.insert(name).second) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The smallest unsigned type holding every index
+    static const char *indexType(std::size_t count) {
+        return count <= 256 ? "std::uint8_t" : count <= 65536 ? "std::uint16_t" : "std::uint32_t";
+    }
+
+    std::string slotName(const char *prefix, detail::ImageSection section, std::uint32_t slot) const {
+        auto &imageSlot = fImage.section<detail::ImageSlot>(section)[slot];
+        switch (imageSlot.fKind) {
+            case detail::ImageSlot::Kind::Entry:
+                return "onEntry_" + fStates[imageSlot.fState];
+            case detail::ImageSlot::Kind::Exit:
+                return "onExit_" + fStates[imageSlot.fState];
+            default:
+                return std::string(prefix) + "_" + fStates[imageSlot.fState] + "_" + fTriggers[imageSlot.fTrigger] + "_" + std::to_string(imageSlot.fAction);
+        }
+    }
+
+    std::string callback(std::uint32_t slot) const {
+        return "fCallbacks." + slotName("action", detail::ImageSection::Callbacks, slot) + "()";
+    }
+
+    template <typename F>
+    void emitNames(std::ostream &code, const char *type, const std::vector<std::string> &identifiers, F nameAt) const {
+        code << "inline const char *toString(" << type << " value) {\n";
+        code << "    switch (value) {\n";
+        for (std::size_t i = 0; i < identifiers.size(); i++) {
+            if (identifiers[i].empty()) {
+                continue;
+            }
+            auto name = fImage.name(nameAt(i));
+            code << "        case " << type << "::" << identifiers[i] << ": return \"";
+            for (auto c : name) {
+                auto byte = static_cast<unsigned char>(c);
+                if (c == '"' || c == '\\') {
+                    code << '\\' << c;
+                }
+                else if (byte < 0x20 || byte == 0x7f) {
+                    // Three octal digits, which can't run into the next character like a hexadecimal escape
+                    code << '\\' << static_cast<char>('0' + (byte >> 6)) << static_cast<char>('0' + ((byte >> 3) & 7)) << static_cast<char>('0' + (byte & 7));
+                }
+                else {
+                    code << c;
+                }
+            }
+            code << "\";\n";
+        }
+        code << "    }\n";
+        code << "    return \"\";\n";
+        code << "}\n\n";
+    }
+
+    void emitEnum(std::ostream &code, const char *type, const std::vector<std::string> &identifiers) const {
+        code << "enum class " << type << " : " << indexType(identifiers.size()) << " {\n";
+        for (std::size_t i = 0; i < identifiers.size(); i++) {
+            if (!identifiers[i].empty()) {
+                code << "    " << identifiers[i] << " = " << i << ",\n";
+            }
+        }
+        code << "};\n\n";
+    }
+
+    // The statements of a planned transition, mirroring MachineImage::transition. The state is only assigned when a
+    // callback could observe it, and once at the end.
+    void emitTransition(std::ostream &code, const detail::ImagePlan &plan, const char *indent) const {
+        for (auto i = plan.fExitBegin; i != plan.fEntryBegin; i++) {
+            auto slot = fImage.fStates[fImage.fPlanStates[i]].fOnExit;
+            if (slot != detail::ImageNone) {
+                code << indent << callback(slot) << ";\n";
+            }
+        }
+        auto assigned = detail::ImageNone;
+        auto state = plan.fDestination;
+        for (auto i = plan.fEntryBegin; i != plan.fEntryEnd; i++) {
+            if (i >= plan.fInitialBegin) {
+                state = fImage.fPlanStates[i];
+            }
+            auto slot = fImage.fStates[fImage.fPlanStates[i]].fOnEntry;
+            if (slot != detail::ImageNone) {
+                if (assigned != state) {
+                    code << indent << "fState = State::" << fStates[state] << ";\n";
+                    assigned = state;
+                }
+                code << indent << callback(slot) << ";\n";
+            }
+        }
+        if (assigned != state) {
+            code << indent << "fState = State::" << fStates[state] << ";\n";
+        }
+    }
+
+    void emitCell(std::ostream &code, const detail::ImageCell &cell) const {
+        for (auto j = cell.fBegin; j != cell.fEnd; j++) {
+            auto &entry = fImage.fEntries[j];
+            bool guarded = entry.fPredicate != detail::ImageNone;
+            auto indent = guarded ? "                    " : "                ";
+            if (guarded) {
+                code << "                if (fCallbacks." << slotName("guard", detail::ImageSection::Predicates, entry.fPredicate) << "()) {\n";
+            }
+            switch (entry.fKind) {
+                case detail::ImageEntry::Kind::Ignore:
+                    break;
+                case detail::ImageEntry::Kind::Internal:
+                    code << indent << callback(entry.fCallback) << ";\n";
+                    break;
+                case detail::ImageEntry::Kind::Transition:
+                    emitTransition(code, fImage.fPlans[entry.fPlan], indent);
+                    break;
+            }
+            code << indent << "return true;\n";
+            if (!guarded) {
+                // Later candidates are never reached
+                return;
+            }
+            code << "                }\n";
+        }
+        code << "                return false;\n";
+    }
+
+    // 64 bit FNV-1a
+    static std::uint64_t checksum(std::string_view text) {
+        std::uint64_t hash = 14695981039346656037ull;
+        for (auto c : text) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    std::string emit(std::string_view name) const {
+        std::ostringstream head;
+        head << "// Generated by CodeGenerator from a machine definition, regenerate it instead of editing\n";
+        head << "#pragma once\n\n";
+        head << "#include <cstddef>\n";
+        head << "#include <cstdint>\n\n";
+        head << "namespace " << name << " {\n\n";
+        emitEnum(head, "State", fStates);
+        emitEnum(head, "Trigger", fTriggers);
+        head << "constexpr std::size_t TriggerCount = " << fTriggers.size() << ";\n\n";
+
+        std::ostringstream code;
+        emitNames(code, "State", fStates, [this](std::size_t i) { return fImage.fStates[i].fName; });
+        emitNames(code, "Trigger", fTriggers, [this](std::size_t i) { return fImage.fTriggers[i]; });
+
+        code << "template <typename Callbacks>\n";
+        code << "class Machine {\n";
+        code << "public:\n";
+        code << "    Machine(Callbacks &callbacks, State state) : fCallbacks(callbacks), fState(state) {}\n\n";
+        code << "    State getState() const {\n";
+        code << "        return fState;\n";
+        code << "    }\n\n";
+        code << "    // Whether the current state is the state or one of its substates\n";
+        code << "    bool isInState(State state) const {\n";
+        code << "        auto current = static_cast<std::size_t>(fState);\n";
+        code << "        auto ancestor = static_cast<std::size_t>(state);\n";
+        code << "        return Pre[ancestor] <= Pre[current] && Post[current] <= Post[ancestor];\n";
+        code << "    }\n\n";
+        code << "    // Returns false when the trigger isn't handled in the current state\n";
+        code << "    bool fire(Trigger trigger) {\n";
+        code << "        switch (fState) {\n";
+        auto triggerCount = fImage.getTriggerCount();
+        for (std::size_t state = 0; state < fStates.size(); state++) {
+            if (fStates[state].empty()) {
+                continue;
+            }
+            code << "        case State::" << fStates[state] << ":\n";
+            code << "            switch (trigger) {\n";
+            for (std::size_t trigger = 0; trigger < triggerCount; trigger++) {
+                auto &cell = fImage.fCells[state * triggerCount + trigger];
+                if (cell.fBegin != cell.fEnd) {
+                    code << "            case Trigger::" << fTriggers[trigger] << ":\n";
+                    emitCell(code, cell);
+                }
+            }
+            code << "            default:\n";
+            code << "                return false;\n";
+            code << "            }\n";
+        }
+        code << "        }\n";
+        code << "        return false;\n";
+        code << "    }\n\n";
+        code << "private:\n";
+        code << "    // Depth first numbering, descendants are numbered between the two numbers of a state\n";
+        emitNumbering(code, "Pre", [](const detail::ImageState &state) { return state.fPre; });
+        emitNumbering(code, "Post", [](const detail::ImageState &state) { return state.fPost; });
+        code << "\n";
+        code << "    Callbacks   &fCallbacks;\n";
+        code << "    State       fState;\n";
+        code << "};\n\n";
+        code << "}\n";
+
+        // Lets a program including the header tell whether generating it again gives the same text
+        head << "// FNV-1a of the rest of this header\n";
+        head << "constexpr std::uint64_t Checksum = 0x" << std::hex << checksum(head.str() + code.str()) << std::dec << ";\n\n";
+        return head.str() + code.str();
+    }
+
+    template <typename F>
+    void emitNumbering(std::ostream &code, const char *array, F number) const {
+        code << "    static constexpr std::uint32_t " << array << "[] = {";
+        for (std::size_t i = 0; i < fStates.size(); i++) {
+            code << (i ? ", " : "") << number(fImage.fStates[i]);
+        }
+        code << "};\n";
+    }
+
+    const MachineImage          &fImage;
+    std::vector<std::string>    fStates;    // Identifiers, empty for states which weren't configured
+    std::vector<std::string>    fTriggers;
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include "machine.h"
+
+#if !defined(__cpp_impl_coroutine)
+#error "coroutine.h requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+
+// A coroutine without result which starts right away. Awaiting a Task resumes the awaiting coroutine once the task
+// has finished. The coroutine frame belongs to the Task, so a Task has to be kept until it is done.
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        // Stays suspended once finished, until the Task is destroyed, and continues with the awaiting coroutine
+        auto final_suspend() noexcept {
+            struct Continue {
+                bool await_ready() noexcept {
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    auto continuation = handle.promise().fContinuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+            return Continue{};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+
+        std::coroutine_handle<> fContinuation;
+    };
+
+    Task() = default;
+
+    Task(Task &&other) noexcept :
+    fHandle(std::exchange(other.fHandle, nullptr)) {
+
+    }
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            reset();
+            fHandle = std::exchange(other.fHandle, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() {
+        reset();
+    }
+
+    bool done() const {
+        return !fHandle || fHandle.done();
+    }
+
+    bool await_ready() const {
+        return done();
+    }
+
+    void await_suspend(std::coroutine_handle<> awaiting) {
+        fHandle.promise().fContinuation = awaiting;
+    }
+
+    void await_resume() {}
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) :
+    fHandle(handle) {
+
+    }
+
+    void reset() {
+        if (fHandle) {
+            fHandle.destroy();
+            fHandle = nullptr;
+        }
+    }
+
+    std::coroutine_handle<promise_type> fHandle;
+};
+
+// A Machine whose entry and exit callbacks may be coroutines. Such callbacks are registered as usual, wrapped with
+// async, and a transition only completes once every Task started by its callbacks has finished. Triggers fired
+// meanwhile wait for it, then fire one transition at a time, so the machine never moves on while an action is
+// still running.
+//
+//   m.configure(State::Loading)
+//       .onEntry(m.async([&]() -> Task { co_await load(); }))
+//       .permit(Trigger::Loaded, State::Ready);
+//
+//   co_await m.fireAsync(Trigger::Load);    // resumes once load() has completed
+//
+// Nothing here is thread safe: the I/O behind the tasks has to resume them on the thread which runs the machine,
+// usually an event loop, so that many machines in flight share that thread instead of blocking one each.
+template <typename S, typename T>
+class AsyncMachine : public Machine<S, T> {
+public:
+    using Base = Machine<S, T>;
+    using typename Base::StateKey;
+    using typename Base::TriggerKey;
+    using typename Base::StateHandle;
+    using typename Base::TriggerHandle;
+
+    using Base::Base;
+
+    AsyncMachine(const AsyncMachine &) = delete;
+    AsyncMachine &operator=(const AsyncMachine &) = delete;
+
+    // Adapts a callback returning a Task to onEntry, onExit, onEntryFrom and onExitFrom
+    template <typename F>
+    auto async(F callback) {
+        return [this, callback](const auto &...args) {
+            Task task = callback(args...);
+            if (!task.done()) {
+                fTasks.push_back(std::move(task));
+            }
+        };
+    }
+
+    // Fires right away when the machine is idle, otherwise once the transitions before it have completed
+    template <typename ...Args>
+    void fire(TriggerKey trigger, Args...args) {
+        if (auto handle = this->findTrigger(trigger)) {
+            fire<Args...>(*handle, args...);
+            return;
+        }
+        // Reports the unhandled trigger right away
+        Base::template fire<Args...>(trigger, args...);
+    }
+
+    template <typename ...Args>
+    void fire(TriggerHandle trigger, Args...args) {
+        if (this->isFiring()) {
+            // Fired by a callback, part of the current transition
+            Base::template fire<Args...>(trigger, args...);
+            return;
+        }
+        auto event = Base::template makeEvent<Args...>(trigger, args...);
+        if (fBusy) {
+            fWaiting.push_back({event, nullptr});
+            return;
+        }
+        start(event, nullptr);
+    }
+
+    // Awaitable which fires the trigger like fire, and resumes once the transition and its tasks have completed.
+    // Callbacks of this machine can't await it, since the transition they belong to would wait for itself.
+    template <typename ...Args>
+    auto fireAsync(TriggerKey trigger, Args...args) {
+        if (auto handle = this->findTrigger(trigger)) {
+            return fireAsync<Args...>(*handle, args...);
+        }
+        Base::template fire<Args...>(trigger, args...);
+        return FireAwaiter{*this, nullptr};
+    }
+
+    template <typename ...Args>
+    auto fireAsync(TriggerHandle trigger, Args...args) {
+        return FireAwaiter{*this, Base::template makeEvent<Args...>(trigger, args...)};
+    }
+
+    // Awaitable which resumes once the machine is in the state, or a substate, with no transition in progress.
+    // Looks the state up without interning it, a state which was never configured is never reached.
+    auto awaitState(StateKey state) {
+        auto handle = this->findState(state);
+        return StateAwaiter{*this, handle ? *handle : StateHandle{std::numeric_limits<std::size_t>::max()}};
+    }
+
+    auto awaitState(StateHandle state) {
+        return StateAwaiter{*this, state};
+    }
+
+    // Whether tasks started by the last transition are still running
+    bool isBusy() const {
+        return fBusy;
+    }
+
+private:
+    using Event = typename Base::Event;
+
+    struct FireAwaiter {
+        bool await_ready() const {
+            return !fEvent;
+        }
+
+        // Returns false, resuming the awaiting coroutine right away, when the transition completed within start
+        bool await_suspend(std::coroutine_handle<> awaiting) {
+            assert(!fMachine.isFiring());
+            if (fMachine.fBusy) {
+                fMachine.fWaiting.push_back({fEvent, awaiting});
+                return true;
+            }
+            return !fMachine.start(fEvent, awaiting);
+        }
+
+        void await_resume() {}
+
+        AsyncMachine    &fMachine;
+        Event           fEvent; // Empty for unhandled triggers, which complete right away
+    };
+
+    struct StateAwaiter {
+        bool await_ready() {
+            return !fMachine.fBusy && fMachine.isInState(fState);
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting) {
+            fMachine.fStateWaiters.push_back({fState, awaiting});
+        }
+
+        void await_resume() {}
+
+        AsyncMachine    &fMachine;
+        StateHandle     fState;
+    };
+
+    struct Waiting {
+        Event                   fEvent;
+        std::coroutine_handle<> fAwaiting; // Resumed once the transition has completed, if any
+    };
+
+    struct StateWaiter {
+        StateHandle             fState;
+        std::coroutine_handle<> fAwaiting;
+    };
+
+    // Fires the event, returns whether it completed before returning, in which case awaiting wasn't resumed since
+    // it isn't suspended yet
+    bool start(const Event &event, std::coroutine_handle<> awaiting) {
+        this->compile();
+        Base::runEvent(event);
+        if (fTasks.empty()) {
+            resumeStateWaiters();
+            return true;
+        }
+        fBusy = true;
+        fStarting = true;
+        fCompletedInStart = false;
+        fDriver = drive(awaiting);
+        fStarting = false;
+        return fCompletedInStart;
+    }
+
+    // Waits for the tasks of the current transition, then fires the triggers which were waiting one at a time
+    Task drive(std::coroutine_handle<> awaiting) {
+        for (bool first = true; ; first = false) {
+            for (auto &task : fTasks) {
+                co_await task;
+            }
+            fTasks.clear();
+            resumeStateWaiters();
+            if (first && fStarting) {
+                // The tasks finished while start ran, the coroutine awaiting start is resumed once it returns
+                fCompletedInStart = true;
+            }
+            else if (awaiting) {
+                awaiting.resume();
+            }
+            if (fWaiting.empty()) {
+                break;
+            }
+            auto next = std::move(fWaiting.front());
+            fWaiting.pop_front();
+            awaiting = next.fAwaiting;
+            this->compile();
+            Base::runEvent(next.fEvent);
+        }
+        fBusy = false;
+    }
+
+    void resumeStateWaiters() {
+        // Resumed coroutines may fire and add waiters, so the list is rescanned by index
+        for (std::size_t i = 0; i < fStateWaiters.size();) {
+            if (this->isInState(fStateWaiters[i].fState)) {
+                auto awaiting = fStateWaiters[i].fAwaiting;
+                fStateWaiters.erase(fStateWaiters.begin() + i);
+                awaiting.resume();
+            }
+            else {
+                i++;
+            }
+        }
+    }
+
+    bool                        fBusy = false;
+    bool                        fStarting = false;          // Within start, which is within await_suspend
+    bool                        fCompletedInStart = false;  // The transition fired by start has completed
+    std::vector<Task>           fTasks;         // Started by callbacks of the current transition
+    std::deque<Waiting>         fWaiting;       // Fired while busy
+    std::vector<StateWaiter>    fStateWaiters;
+    Task                        fDriver;
+};
@@ -10,6 +10,7 @@ int main() {
         .permit(Trigger::Edit, State::Edit);
     m.configure(State::Edit)
         .initialTransition(State::Translate)
+        .shallowHistory()
         .permit(Trigger::Play, State::Play)
         .permit(Trigger::Translate, State::Translate)
         .permit(Trigger::Rotate, State::Rotate)
@@ -25,6 +26,10 @@ int main() {
     m.fire(Trigger::Edit);
     assert(m.isInState(State::Edit));
     assert(m.isInState(State::Translate));
+    m.fire(Trigger::Rotate);
     m.fire(Trigger::Play);
     assert(m.isInState(State::Play));
+    // Back to where editing was left
+    m.fire(Trigger::Edit);
+    assert(m.isInState(State::Rotate));
 }
@@ -0,0 +1,27 @@
+#include "../codegen.h"
+
+#include <fstream>
+
+// Generates the C++ header of a machine from its image, written with MachineImage::write
+//
+//   generate player.image player > player.h
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        std::cerr << "usage: generate <image> <namespace>\n";
+        return 1;
+    }
+    std::ifstream file(argv[1], std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::vector<std::uint64_t> data(bytes.size() / sizeof(std::uint64_t) + 1);
+    std::memcpy(data.data(), bytes.data(), bytes.size());
+    MachineImage image(data.data(), bytes.size());
+    if (!file || !image.isValid()) {
+        std::cerr << "generate: " << argv[1] << " isn't a machine image\n";
+        return 1;
+    }
+    if (!CodeGenerator::generate(image, argv[2], std::cout)) {
+        std::cerr << "generate: names of states or triggers make a keyword, a reserved identifier, or the same identifier or callback name twice\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,191 @@
+// Generated by CodeGenerator from a machine definition, regenerate it instead of editing
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace player {
+
+enum class State : std::uint8_t {
+    Stopped = 0,
+    Active = 1,
+    Playing = 2,
+    Buffering = 3,
+    Paused = 4,
+    Streaming = 5,
+};
+
+enum class Trigger : std::uint8_t {
+    Play = 0,
+    Stop = 1,
+    Seek = 2,
+    Pause = 3,
+    Tick = 4,
+};
+
+constexpr std::size_t TriggerCount = 5;
+
+// FNV-1a of the rest of this header
+constexpr std::uint64_t Checksum = 0x4bf2ff13f7fb9643;
+
+inline const char *toString(State value) {
+    switch (value) {
+        case State::Stopped: return "Stopped";
+        case State::Active: return "Active";
+        case State::Playing: return "Playing";
+        case State::Buffering: return "Buffering";
+        case State::Paused: return "Paused";
+        case State::Streaming: return "Streaming";
+    }
+    return "";
+}
+
+inline const char *toString(Trigger value) {
+    switch (value) {
+        case Trigger::Play: return "Play";
+        case Trigger::Stop: return "Stop";
+        case Trigger::Seek: return "Seek";
+        case Trigger::Pause: return "Pause";
+        case Trigger::Tick: return "Tick";
+    }
+    return "";
+}
+
+template <typename Callbacks>
+class Machine {
+public:
+    Machine(Callbacks &callbacks, State state) : fCallbacks(callbacks), fState(state) {}
+
+    State getState() const {
+        return fState;
+    }
+
+    // Whether the current state is the state or one of its substates
+    bool isInState(State state) const {
+        auto current = static_cast<std::size_t>(fState);
+        auto ancestor = static_cast<std::size_t>(state);
+        return Pre[ancestor] <= Pre[current] && Post[current] <= Post[ancestor];
+    }
+
+    // Returns false when the trigger isn't handled in the current state
+    bool fire(Trigger trigger) {
+        switch (fState) {
+        case State::Stopped:
+            switch (trigger) {
+            case Trigger::Play:
+                fState = State::Active;
+                fCallbacks.onEntry_Active();
+                fState = State::Buffering;
+                fCallbacks.onEntry_Buffering();
+                return true;
+            case Trigger::Stop:
+                return true;
+            default:
+                return false;
+            }
+        case State::Active:
+            switch (trigger) {
+            case Trigger::Stop:
+                fCallbacks.onExit_Active();
+                fState = State::Stopped;
+                return true;
+            case Trigger::Seek:
+                fCallbacks.action_Active_Seek_0();
+                return true;
+            default:
+                return false;
+            }
+        case State::Playing:
+            switch (trigger) {
+            case Trigger::Stop:
+                fCallbacks.onExit_Active();
+                fState = State::Stopped;
+                return true;
+            case Trigger::Seek:
+                fCallbacks.action_Active_Seek_0();
+                return true;
+            case Trigger::Pause:
+                fState = State::Paused;
+                return true;
+            default:
+                return false;
+            }
+        case State::Buffering:
+            switch (trigger) {
+            case Trigger::Stop:
+                fCallbacks.onExit_Active();
+                fState = State::Stopped;
+                return true;
+            case Trigger::Seek:
+                fCallbacks.action_Active_Seek_0();
+                return true;
+            case Trigger::Pause:
+                fState = State::Paused;
+                return true;
+            case Trigger::Tick:
+                if (fCallbacks.guard_Buffering_Tick_0()) {
+                    fState = State::Streaming;
+                    return true;
+                }
+                if (fCallbacks.guard_Buffering_Tick_1()) {
+                    return true;
+                }
+                return false;
+            default:
+                return false;
+            }
+        case State::Paused:
+            switch (trigger) {
+            case Trigger::Play:
+                fState = State::Buffering;
+                fCallbacks.onEntry_Buffering();
+                return true;
+            case Trigger::Stop:
+                fCallbacks.onExit_Active();
+                fState = State::Stopped;
+                return true;
+            case Trigger::Seek:
+                fCallbacks.action_Active_Seek_0();
+                return true;
+            default:
+                return false;
+            }
+        case State::Streaming:
+            switch (trigger) {
+            case Trigger::Stop:
+                fCallbacks.onExit_Streaming();
+                fCallbacks.onExit_Active();
+                fState = State::Stopped;
+                return true;
+            case Trigger::Seek:
+                if (fCallbacks.guard_Streaming_Seek_0()) {
+                    fCallbacks.action_Streaming_Seek_0();
+                    return true;
+                }
+                fCallbacks.action_Active_Seek_0();
+                return true;
+            case Trigger::Pause:
+                fCallbacks.onExit_Streaming();
+                fState = State::Paused;
+                return true;
+            case Trigger::Tick:
+                fCallbacks.onExit_Streaming();
+                fState = State::Streaming;
+                return true;
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+
+private:
+    // Depth first numbering, descendants are numbered between the two numbers of a state
+    static constexpr std::uint32_t Pre[] = {0, 2, 3, 4, 9, 6};
+    static constexpr std::uint32_t Post[] = {1, 11, 8, 5, 10, 7};
+
+    Callbacks   &fCallbacks;
+    State       fState;
+};
+
+}
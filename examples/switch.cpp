@@ -1,7 +1,7 @@
 #include "../machine.h"
 
-enum class State { Off, On };
-enum class Trigger { Switch };
+enum class State { Off, On, Count };
+enum class Trigger { Switch, Count };
 
 int main() {
     Machine<State, Trigger> m(State::Off);
@@ -0,0 +1,689 @@
+#pragma once
+
+#include "machine.h"
+
+#include <limits>
+#include <sstream>
+
+// Images can be mapped from files where the system has mmap, define MACHINE_NO_MMAP to leave it out
+#if !defined(MACHINE_NO_MMAP) && __has_include(<sys/mman.h>)
+#define MACHINE_IMAGE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Frozen definitions saved as a binary image, which is used in place once loaded or mapped, without parsing or
+// allocating anything per state. Every part of the compiled definition is an array in the image, referring to the
+// others by index, so the image doesn't depend on the address it is mapped at and processes can share one copy:
+//
+//   states        name, parent, depth first numbering, entry and exit callbacks
+//   triggers      name
+//   cells         range of entries for each (state, trigger)
+//   entries       kind, plan, predicate and callback of each candidate action
+//   plans         ranges of plan states exited and entered by each transition
+//   plan states   state indices
+//   callbacks     which callback of which state each callback slot stands for, the same for predicates
+//   hashes        open addressing tables of state and trigger indices by name
+//   strings       the names, streamed from the keys
+//
+// Callbacks can't be saved, the image only records which ones the definition had. They are bound again by name
+// through a CallbackRegistry in each process using the image.
+namespace detail {
+
+enum class ImageSection : std::uint32_t {
+    States,
+    Triggers,
+    Cells,
+    Entries,
+    Plans,
+    PlanStates,
+    Callbacks,
+    Predicates,
+    StateHash,
+    TriggerHash,
+    Strings,
+    Count
+};
+
+// Stands for no index in the image
+constexpr std::uint32_t ImageNone = std::numeric_limits<std::uint32_t>::max();
+
+struct ImageHeader {
+    static constexpr std::uint32_t Magic = 0x534d4931;   // Read back differently on a machine with another byte order
+    static constexpr std::uint32_t Version = 1;
+
+    struct Section {
+        std::uint32_t   fOffset;    // From the start of the image
+        std::uint32_t   fCount;
+    };
+
+    std::uint32_t   fMagic = Magic;
+    std::uint32_t   fVersion = Version;
+    std::uint32_t   fSize = 0;
+    std::uint32_t   fTriggerCount = 0;
+    std::array<Section, static_cast<std::size_t>(ImageSection::Count)>  fSections{};
+};
+
+struct ImageName {
+    std::uint32_t   fOffset;    // Into the strings
+    std::uint32_t   fLength;
+};
+
+struct ImageState {
+    ImageName       fName;
+    std::uint32_t   fConfigured;    // Enums have indices for states which weren't configured
+    std::uint32_t   fParent;
+    std::uint32_t   fPre;
+    std::uint32_t   fPost;
+    std::uint32_t   fOnEntry;       // Callback slots
+    std::uint32_t   fOnExit;
+};
+
+struct ImageCell {
+    std::uint32_t   fBegin;
+    std::uint32_t   fEnd;
+};
+
+struct ImageEntry {
+    enum class Kind : std::uint32_t {
+        Ignore,
+        Transition,
+        Internal
+    };
+
+    Kind            fKind;
+    std::uint32_t   fPlan;
+    std::uint32_t   fPredicate; // Predicate slot
+    std::uint32_t   fCallback;  // Callback slot of internal transitions
+};
+
+struct ImagePlan {
+    std::uint32_t   fExitBegin;
+    std::uint32_t   fEntryBegin;
+    std::uint32_t   fInitialBegin;
+    std::uint32_t   fEntryEnd;
+    std::uint32_t   fDestination;
+};
+
+// What a callback or predicate slot is bound to: an entry or exit callback of a state, or the predicate or callback
+// of the action-th action configured on the state for the trigger
+struct ImageSlot {
+    enum class Kind : std::uint32_t {
+        Entry,
+        Exit,
+        Internal,
+        Guard
+    };
+
+    Kind            fKind;
+    std::uint32_t   fState;
+    std::uint32_t   fTrigger;
+    std::uint32_t   fAction;
+};
+
+// Size of the elements of each section
+constexpr std::array<std::size_t, static_cast<std::size_t>(ImageSection::Count)> ImageElementSizes = {
+    sizeof(ImageState), sizeof(ImageName), sizeof(ImageCell), sizeof(ImageEntry), sizeof(ImagePlan), sizeof(std::uint32_t),
+    sizeof(ImageSlot), sizeof(ImageSlot), sizeof(std::uint32_t), sizeof(std::uint32_t), sizeof(char)
+};
+
+// FNV-1a, fixed so images hash names the same way everywhere
+inline std::uint32_t imageHash(std::string_view name) {
+    std::uint32_t hash = 2166136261u;
+    for (auto c : name) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+inline std::string imageSlotKey(ImageSlot::Kind kind, std::string_view state, std::string_view trigger, std::size_t action) {
+    std::string key(1, static_cast<char>('0' + static_cast<int>(kind)));
+    key.append(state).append(1, '\0').append(trigger).append(1, '\0').append(std::to_string(action));
+    return key;
+}
+
+// Reads the compiled tables of a definition, see MachineImage::write
+class ImageWriter {
+public:
+    template <typename S, typename T>
+    static bool write(const MachineDefinition<S, T> &definition, std::ostream &stream) {
+        using Definition = MachineDefinition<S, T>;
+        using Action = typename Definition::Action;
+        assert(definition.fCompiled);
+        ImageWriter writer;
+        auto &states = definition.fStateList;
+        std::size_t triggerCount = definition.fTriggerCount;
+
+        // Slots of the callbacks of each action, by action
+        std::unordered_map<const Action*, std::pair<std::uint32_t, std::uint32_t>> actionSlots;
+        for (std::size_t i = 0; i < states.size(); i++) {
+            auto state = states[i];
+            if (!state) {
+                writer.fStates.push_back({{0, 0}, 0, ImageNone, 0, 0, ImageNone, ImageNone});
+                continue;
+            }
+            // Features which need more than the tables, or callbacks with arguments
+            if (state->fOrthogonal || state->fHistory != Definition::MachineState::History::None || !state->fTimeouts.empty() ||
+                !state->fOnEntryWithParameters.empty() || !state->fOnExitWithParameters.empty()) {
+                return false;
+            }
+            auto index = static_cast<std::uint32_t>(i);
+            auto name = writer.addName(nameOf(state->fState));
+            auto parent = state->fParent ? static_cast<std::uint32_t>(state->fParent->fIndex) : ImageNone;
+            auto onEntry = state->fOnEntry ? writer.addSlot(writer.fCallbacks, ImageSlot::Kind::Entry, index) : ImageNone;
+            auto onExit = state->fOnExit ? writer.addSlot(writer.fCallbacks, ImageSlot::Kind::Exit, index) : ImageNone;
+            writer.fStates.push_back({name, 1, parent, static_cast<std::uint32_t>(state->fPre), static_cast<std::uint32_t>(state->fPost), onEntry, onExit});
+            for (std::size_t trigger = 0; trigger < triggerCount; trigger++) {
+                auto actions = state->fTriggers.find(trigger);
+                if (!actions) {
+                    continue;
+                }
+                for (std::size_t j = 0; j < actions->size(); j++) {
+                    auto &action = (*actions)[j];
+                    bool supported = action.fKind == Action::Kind::Ignore || action.fKind == Action::Kind::Transition || action.fKind == Action::Kind::Internal;
+                    if (!supported || action.fSignature != detail::signature<>()) {
+                        return false;
+                    }
+                    auto &slots = actionSlots[&action];
+                    slots.first = action.fPredicate ? writer.addSlot(writer.fPredicates, ImageSlot::Kind::Guard, index, trigger, j) : ImageNone;
+                    slots.second = action.fKind == Action::Kind::Internal ? writer.addSlot(writer.fCallbacks, ImageSlot::Kind::Internal, index, trigger, j) : ImageNone;
+                }
+            }
+        }
+        for (std::size_t trigger = 0; trigger < triggerCount; trigger++) {
+            writer.fTriggers.push_back(writer.addName(nameOf(definition.fTriggerIndices.key(trigger))));
+        }
+
+        for (auto &cell : definition.fTable) {
+            writer.fCells.push_back({static_cast<std::uint32_t>(cell.first), static_cast<std::uint32_t>(cell.second)});
+        }
+        for (auto &entry : definition.fTableEntries) {
+            auto action = entry.fAction;
+            auto kind = action->fKind == Action::Kind::Transition ? ImageEntry::Kind::Transition :
+                action->fKind == Action::Kind::Internal ? ImageEntry::Kind::Internal : ImageEntry::Kind::Ignore;
+            auto plan = entry.fPlan == Definition::npos ? ImageNone : static_cast<std::uint32_t>(entry.fPlan);
+            auto &slots = actionSlots.at(action);
+            writer.fEntries.push_back({kind, plan, slots.first, slots.second});
+        }
+        for (auto &plan : definition.fPlans) {
+            writer.fPlans.push_back({static_cast<std::uint32_t>(plan.fExitBegin), static_cast<std::uint32_t>(plan.fEntryBegin),
+                static_cast<std::uint32_t>(plan.fInitialBegin), static_cast<std::uint32_t>(plan.fEntryEnd),
+                static_cast<std::uint32_t>(plan.fDestination->fIndex)});
+        }
+        for (auto state : definition.fPlanStates) {
+            writer.fPlanStates.push_back(static_cast<std::uint32_t>(state->fIndex));
+        }
+        writer.fStateHash = writer.hashNames(writer.fStates.size(), [&writer](std::size_t i) {
+            return writer.fStates[i].fConfigured ? std::optional<ImageName>(writer.fStates[i].fName) : std::nullopt;
+        });
+        writer.fTriggerHash = writer.hashNames(writer.fTriggers.size(), [&writer](std::size_t i) {
+            return std::optional<ImageName>(writer.fTriggers[i]);
+        });
+        return writer.emit(stream, triggerCount);
+    }
+
+private:
+    template <typename K>
+    static std::string nameOf(const K &key) {
+        if constexpr (std::is_convertible_v<const K&, std::string_view>) {
+            return std::string(std::string_view(key));
+        }
+        else {
+            std::ostringstream name;
+            name << key;
+            return name.str();
+        }
+    }
+
+    ImageName addName(const std::string &name) {
+        ImageName imageName{static_cast<std::uint32_t>(fStrings.size()), static_cast<std::uint32_t>(name.size())};
+        fStrings += name;
+        return imageName;
+    }
+
+    static std::uint32_t addSlot(std::vector<ImageSlot> &slots, ImageSlot::Kind kind, std::uint32_t state, std::size_t trigger = 0, std::size_t action = 0) {
+        slots.push_back({kind, state, static_cast<std::uint32_t>(trigger), static_cast<std::uint32_t>(action)});
+        return static_cast<std::uint32_t>(slots.size() - 1);
+    }
+
+    std::string_view name(ImageName name) const {
+        return std::string_view(fStrings).substr(name.fOffset, name.fLength);
+    }
+
+    // A power of two of buckets, at most half full, probed linearly
+    template <typename F>
+    std::vector<std::uint32_t> hashNames(std::size_t count, F nameAt) const {
+        std::size_t buckets = 2;
+        while (buckets < 2 * count) {
+            buckets *= 2;
+        }
+        std::vector<std::uint32_t> hash(buckets, ImageNone);
+        for (std::size_t i = 0; i < count; i++) {
+            if (auto imageName = nameAt(i)) {
+                auto bucket = imageHash(name(*imageName)) & (buckets - 1);
+                while (hash[bucket] != ImageNone) {
+                    bucket = (bucket + 1) & (buckets - 1);
+                }
+                hash[bucket] = static_cast<std::uint32_t>(i);
+            }
+        }
+        return hash;
+    }
+
+    bool emit(std::ostream &stream, std::size_t triggerCount) {
+        ImageHeader header;
+        header.fTriggerCount = static_cast<std::uint32_t>(triggerCount);
+        std::array<std::pair<const void*, std::size_t>, static_cast<std::size_t>(ImageSection::Count)> sections = {{
+            {fStates.data(), fStates.size()}, {fTriggers.data(), fTriggers.size()}, {fCells.data(), fCells.size()},
+            {fEntries.data(), fEntries.size()}, {fPlans.data(), fPlans.size()}, {fPlanStates.data(), fPlanStates.size()},
+            {fCallbacks.data(), fCallbacks.size()}, {fPredicates.data(), fPredicates.size()}, {fStateHash.data(), fStateHash.size()},
+            {fTriggerHash.data(), fTriggerHash.size()}, {fStrings.data(), fStrings.size()}
+        }};
+        // Every section starts 8 byte aligned
+        auto align = [](std::size_t offset) { return (offset + 7) & ~std::size_t(7); };
+        std::size_t offset = align(sizeof(ImageHeader));
+        for (std::size_t i = 0; i < sections.size(); i++) {
+            header.fSections[i] = {static_cast<std::uint32_t>(offset), static_cast<std::uint32_t>(sections[i].second)};
+            offset = align(offset + sections[i].second * ImageElementSizes[i]);
+        }
+        if (offset > std::numeric_limits<std::uint32_t>::max()) {
+            return false;
+        }
+        header.fSize = static_cast<std::uint32_t>(offset);
+        std::string image(offset, '\0');
+        std::memcpy(image.data(), &header, sizeof(header));
+        for (std::size_t i = 0; i < sections.size(); i++) {
+            if (sections[i].second) {
+                std::memcpy(image.data() + header.fSections[i].fOffset, sections[i].first, sections[i].second * ImageElementSizes[i]);
+            }
+        }
+        stream.write(image.data(), static_cast<std::streamsize>(image.size()));
+        return static_cast<bool>(stream);
+    }
+
+    std::vector<ImageState>     fStates;
+    std::vector<ImageName>      fTriggers;
+    std::vector<ImageCell>      fCells;
+    std::vector<ImageEntry>     fEntries;
+    std::vector<ImagePlan>      fPlans;
+    std::vector<std::uint32_t>  fPlanStates;
+    std::vector<ImageSlot>      fCallbacks;
+    std::vector<ImageSlot>      fPredicates;
+    std::vector<std::uint32_t>  fStateHash;
+    std::vector<std::uint32_t>  fTriggerHash;
+    std::string                 fStrings;
+};
+
+}
+
+// Callbacks and predicates for the slots of an image, by the names of their state and trigger. Actions are counted
+// among those configured on the state for the trigger, from 0 in the order they were configured.
+class CallbackRegistry {
+public:
+    using Callback = detail::InlineFunction<void()>;
+    using Predicate = detail::InlineFunction<bool()>;
+
+    CallbackRegistry &onEntry(std::string_view state, Callback callback) {
+        fCallbacks[detail::imageSlotKey(detail::ImageSlot::Kind::Entry, state, {}, 0)] = callback;
+        return *this;
+    }
+
+    CallbackRegistry &onExit(std::string_view state, Callback callback) {
+        fCallbacks[detail::imageSlotKey(detail::ImageSlot::Kind::Exit, state, {}, 0)] = callback;
+        return *this;
+    }
+
+    // The callback of an internalTransition
+    CallbackRegistry &internalAction(std::string_view state, std::string_view trigger, Callback callback, std::size_t action = 0) {
+        fCallbacks[detail::imageSlotKey(detail::ImageSlot::Kind::Internal, state, trigger, action)] = callback;
+        return *this;
+    }
+
+    // The predicate of a permitIf, permitReentryIf, ignoreIf or internalTransitionIf
+    CallbackRegistry &guard(std::string_view state, std::string_view trigger, Predicate predicate, std::size_t action = 0) {
+        fPredicates[detail::imageSlotKey(detail::ImageSlot::Kind::Guard, state, trigger, action)] = predicate;
+        return *this;
+    }
+
+private:
+    friend class MachineImage;
+
+    std::unordered_map<std::string, Callback>   fCallbacks;
+    std::unordered_map<std::string, Predicate>  fPredicates;
+};
+
+class CodeGenerator;
+
+// A frozen definition used in place from its binary image. States and triggers are identified by name, or by the
+// indices they had in the definition. Like a definition, an image is shared by instances which only hold their
+// state, and firing only reads it, so it can be shared between threads once bound.
+//
+//   std::ofstream file("editor.image", std::ios::binary);
+//   MachineImage::write(definition, file);
+//
+//   MappedFile mapped("editor.image");
+//   MachineImage image(mapped.data(), mapped.size());
+//   image.bind(registry);
+//   auto instance = image.createInstance(*image.findState("Play"));
+//   image.fire(instance, "Edit");
+//
+// Images are trusted: loading one only checks its header and that its sections lie within it.
+class MachineImage {
+public:
+    struct StateHandle {
+        std::size_t fIndex;
+    };
+
+    struct TriggerHandle {
+        std::size_t fIndex;
+    };
+
+    class Instance {
+    public:
+        explicit Instance(std::size_t index) : fStateIndex(static_cast<std::uint32_t>(index)) {
+
+        }
+
+    private:
+        friend class MachineImage;
+
+        std::uint32_t   fStateIndex;
+    };
+
+    // Writes the compiled tables of the definition. Returns false, having written nothing, when the definition
+    // uses what images can't hold: dynamic transitions, deferred triggers, history, orthogonal regions, timeouts,
+    // or arguments. Names are the keys themselves for strings, and streamed with operator<< otherwise.
+    template <typename S, typename T>
+    static bool write(const MachineDefinition<S, T> &definition, std::ostream &stream) {
+        assert(definition.isFrozen());
+        return detail::ImageWriter::write(definition, stream);
+    }
+
+    // The data has to stay valid while the image is used, and be at least 4 byte aligned, as mapped files are
+    MachineImage(const void *data, std::size_t size) :
+    fData(static_cast<const char*>(data)),
+    fSize(size) {
+        fValid = check();
+        fBound = fValid && getCount(detail::ImageSection::Callbacks) == 0 && getCount(detail::ImageSection::Predicates) == 0;
+    }
+
+    MachineImage(const MachineImage &) = delete;
+    MachineImage &operator=(const MachineImage &) = delete;
+
+    // Whether the data holds an image of this version, for this byte order
+    bool isValid() const {
+        return fValid;
+    }
+
+    // Binds every callback slot of the image to its callback in the registry, copying them. Returns false when some
+    // are missing from the registry, in which case the image stays unbound. Images without callbacks are bound.
+    bool bind(const CallbackRegistry &registry) {
+        assert(fValid);
+        auto callbacks = bindSlots(registry.fCallbacks, detail::ImageSection::Callbacks);
+        auto predicates = bindSlots(registry.fPredicates, detail::ImageSection::Predicates);
+        if (!callbacks || !predicates) {
+            return false;
+        }
+        fCallbacks = std::move(*callbacks);
+        fPredicates = std::move(*predicates);
+        fBound = true;
+        return true;
+    }
+
+    bool isBound() const {
+        return fBound;
+    }
+
+    std::size_t getStateCount() const {
+        return getCount(detail::ImageSection::States);
+    }
+
+    std::size_t getTriggerCount() const {
+        return fTriggerCount;
+    }
+
+    std::optional<StateHandle> findState(std::string_view state) const {
+        auto index = find(detail::ImageSection::StateHash, state, [this](std::uint32_t i) { return fStates[i].fName; });
+        return index != detail::ImageNone ? std::optional<StateHandle>(StateHandle{index}) : std::nullopt;
+    }
+
+    std::optional<TriggerHandle> findTrigger(std::string_view trigger) const {
+        auto index = find(detail::ImageSection::TriggerHash, trigger, [this](std::uint32_t i) { return fTriggers[i]; });
+        return index != detail::ImageNone ? std::optional<TriggerHandle>(TriggerHandle{index}) : std::nullopt;
+    }
+
+    Instance createInstance(StateHandle state) const {
+        assert(state.fIndex < getStateCount() && fStates[state.fIndex].fConfigured);
+        return Instance(state.fIndex);
+    }
+
+    std::string_view getState(const Instance &instance) const {
+        return name(fStates[instance.fStateIndex].fName);
+    }
+
+    bool isInState(const Instance &instance, std::string_view state) const {
+        auto handle = findState(state);
+        return handle && isInState(instance, *handle);
+    }
+
+    bool isInState(const Instance &instance, StateHandle state) const {
+        if (state.fIndex >= getStateCount() || !fStates[state.fIndex].fConfigured) {
+            return false;
+        }
+        auto &current = fStates[instance.fStateIndex];
+        auto &ancestor = fStates[state.fIndex];
+        return ancestor.fPre <= current.fPre && current.fPost <= ancestor.fPost;
+    }
+
+    void fire(Instance &instance, std::string_view trigger) const {
+        if (auto handle = findTrigger(trigger)) {
+            fire(instance, *handle);
+        }
+        else {
+            unhandled(instance, trigger);
+        }
+    }
+
+    // Like MachineDefinition::fire for triggers without arguments
+    void fire(Instance &instance, TriggerHandle trigger) const {
+        assert(fBound && trigger.fIndex < fTriggerCount);
+        auto &cell = fCells[instance.fStateIndex * fTriggerCount + trigger.fIndex];
+        for (auto j = cell.fBegin; j != cell.fEnd; j++) {
+            auto &entry = fEntries[j];
+            if (entry.fPredicate != detail::ImageNone && !fPredicates[entry.fPredicate]()) {
+                continue;
+            }
+            switch (entry.fKind) {
+                case detail::ImageEntry::Kind::Ignore:
+                    return;
+                case detail::ImageEntry::Kind::Internal:
+                    fCallbacks[entry.fCallback]();
+                    return;
+                case detail::ImageEntry::Kind::Transition:
+                    transition(instance, fPlans[entry.fPlan]);
+                    return;
+            }
+        }
+        unhandled(instance, name(fTriggers[trigger.fIndex]));
+    }
+
+    template <typename F>
+    void onUnhandledTrigger(F callback) {
+        fOnUnhandledTrigger = callback;
+    }
+
+private:
+    friend class CodeGenerator;
+
+    using Callback = CallbackRegistry::Callback;
+    using Predicate = CallbackRegistry::Predicate;
+
+    bool check() {
+        if (fSize < sizeof(detail::ImageHeader) || reinterpret_cast<std::uintptr_t>(fData) % alignof(std::uint32_t) != 0) {
+            return false;
+        }
+        auto &header = *reinterpret_cast<const detail::ImageHeader*>(fData);
+        if (header.fMagic != detail::ImageHeader::Magic || header.fVersion != detail::ImageHeader::Version || header.fSize > fSize) {
+            return false;
+        }
+        for (std::size_t i = 0; i < header.fSections.size(); i++) {
+            auto &section = header.fSections[i];
+            if (section.fOffset % alignof(std::uint32_t) != 0 || section.fOffset > header.fSize ||
+                section.fCount > (header.fSize - section.fOffset) / detail::ImageElementSizes[i]) {
+                return false;
+            }
+        }
+        fTriggerCount = header.fTriggerCount;
+        if (getCount(detail::ImageSection::Cells) != getCount(detail::ImageSection::States) * fTriggerCount) {
+            return false;
+        }
+        fStates = section<detail::ImageState>(detail::ImageSection::States);
+        fTriggers = section<detail::ImageName>(detail::ImageSection::Triggers);
+        fCells = section<detail::ImageCell>(detail::ImageSection::Cells);
+        fEntries = section<detail::ImageEntry>(detail::ImageSection::Entries);
+        fPlans = section<detail::ImagePlan>(detail::ImageSection::Plans);
+        fPlanStates = section<std::uint32_t>(detail::ImageSection::PlanStates);
+        fStrings = section<char>(detail::ImageSection::Strings);
+        return true;
+    }
+
+    const detail::ImageHeader &header() const {
+        return *reinterpret_cast<const detail::ImageHeader*>(fData);
+    }
+
+    std::size_t getCount(detail::ImageSection section) const {
+        return header().fSections[static_cast<std::size_t>(section)].fCount;
+    }
+
+    template <typename V>
+    const V *section(detail::ImageSection section) const {
+        return reinterpret_cast<const V*>(fData + header().fSections[static_cast<std::size_t>(section)].fOffset);
+    }
+
+    std::string_view name(detail::ImageName name) const {
+        return std::string_view(fStrings + name.fOffset, name.fLength);
+    }
+
+    template <typename F>
+    std::uint32_t find(detail::ImageSection hash, std::string_view key, F nameAt) const {
+        auto buckets = section<std::uint32_t>(hash);
+        auto mask = getCount(hash) - 1;
+        for (auto bucket = detail::imageHash(key) & mask;; bucket = (bucket + 1) & mask) {
+            auto index = buckets[bucket];
+            if (index == detail::ImageNone || name(nameAt(index)) == key) {
+                return index;
+            }
+        }
+    }
+
+    template <typename V>
+    std::optional<std::vector<V>> bindSlots(const std::unordered_map<std::string, V> &registered, detail::ImageSection slots) const {
+        std::vector<V> bound;
+        auto slot = section<detail::ImageSlot>(slots);
+        for (std::size_t i = 0; i < getCount(slots); i++) {
+            auto state = name(fStates[slot[i].fState].fName);
+            auto trigger = slot[i].fKind == detail::ImageSlot::Kind::Internal || slot[i].fKind == detail::ImageSlot::Kind::Guard ?
+                name(fTriggers[slot[i].fTrigger]) : std::string_view();
+            auto found = registered.find(detail::imageSlotKey(slot[i].fKind, state, trigger, slot[i].fAction));
+            if (found == registered.end()) {
+                return std::nullopt;
+            }
+            bound.push_back(found->second);
+        }
+        return bound;
+    }
+
+    // Runs a planned transition like MachineDefinition::transition
+    void transition(Instance &instance, const detail::ImagePlan &plan) const {
+        for (auto i = plan.fExitBegin; i != plan.fEntryBegin; i++) {
+            auto slot = fStates[fPlanStates[i]].fOnExit;
+            if (slot != detail::ImageNone) {
+                fCallbacks[slot]();
+            }
+        }
+        instance.fStateIndex = plan.fDestination;
+        for (auto i = plan.fEntryBegin; i != plan.fEntryEnd; i++) {
+            if (i >= plan.fInitialBegin) {
+                instance.fStateIndex = fPlanStates[i];
+            }
+            auto slot = fStates[fPlanStates[i]].fOnEntry;
+            if (slot != detail::ImageNone) {
+                fCallbacks[slot]();
+            }
+        }
+    }
+
+    void unhandled(const Instance &instance, std::string_view trigger) const {
+        if (fOnUnhandledTrigger) {
+            fOnUnhandledTrigger(getState(instance), trigger);
+        }
+        else {
+            assert(false);
+        }
+    }
+
+    const char                              *fData;
+    std::size_t                             fSize;
+    bool                                    fValid = false;
+    bool                                    fBound = false;
+    std::size_t                             fTriggerCount = 0;
+    const detail::ImageState                *fStates = nullptr;
+    const detail::ImageName                 *fTriggers = nullptr;
+    const detail::ImageCell                 *fCells = nullptr;
+    const detail::ImageEntry                *fEntries = nullptr;
+    const detail::ImagePlan                 *fPlans = nullptr;
+    const std::uint32_t                     *fPlanStates = nullptr;
+    const char                              *fStrings = nullptr;
+    std::vector<Callback>                   fCallbacks;     // Bound to the callback slots
+    std::vector<Predicate>                  fPredicates;    // Bound to the predicate slots
+    detail::InlineFunction<void(std::string_view state, std::string_view trigger)>   fOnUnhandledTrigger;
+};
+
+#ifdef MACHINE_IMAGE_MMAP
+// A file mapped read only, so processes mapping the same image share its pages
+class MappedFile {
+public:
+    explicit MappedFile(const char *path) {
+        auto file = ::open(path, O_RDONLY);
+        if (file < 0) {
+            return;
+        }
+        struct stat status;
+        if (::fstat(file, &status) == 0 && status.st_size > 0) {
+            auto data = ::mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_SHARED, file, 0);
+            if (data != MAP_FAILED) {
+                fData = data;
+                fSize = static_cast<std::size_t>(status.st_size);
+            }
+        }
+        ::close(file);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (fData) {
+            ::munmap(fData, fSize);
+        }
+    }
+
+    bool isOpen() const {
+        return fData != nullptr;
+    }
+
+    const void *data() const {
+        return fData;
+    }
+
+    std::size_t size() const {
+        return fSize;
+    }
+
+private:
+    void        *fData = nullptr;
+    std::size_t fSize = 0;
+};
+#endif
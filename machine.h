@@ -1,23 +1,512 @@
- #include <iostream>
+#pragma once
+
+#include <iostream>
 #include <cassert>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <cstring>
+#include <limits>
 #include <map>
 #include <memory>
-#include <typeindex>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Specialize to give the number of values of an enum used as state or trigger type, for example
+// template <> struct enum_count<State> : std::integral_constant<std::size_t, 5> {};
+// Enums which end with a Count enumerator are detected automatically.
+// Machines on such types store their states and triggers in arrays indexed by the underlying value.
+template <typename E, typename = void>
+struct enum_count {};
+
+template <typename E>
+struct enum_count<E, std::enable_if_t<std::is_enum_v<E>, std::void_t<decltype(E::Count)>>> :
+    std::integral_constant<std::size_t, static_cast<std::size_t>(E::Count)> {};
+
+// Bytes available to store a callback inline. Callbacks are never heap allocated, capturing more than
+// this many bytes fails to compile. Define before including this header to change it.
+#ifndef MACHINE_CALLBACK_CAPACITY
+#define MACHINE_CALLBACK_CAPACITY (6 * sizeof(void*))
+#endif
+
+// Number of triggers a Machine queues inline while it is firing, for triggers fired by its own callbacks. Further
+// ones are queued in a vector allocated on first use. Define before including this header to change it.
+#ifndef MACHINE_QUEUE_CAPACITY
+#define MACHINE_QUEUE_CAPACITY 16
+#endif
+
+// Number of states with history a Machine can go back to, each takes a state index in the machine.
+// Define before including this header to change it.
+#ifndef MACHINE_HISTORY_CAPACITY
+#define MACHINE_HISTORY_CAPACITY 4
+#endif
+
+namespace detail {
+
+// A std::function replacement which stores the callable inline and never allocates.
+// Trivially copyable callables, such as lambdas capturing references, are copied without indirection.
+template <typename Signature, std::size_t Capacity = MACHINE_CALLBACK_CAPACITY>
+class InlineFunction;
+
+template <typename R, typename ...Args, std::size_t Capacity>
+class InlineFunction<R(Args...), Capacity> {
+public:
+    InlineFunction() = default;
+
+    InlineFunction(std::nullptr_t) {}
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, InlineFunction>>>
+    InlineFunction(F &&callable) {
+        using Callable = std::decay_t<F>;
+        static_assert(sizeof(Callable) <= Capacity, "Callback too large, increase MACHINE_CALLBACK_CAPACITY");
+        static_assert(alignof(Callable) <= alignof(void*), "Callback alignment not supported");
+        new (fStorage) Callable(std::forward<F>(callable));
+        fInvoke = [](void *storage, Args ...args) -> R {
+            return (*static_cast<Callable*>(storage))(std::forward<Args>(args)...);
+        };
+        if (!std::is_trivially_copyable_v<Callable>) {
+            fManage = &manage<Callable>;
+        }
+    }
+
+    InlineFunction(const InlineFunction &other) {
+        copy(other);
+    }
+
+    InlineFunction &operator=(const InlineFunction &other) {
+        if (this != &other) {
+            reset();
+            copy(other);
+        }
+        return *this;
+    }
+
+    InlineFunction &operator=(std::nullptr_t) {
+        reset();
+        return *this;
+    }
+
+    ~InlineFunction() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return fInvoke != nullptr;
+    }
+
+    R operator()(Args ...args) const {
+        return fInvoke(const_cast<unsigned char*>(fStorage), std::forward<Args>(args)...);
+    }
+
+private:
+    // Copies a callable from source to destination, or destroys destination if source is nullptr
+    template <typename Callable>
+    static void manage(void *destination, const void *source) {
+        if (source) {
+            new (destination) Callable(*static_cast<const Callable*>(source));
+        }
+        else {
+            static_cast<Callable*>(destination)->~Callable();
+        }
+    }
+
+    void copy(const InlineFunction &other) {
+        if (other.fManage) {
+            other.fManage(fStorage, other.fStorage);
+        }
+        else {
+            std::memcpy(fStorage, other.fStorage, Capacity);
+        }
+        fInvoke = other.fInvoke;
+        fManage = other.fManage;
+    }
+
+    void reset() {
+        if (fManage) {
+            fManage(fStorage, nullptr);
+        }
+        fInvoke = nullptr;
+        fManage = nullptr;
+    }
+
+    alignas(void*) unsigned char    fStorage[Capacity];
+    R                               (*fInvoke)(void *storage, Args ...args) = nullptr;
+    void                            (*fManage)(void *destination, const void *source) = nullptr;
+};
+
+// A first in first out queue stored inline up to its capacity. Values pushed while it is full go to a vector
+// allocated on first use, and so do the values pushed after them until the vector has been emptied, to keep them
+// in order.
+template <typename V, std::size_t Capacity>
+class RingBuffer {
+public:
+    bool empty() const {
+        return fSize == 0 && fOverflowHead == fOverflow.size();
+    }
+
+    void push(const V &value) {
+        if (fSize < Capacity && fOverflow.empty()) {
+            fValues[(fHead + fSize++) % Capacity] = value;
+        }
+        else {
+            fOverflow.push_back(value);
+        }
+    }
+
+    V pop() {
+        assert(!empty());
+        if (fSize == 0) {
+            V value = std::move(fOverflow[fOverflowHead++]);
+            if (fOverflowHead == fOverflow.size()) {
+                // Keeps the capacity for the next burst
+                fOverflow.clear();
+                fOverflowHead = 0;
+            }
+            return value;
+        }
+        V value = fValues[fHead];
+        fValues[fHead] = V();
+        fHead = (fHead + 1) % Capacity;
+        fSize--;
+        return value;
+    }
+
+private:
+    std::size_t                 fHead = 0;
+    std::size_t                 fSize = 0;
+    std::array<V, Capacity>     fValues;
+    std::vector<V>              fOverflow; // Pushed after the inline values, popped from fOverflowHead
+    std::size_t                 fOverflowHead = 0;
+};
+
+// A unique address for each argument list, used to match typed actions with fire without RTTI
+template <typename ...Args>
+const void *signature() {
+    static const char tag = 0;
+    return &tag;
+}
+
+// Index of the lowest set bit, bits can't be 0
+inline std::size_t lowestBit(std::uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<std::size_t>(__builtin_ctzll(bits));
+#else
+    std::size_t index = 0;
+    for (; !(bits & 1); bits >>= 1) {
+        index++;
+    }
+    return index;
+#endif
+}
+
+// Leads every snapshot, so a definition can tell whether it can read the instances which follow
+struct SnapshotHeader {
+    static constexpr std::uint32_t Magic = 0x534d4331;   // Read back differently on a machine with another byte order
+    static constexpr std::uint16_t Version = 1;
+
+    std::uint32_t   fMagic = Magic;
+    std::uint16_t   fVersion = Version;
+    std::uint8_t    fIndexSize = 0;     // Bytes of a state index
+    std::uint8_t    fHistory = 0;       // History slots of each instance
+    std::uint32_t   fStateCount = 0;    // Of the definition, which has to be configured the same way to read it back
+    std::uint32_t   fHistoryCount = 0;  // States with history in the definition
+    std::uint64_t   fCount = 0;         // Instances following the header
+
+    bool operator==(const SnapshotHeader &other) const {
+        return fMagic == other.fMagic && fVersion == other.fVersion && fIndexSize == other.fIndexSize &&
+            fHistory == other.fHistory && fStateCount == other.fStateCount && fHistoryCount == other.fHistoryCount &&
+            fCount == other.fCount;
+    }
+};
+
+static_assert(sizeof(SnapshotHeader) == 24, "Snapshot headers are written as is");
+
+// The type used to look up a key at run time. Strings are looked up through a view so no temporary is created
+template <typename K>
+struct key_view {
+    using type = const K &;
+};
+
+template <typename C, typename Traits, typename Allocator>
+struct key_view<std::basic_string<C, Traits, Allocator>> {
+    using type = std::basic_string_view<C, Traits>;
+};
+
+template <typename K, typename = void>
+struct is_enum_indexed : std::false_type {};
+
+template <typename K>
+struct is_enum_indexed<K, std::void_t<decltype(enum_count<K>::value)>> : std::true_type {};
+
+// Interns keys, assigning a dense index to each key in order of first use
+template <typename K, typename = void>
+class KeyIndex {
+public:
+    static constexpr std::size_t npos = -1;
+
+    std::size_t insert(const K &key) {
+        auto i = fIndices.find(key);
+        if (fIndices.end() != i) {
+            return i->second;
+        }
+        i = fIndices.insert({key, fKeys.size()}).first;
+        fKeys.push_back(&i->first);
+        return i->second;
+    }
+
+    // Heterogeneous lookup, a std::string key can be found by a std::string_view
+    template <typename Key>
+    std::size_t find(const Key &key) const {
+        auto i = fIndices.find(key);
+        return fIndices.end() != i ? i->second : npos;
+    }
+
+    const K &key(std::size_t index) const {
+        return *fKeys[index];
+    }
+
+    std::size_t size() const {
+        return fKeys.size();
+    }
+
+private:
+    std::map<K, std::size_t, std::less<>>   fIndices;
+    std::vector<const K*>                   fKeys;
+};
+
+// Enums use their underlying value as index
+template <typename K>
+class KeyIndex<K, std::enable_if_t<is_enum_indexed<K>::value>> {
+public:
+    static constexpr std::size_t npos = -1;
+
+    std::size_t insert(const K &key) const {
+        assert(find(key) != npos);
+        return find(key);
+    }
+
+    std::size_t find(const K &key) const {
+        auto index = static_cast<std::size_t>(key);
+        return index < size() ? index : npos;
+    }
+
+    K key(std::size_t index) const {
+        return static_cast<K>(index);
+    }
+
+    constexpr std::size_t size() const {
+        return enum_count<K>::value;
+    }
+};
+
+// Values stored by key index, sparse in a map
+template <typename K, typename V, typename = void>
+class IndexedStorage {
+public:
+    V *find(std::size_t index) {
+        auto i = fValues.find(index);
+        return fValues.end() != i ? &i->second : nullptr;
+    }
+
+    template <typename ...Args>
+    V &emplace(std::size_t index, Args &&...args) {
+        return fValues.try_emplace(index, std::forward<Args>(args)...).first->second;
+    }
+
+private:
+    std::map<std::size_t, V>    fValues;
+};
+
+// Values of enum keys are stored inline in an array, without allocation
+template <typename K, typename V>
+class IndexedStorage<K, V, std::enable_if_t<is_enum_indexed<K>::value>> {
+public:
+    V *find(std::size_t index) {
+        return fValues[index] ? &*fValues[index] : nullptr;
+    }
+
+    template <typename ...Args>
+    V &emplace(std::size_t index, Args &&...args) {
+        return fValues[index] ? *fValues[index] : fValues[index].emplace(std::forward<Args>(args)...);
+    }
+
+private:
+    std::array<std::optional<V>, enum_count<K>::value>  fValues;
+};
+
+// The type of the state index held by an instance. Enums use their underlying type, so an instance is no larger than
+// the state itself.
+template <typename S, typename = void>
+struct state_index {
+    using type = std::uint32_t;
+};
+
+template <typename S>
+struct state_index<S, std::enable_if_t<is_enum_indexed<S>::value>> {
+    using type = std::underlying_type_t<S>;
+};
+
+// Saves compiled definitions as images, see image.h
+class ImageWriter;
+
+}
+
+// The instrumentation policy of a Machine which measures nothing, every hook compiles away. A policy is told about
+// every trigger fired, and runs the entry and exit callbacks of states which have some, see statistics.h.
+struct NoInstrumentation {
+    void fired(std::size_t /* state */, std::size_t /* trigger */, std::size_t /* stateCount */, std::size_t /* triggerCount */) {}
+
+    template <typename F>
+    void entered(std::size_t /* state */, F callback) {
+        callback();
+    }
+
+    template <typename F>
+    void exited(std::size_t /* state */, F callback) {
+        callback();
+    }
+
+    template <typename StateName, typename TriggerName>
+    void dump(std::ostream &/* stream */, StateName, TriggerName) const {}
+};
 
 template <typename S, typename T>
-class Machine {
+class MachineDefinition;
+
+// The current state of one machine, fired through the MachineDefinition which created it
+template <typename S, std::size_t History = 0>
+class MachineInstance;
+
+template <typename S>
+class MachineInstance<S, 0> {
 public:
-    Machine(S initialState) :
-    fState(initialState) {
+    using Index = typename detail::state_index<S>::type;
+
+    explicit MachineInstance(std::size_t index) : fStateIndex(static_cast<Index>(index)) {
+        assert(static_cast<std::size_t>(fStateIndex) == index);
+    }
+
+private:
+    template <typename, typename>
+    friend class MachineDefinition;
+
+    template <typename>
+    friend class ConcurrentMachineInstance;
+
+    template <typename, std::size_t>
+    friend class MachineInstance;
+
+    void setState(std::size_t index) {
+        fStateIndex = static_cast<Index>(index);
+    }
+
+    Index   fStateIndex;
+};
+
+// An instance which also records the substate left by each state with history, for up to History such states
+template <typename S, std::size_t History>
+class MachineInstance : public MachineInstance<S, 0> {
+public:
+    using typename MachineInstance<S, 0>::Index;
+
+    explicit MachineInstance(std::size_t index) : MachineInstance<S, 0>(index) {
+
+    }
+
+private:
+    template <typename, typename>
+    friend class MachineDefinition;
+
+    std::array<Index, History>  fHistory{}; // Index of the recorded substate plus one, 0 while nothing was recorded
+};
+
+// The current state of one machine shared between threads, for machines without callbacks on their transitions.
+// Fired through the MachineDefinition which created it, which commits each transition with a compare and swap.
+template <typename S>
+class ConcurrentMachineInstance {
+public:
+    explicit ConcurrentMachineInstance(MachineInstance<S> instance) : fStateIndex(instance.fStateIndex) {
+
+    }
+
+    // A snapshot of the current state
+    MachineInstance<S> load() const {
+        return MachineInstance<S>(fStateIndex.load(std::memory_order_acquire));
+    }
 
+private:
+    template <typename, typename>
+    friend class MachineDefinition;
+
+    std::atomic<typename MachineInstance<S>::Index> fStateIndex;
+};
+
+// The active states of one machine with orthogonal regions, fired through the MachineDefinition which created it.
+// Every active state has its bit set, ancestors included, so checking a state is a single bit test.
+template <typename S>
+class MachineConfiguration {
+private:
+    template <typename, typename>
+    friend class MachineDefinition;
+
+    bool isActive(std::size_t index) const {
+        return index / 64 < fActive.size() && ((fActive[index / 64] >> (index % 64)) & 1);
+    }
+
+    void setActive(std::size_t index, bool active) {
+        if (index / 64 >= fActive.size()) {
+            fActive.resize(index / 64 + 1);
+        }
+        auto bit = std::uint64_t(1) << (index % 64);
+        fActive[index / 64] = active ? fActive[index / 64] | bit : fActive[index / 64] & ~bit;
     }
 
+    std::vector<std::uint64_t>  fActive;    // Bit mask of state indices
+    std::vector<std::size_t>    fLeaves;    // Used by fire, the active states without active substates
+    std::vector<const void*>    fFired;     // Used by fire, the actions already run for the trigger
+};
+
+template <typename S, typename T>
+class MachineDefinition {
+public:
+    class MachineState;
+    using Instance = MachineInstance<S>;
+    using ConcurrentInstance = ConcurrentMachineInstance<S>;
+    using Configuration = MachineConfiguration<S>;
+    using StateKey = typename detail::key_view<S>::type;
+    using TriggerKey = typename detail::key_view<T>::type;
+
+    // A pre-interned state, checking with a handle skips the key lookup
+    struct StateHandle {
+        std::size_t fIndex;
+    };
+
+    // A pre-interned trigger, firing with a handle skips the key lookup
+    struct TriggerHandle {
+        std::size_t fIndex;
+    };
+
+    // A trigger fired once a state has been active for a while, see MachineState::permitAfter
+    struct Timeout {
+        TriggerHandle                           fTrigger;
+        std::chrono::steady_clock::duration     fDelay;
+    };
+
     class MachineState {
     public:
-        MachineState(Machine &machine, S state) : 
-        fMachine(machine),
-        fState(state) {
+        MachineState(MachineDefinition &definition, S state, std::size_t index) : 
+        fDefinition(definition),
+        fState(state),
+        fIndex(index) {
 
         }
 
@@ -25,100 +514,151 @@ public:
         template <typename ...Args>
         MachineState &permit(T trigger, S state) {
             assert(state != fState);
-            fTriggers.insert({trigger, std::make_unique<TriggerAction<Args...>>(state)});
+            addAction<Args...>(trigger, Action::Kind::Transition, fDefinition.getCachedMachineState(state));
+            return *this;
+        }
+
+        // Transition from one state to another state by firing the trigger once the state has been active for the
+        // delay. The timer is armed when the state is entered and cancelled when it is exited, by a TimedMachine.
+        template <typename Rep, typename Period>
+        MachineState &permitAfter(T trigger, std::chrono::duration<Rep, Period> delay, S state) {
+            permit(trigger, state);
+            auto handle = TriggerHandle{fDefinition.fTriggerIndices.find(trigger)};
+            fTimeouts.push_back({handle, std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay)});
             return *this;
         }
 
         // Conditional transition from one state to another state
-        template <typename ...Args>
-        MachineState &permitIf(T trigger, S state, const std::function<bool()> &predicate) {
+        template <typename ...Args, typename P>
+        MachineState &permitIf(T trigger, S state, P predicate) {
             assert(state != fState);
-            fTriggers.insert({trigger, std::make_unique<ConditionalTriggerAction<Args...>>(predicate, state)});
+            addAction<Args...>(trigger, Action::Kind::Transition, fDefinition.getCachedMachineState(state), predicate);
             return *this;
         }
 
         // Transition from one state to the same state
         template <typename ...Args>
         MachineState &permitReentry(T trigger) {
-            fTriggers.insert({trigger, std::make_unique<TriggerAction<Args...>>(fState)});
+            addAction<Args...>(trigger, Action::Kind::Transition, this);
             return *this;
         }
 
         // Conditional transition from one state to the same state
-        template <typename ...Args>
-        MachineState &permitReentryIf(T trigger, const std::function<bool()> &predicate) {
-            fTriggers.insert({trigger, std::make_unique<ConditionalTriggerAction<Args...>>(predicate, fState)});
+        template <typename ...Args, typename P>
+        MachineState &permitReentryIf(T trigger, P predicate) {
+            addAction<Args...>(trigger, Action::Kind::Transition, this, predicate);
             return *this;
         }
 
         // Transition from one state to a dynamicly selected state
         template <typename ...Args, typename F>
         MachineState &permitDynamic(T trigger, F selector) {
-            fTriggers.insert({trigger, std::make_unique<DynamicTriggerAction<Args...>>(selector)});
+            addAction<Args...>(trigger, Action::Kind::Dynamic).fCallback = makeSelector<Args...>(selector);
             return *this;
         }
 
         // Conditional transition from one state to a dynamicly selected state
-        template <typename ...Args, typename F>
-        MachineState &permitDynamicIf(T trigger, F selector, const std::function<bool()> &predicate) {
-            fTriggers.insert({trigger, std::make_unique<ConditionalDynamicTriggerAction<Args...>>(predicate, selector)});
+        template <typename ...Args, typename F, typename P>
+        MachineState &permitDynamicIf(T trigger, F selector, P predicate) {
+            addAction<Args...>(trigger, Action::Kind::Dynamic, nullptr, predicate).fCallback = makeSelector<Args...>(selector);
             return *this;
         }
 
         // No transition, but also no handler exception
         template <typename ...Args>
         MachineState &ignore(T trigger) {
-            fTriggers.insert({trigger, std::make_unique<TriggerAction<Args...>>()});
+            addAction<Args...>(trigger, Action::Kind::Ignore);
             return *this;
         }
 
         // Conditionally no transition, but also no handler exception
+        template <typename ...Args, typename P>
+        MachineState &ignoreIf(T trigger, P predicate) {
+            addAction<Args...>(trigger, Action::Kind::Ignore, nullptr, predicate);
+            return *this;
+        }
+
+        // No transition, the trigger is kept and fired again once the machine is in a state which doesn't defer it.
+        // Only a Machine keeps deferred triggers, firing them on a bare instance reports them as unhandled.
         template <typename ...Args>
-        MachineState &ignoreIf(T trigger, const std::function<bool()> &predicate) {
-            fTriggers.insert({trigger, std::make_unique<ConditionalTriggerAction<Args...>>(predicate)});
+        MachineState &defer(T trigger) {
+            addAction<Args...>(trigger, Action::Kind::Defer);
             return *this;
         }
 
         // No transition, but calls action
-        template <typename ...Args>
-        MachineState &internalTransition(T trigger, const std::function<void()> &action) {
-            fTriggers.insert({trigger, std::make_unique<InternalTriggerAction<Args...>>(action)});
+        template <typename ...Args, typename F>
+        MachineState &internalTransition(T trigger, F action) {
+            addAction<Args...>(trigger, Action::Kind::Internal).fCallback = makeInternalAction(action);
             return *this;
         }
 
         // Conditionally no transition, but calls action
-        template <typename ...Args>
-        MachineState &internalTransitionIf(T trigger, const std::function<void()> &action, const std::function<bool()> &predicate) {
-            fTriggers.insert({trigger, std::make_unique<ConditionalInternalTriggerAction<Args...>>(predicate, action)});
+        template <typename ...Args, typename F, typename P>
+        MachineState &internalTransitionIf(T trigger, F action, P predicate) {
+            addAction<Args...>(trigger, Action::Kind::Internal, nullptr, predicate).fCallback = makeInternalAction(action);
             return *this;
         }
 
         // Makes this state a substate of the given state
         MachineState &substateOf(S state) {
+            auto parent = fDefinition.getCachedMachineState(state);
             // Check if parent state is not yet set
-            assert(!fParentState);
+            assert(!fParent);
             // Check for cycles
-            assert(!isDescendantOf(state));
-            fParentState = state;
+            for (auto ancestor = parent; ancestor; ancestor = ancestor->fParent) {
+                assert(ancestor != this);
+            }
+            fDefinition.invalidate();
+            fParent = parent;
             return *this;
         }
 
         // When entering this state, immediatelly go to the given substate
         MachineState &initialTransition(S state) {
             assert(fState != state);
-            assert(!fInitialState);
-            fInitialState = state;
+            assert(!fInitial && !fOrthogonal);
+            fDefinition.invalidate();
+            fInitial = fDefinition.getCachedMachineState(state);
+            return *this;
+        }
+
+        // When this state is entered without a substate as destination, goes back to the direct substate which was
+        // active when it was last left, instead of taking the initial transition. That substate is entered the usual
+        // way, through its own history or initial transition. The first time, the initial transition is taken.
+        MachineState &shallowHistory() {
+            return history(History::Shallow);
+        }
+
+        // Like shallowHistory, but goes back to the innermost substate which was active when this state was left
+        MachineState &deepHistory() {
+            return history(History::Deep);
+        }
+
+        // Makes the substates of this state orthogonal regions, which are all active while this state is. Entering
+        // this state enters every region, each through its own initial transition. Only configurations follow more
+        // than one region, see MachineDefinition::createConfiguration.
+        MachineState &orthogonal() {
+            assert(!fInitial);
+            fDefinition.invalidate();
+            fOrthogonal = true;
             return *this;
         }
 
         // Set a callback for when this state is entered
-        MachineState &onEntry(const std::function<void()> &callback) {
+        template <typename F>
+        MachineState &onEntry(F callback) {
+            static_assert(std::is_void_v<std::invoke_result_t<F&>>, "Entry and exit callbacks return nothing, wrap coroutines with AsyncMachine::async");
+            fDefinition.invalidate();
             fOnEntry = callback;
             return *this;
         }
 
         // Set a callback for when this state is exited
-        MachineState &onExit(const std::function<void()> &callback) {
+        template <typename F>
+        MachineState &onExit(F callback) {
+            static_assert(std::is_void_v<std::invoke_result_t<F&>>, "Entry and exit callbacks return nothing, wrap coroutines with AsyncMachine::async");
+            fDefinition.invalidate();
             fOnExit = callback;
             return *this;
         }
@@ -126,565 +666,1601 @@ public:
         // Set a callback for when this state is entered
         template<typename ...Args, typename F>
         MachineState &onEntryFrom(T trigger, F callback) {
-            fOnEntryWithParameters.template insert_or_assign<Args...>(trigger, std::make_unique<TypedTriggerCallBack<Args...>>(callback));
+            fDefinition.invalidate();
+            setTriggerCallback<Args...>(fOnEntryWithParameters, trigger, callback);
             return *this;
         }
 
         // Set a callback for when this state is entered
         template<typename ...Args, typename F>
         MachineState &onExitFrom(T trigger, F callback) {
-            fOnExitWithParameters.template insert_or_assign<Args...>(trigger, std::make_unique<TypedTriggerCallBack<Args...>>(callback));
+            fDefinition.invalidate();
+            setTriggerCallback<Args...>(fOnExitWithParameters, trigger, callback);
             return *this;
         }
 
     private:
-        friend class Machine;
+        friend class MachineDefinition;
+        friend class detail::ImageWriter;
 
-        class Action {
-        public:
-            virtual bool isValid() {
-                return true;
-            }
+        enum class History : std::uint8_t {
+            None,
+            Shallow,
+            Deep
         };
 
-        // Decorator to create a conditional version of an action
-        template <typename A>
-        class Conditional : public A {
-        public:
-            template <typename ...Args>
-            Conditional(const std::function<bool()> &predicate, Args...args) :
-            A(args...),
-            fPredicate(predicate) {}
+        MachineState &history(History history) {
+            assert(fHistory == History::None);
+            fDefinition.invalidate();
+            fHistory = history;
+            fHistorySlot = fDefinition.fHistoryCount++;
+            return *this;
+        }
 
-            bool isValid() override {
-                return fPredicate();
+        // What happens when a trigger is fired, stored inline in the trigger list of the state.
+        // The kind tag replaces virtual dispatch, and the signature replaces a dynamic_cast on the argument types.
+        struct Action {
+            enum class Kind : std::uint8_t {
+                Ignore,     // ignore, no transition
+                Transition, // permit, permitReentry
+                Internal,   // internalTransition, calls fCallback without transition
+                Dynamic,    // permitDynamic, the destination is returned by fCallback
+                Defer       // defer, no transition, the Machine keeps the trigger to fire it again later
+            };
+
+            bool isValid() const {
+                return !fPredicate || fPredicate();
             }
 
-        private:
-            std::function<bool()>   fPredicate;
+            Kind                                                    fKind;
+            const void                                              *fSignature;
+            MachineState                                            *fDestination;
+            detail::InlineFunction<bool()>                          fPredicate;
+            detail::InlineFunction<MachineState*(const MachineDefinition &definition, const void *args)> fCallback; // args points to a std::tuple<Args&...>
         };
 
-        // An action for permit, permitReentry, ignore
-        template <typename ...Args>
-        class TriggerAction : public Action {
-        public:
-            TriggerAction(S state) : 
-                fDestination(state) {}
-            TriggerAction() : 
-                fDestination() {}
-
-            virtual bool hasDestination() {
-                return fDestination.operator bool();
-            }
-
-            virtual S getDestination(Args...args) {
-                return *fDestination;
-            }
+        using Callback = detail::InlineFunction<void()>;
+        using ActionCallback = detail::InlineFunction<MachineState*(const MachineDefinition &definition, const void *args)>;
 
-            virtual void call() {
-            }
+        // An entry or exit callback which receives the arguments passed to fire
+        struct TriggerCallback {
+            using Callback = detail::InlineFunction<void(const void *args)>;
 
-        private:
-            std::optional<S>    fDestination;
+            std::size_t fTrigger;
+            const void  *fSignature;
+            Callback    fCallback; // args points to a std::tuple<Args&...>
         };
 
-        // An action for internalTransition. It doesn't have a state, just an action which is called
-        template <typename ...Args>
-        class InternalTriggerAction : public TriggerAction<Args...> {
-        public:
-            InternalTriggerAction(const std::function<void()> &action) :
-            TriggerAction<Args...>(),
-            fAction(action) {}
-
-            void call() override {
-                fAction();
-            }
-
-        private:
-            std::function<void()>   fAction;
-        };
+        // Usually empty or very small, so a linear scan is cheapest
+        using TriggerCallbacks = std::vector<TriggerCallback>;
 
-        // An action for permitDynamic. Always has a destination, decided by a selector
         template <typename ...Args>
-        class DynamicTriggerAction : public TriggerAction<Args...> {
-        public:
-            DynamicTriggerAction(const std::function<S(Args...)> &selector) :
-            TriggerAction<Args...>(),
-            fSelector(selector) {}
-
-            bool hasDestination() override {
-                return true;
-            }
+        Action &addAction(T trigger, typename Action::Kind kind, MachineState *destination = nullptr, detail::InlineFunction<bool()> predicate = {}) {
+            fDefinition.invalidate();
+            auto &actions = fTriggers.emplace(fDefinition.fTriggerIndices.insert(trigger));
+            return actions.emplace_back(Action{kind, detail::signature<Args...>(), destination, predicate, {}});
+        }
 
-            S getDestination(Args...args) override {
-                return fSelector(args...);
-            }
+        template <typename F>
+        static ActionCallback makeInternalAction(F action) {
+            return [action](const MachineDefinition &, const void *) -> MachineState* {
+                action();
+                return nullptr;
+            };
+        }
 
-        private:
-            std::function<S(Args...)>      fSelector;
-        };
+        template <typename ...Args, typename F>
+        static ActionCallback makeSelector(F selector) {
+            return [selector](const MachineDefinition &definition, const void *args) {
+                return definition.getMachineState(std::apply(selector, *static_cast<const std::tuple<Args&...>*>(args)));
+            };
+        }
 
-        template <typename ...Args> using ConditionalTriggerAction = Conditional<TriggerAction<Args...>>;
-        template <typename ...Args> using ConditionalDynamicTriggerAction = Conditional<DynamicTriggerAction<Args...>>;
-        template <typename ...Args> using ConditionalInternalTriggerAction = Conditional<InternalTriggerAction<Args...>>;
+        template <typename ...Args, typename F>
+        void setTriggerCallback(TriggerCallbacks &callbacks, T trigger, F callback) {
+            static_assert(std::is_void_v<std::invoke_result_t<F&, Args&...>>, "Entry and exit callbacks return nothing, wrap coroutines with AsyncMachine::async");
+            typename TriggerCallback::Callback typedCallback = [callback](const void *args) {
+                std::apply(callback, *static_cast<const std::tuple<Args&...>*>(args));
+            };
+            auto index = fDefinition.fTriggerIndices.insert(trigger);
+            for (auto &existing : callbacks) {
+                if (existing.fTrigger == index && existing.fSignature == detail::signature<Args...>()) {
+                    existing.fCallback = typedCallback;
+                    return;
+                }
+            }
+            callbacks.push_back({index, detail::signature<Args...>(), typedCallback});
+        }
 
         template <typename ...Args>
-        TriggerAction<Args...> *getActionFor(T trigger) {
-            auto range = fTriggers.equal_range(trigger);
-            for (auto i = range.first; i != range.second; i++) {
-                if (!i->second->isValid()) {
-                    continue;
-                }
-                else {
-                    return dynamic_cast<TriggerAction<Args...>*>(i->second.get());
+        static const TriggerCallback *findTriggerCallback(const TriggerCallbacks &callbacks, std::size_t trigger) {
+            for (auto &callback : callbacks) {
+                if (callback.fTrigger == trigger && callback.fSignature == detail::signature<Args...>()) {
+                    return &callback;
                 }
             }
-            if (fParentState) {
-                return fMachine.getMachineState(*fParentState)->template getActionFor<Args...>(trigger);
+            return nullptr;
+        }
+
+        // Appends the actions for the trigger of this state and all its ancestors, in order of precedence
+        void collectActionsFor(std::size_t trigger, std::vector<Action*> &actions) {
+            if (auto triggerActions = fTriggers.find(trigger)) {
+                for (auto &action : *triggerActions) {
+                    actions.push_back(&action);
+                }
             }
-            else {
-                return nullptr;
+            if (fParent) {
+                fParent->collectActionsFor(trigger, actions);
             }
         }
 
-        bool isDescendantOf(S state) {
-            return (fState == state || (fParentState && fMachine.getMachineState(*fParentState)->isDescendantOf(state)));
+        // Whether entering or leaving the state has effects besides changing the current state
+        bool hasCallbacks() const {
+            return fOnEntry || fOnExit || !fOnEntryWithParameters.empty() || !fOnExitWithParameters.empty() || !fTimeouts.empty() || fHistory != History::None;
         }
 
-        bool isAncestorOf(S state) {
-            return fMachine.getMachineState(*fParentState)->isDescendantOf(this->fState);
+        // Constant time using the depth first numbering of the compiled hierarchy
+        bool isDescendantOf(MachineState *state) const {
+            assert(fDefinition.fCompiled);
+            return state->fPre <= fPre && fPost <= state->fPost;
         }
 
         template <typename ...Args>
-        void callOnEntry(T trigger, Args...args) {
-            TriggerCallback *callback = fOnEntryWithParameters.template at<Args...>(trigger);
-            if (callback) {
-                TypedTriggerCallBack<Args...> *typedCallback = dynamic_cast<TypedTriggerCallBack<Args...>*>(callback);
-                assert(typedCallback);
-                if (typedCallback) {
-                    (*typedCallback)(args...);
-                }
+        void callOnEntry(std::size_t trigger, Args...args) const {
+            if (auto callback = findTriggerCallback<Args...>(fOnEntryWithParameters, trigger)) {
+                std::tuple<Args&...> arguments(args...);
+                callback->fCallback(&arguments);
             }
-            else {
-                if (fOnEntry) {
-                    fOnEntry();
-                }
+            else if (fOnEntry) {
+                fOnEntry();
             }
         }
 
         template <typename ...Args>
-        void callOnExit(T trigger, Args...args) {
-            TriggerCallback *callback = fOnExitWithParameters.template at<Args...>(trigger);
-            if (callback) {
-                TypedTriggerCallBack<Args...> *typedCallback = dynamic_cast<TypedTriggerCallBack<Args...>*>(callback);
-                assert(typedCallback);
-                if (typedCallback) {
-                    (*typedCallback)(args...);
-                }
+        void callOnExit(std::size_t trigger, Args...args) const {
+            if (auto callback = findTriggerCallback<Args...>(fOnExitWithParameters, trigger)) {
+                std::tuple<Args&...> arguments(args...);
+                callback->fCallback(&arguments);
             }
-            else {
-                if (fOnExit) {
-                    fOnExit();
-                }
+            else if (fOnExit) {
+                fOnExit();
             }
         }
 
-        // Virtual class used for type erasure of std::function
-        class TriggerCallback {
-        public:
-            virtual ~TriggerCallback() {}
-        };
+        MachineDefinition                           &fDefinition;
+        S                                           fState;
+        std::size_t                                 fIndex;
+        MachineState                                *fParent = nullptr;
+        MachineState                                *fInitial = nullptr;
+        bool                                        fOrthogonal = false;
+        History                                     fHistory = History::None;
+        std::size_t                                 fHistorySlot = 0; // Index into the history slots of instances
+        std::vector<MachineState*>                  fChildren; // Numbered by rebuild, the regions of an orthogonal state
+        std::size_t                                 fPre = 0;  // Depth first order in which the state is entered
+        std::size_t                                 fPost = 0; // and left, descendants are numbered in between
+        std::size_t                                 fDynamicPlans = 0; // Row of the plans of dynamic transitions from this state
+        detail::IndexedStorage<T, std::vector<Action>>  fTriggers;
+        TriggerCallbacks                            fOnEntryWithParameters;
+        TriggerCallbacks                            fOnExitWithParameters;
+        Callback                                    fOnEntry;
+        Callback                                    fOnExit;
+        std::vector<Timeout>                        fTimeouts;
+    };
 
-        template <typename ...Args>
-        class TypedTriggerCallBack : public TriggerCallback {
-        public:
-            TypedTriggerCallBack(const std::function<void(Args...)> &callback) : fCallback(callback) {}
-            void operator()(Args...args) { fCallback(args...); }
-        private:
-            std::function<void(Args...)> fCallback;
-        };
+    MachineDefinition() = default;
 
-        template <>
-        class TypedTriggerCallBack<void> : public TriggerCallback {
-        public:
-            TypedTriggerCallBack(const std::function<void()> &callback) : fCallback(callback) {}
-            void operator()() { fCallback(); }
-        private:
-            std::function<void()> fCallback;
-        };
+    // States refer to their definition and to each other by address, so definitions stay where they were created
+    MachineDefinition(const MachineDefinition &) = delete;
+    MachineDefinition &operator=(const MachineDefinition &) = delete;
 
-        struct TriggerMap {
-            std::map<std::type_index, TriggerMap>           fSubMap;
-            std::map<T, std::unique_ptr<TriggerCallback>>   fCallbacks;
+    MachineState &configure(S state) {
+        assert(!fFrozen);
+        return *getCachedMachineState(state);
+    }
 
-            void insert_or_assign(T trigger, std::unique_ptr<TriggerCallback> &&callback) {
-                fCallbacks.insert_or_assign(trigger, std::move(callback));
-            }
-            
-            template <typename Type>
-            void insert_or_assign(T trigger, std::unique_ptr<TriggerCallback> &&callback) {
-                fSubMap[std::type_index(typeid(Type))].insert_or_assign(trigger, std::move(callback));
-            }
+    // Compiles the configuration into a flat (state x trigger) table and disallows further configuration.
+    // Inherited transitions are resolved ahead of time, so fire no longer depends on the depth of the hierarchy.
+    void freeze() {
+        compile();
+        fFrozen = true;
+    }
 
-            template <typename First, typename Second, typename ...Rest> // We need second here to distinguish it from a call with one template argument
-            void insert_or_assign(T trigger, std::unique_ptr<TriggerCallback> &&callback) {
-                fSubMap[std::type_index(typeid(First))].template insert_or_assign<Second, Rest...>(trigger, std::move(callback));
-            }
+    bool isFrozen() const {
+        return fFrozen;
+    }
 
-            TriggerCallback *at(T trigger) {
-                auto i = fCallbacks.find(trigger);
-                return fCallbacks.end() != i ? i->second.get() : nullptr;
-            }
+    // The number of state and trigger indices handed out, handles and instances index below these
+    std::size_t getStateCount() const {
+        return fStateList.size();
+    }
 
-            template <typename Type>
-            TriggerCallback *at(T trigger) {
-                auto i = fSubMap.find(std::type_index(typeid(Type)));
-                return fSubMap.end() != i ? i->second.at(trigger) : nullptr;
-            }
+    std::size_t getTriggerCount() const {
+        return fTriggerIndices.size();
+    }
 
-            template <typename First, typename Second, typename ...Rest>
-            TriggerCallback *at(T trigger) {
-                auto i = fSubMap.find(std::type_index(typeid(First)));
-                return fSubMap.end() != i ? i->second.template at<Second, Rest...>(trigger) : nullptr;
-            }
-        };
+    // The number of states configured with history, instances need as many slots to go back to all of them
+    std::size_t getHistoryCount() const {
+        return fHistoryCount;
+    }
 
-        Machine                                     &fMachine;
-        S                                           fState;
-        std::optional<S>                            fParentState;
-        std::optional<S>                            fInitialState;
-        std::multimap<T, std::unique_ptr<Action>>   fTriggers; // TODO: use std::variant once std::visit works on iOS
-        TriggerMap                                  fOnEntryWithParameters;
-        TriggerMap                                  fOnExitWithParameters;
-        std::function<void()>                       fOnEntry;
-        std::function<void()>                       fOnExit;
-    };
+    // The state reached by firing the trigger without arguments, when that has no effect besides changing the state.
+    // Ignored and unhandled triggers stay in the state. Returns std::nullopt when firing has other effects.
+    std::optional<StateHandle> getDirectTransition(StateHandle state, TriggerHandle trigger) const {
+        assert(fCompiled);
+        auto index = state.fIndex * fTriggerCount + trigger.fIndex;
+        auto &cell = fTable[index];
+        auto next = fDirect[index];
+        if (!fStateList[state.fIndex] || cell.first == cell.second || next == unchanged) {
+            return state;
+        }
+        if (next == indirect) {
+            return std::nullopt;
+        }
+        return StateHandle{next};
+    }
 
-    MachineState &configure(S state) {
-        return *getCachedMachineState(state);
+    // Interns the state, so it can be checked without looking up the key
+    StateHandle getStateHandle(S state) {
+        return {getCachedMachineState(state)->fIndex};
     }
 
-    bool canFire(T trigger) {
-        // Lookup trigger for current state
-        auto destination = getDestinationFor(fState, trigger);
-        return destination;
+    // Interns the trigger, so it can be fired without looking up the key
+    TriggerHandle getTriggerHandle(T trigger) {
+        auto index = fTriggerIndices.find(trigger);
+        if (index == fTriggerIndices.npos) {
+            invalidate();
+            index = fTriggerIndices.insert(trigger);
+        }
+        return {index};
     }
 
-    void fire(T trigger) {
-        // Lookup current state
-        auto source = getMachineState(fState);
-        // Lookup trigger action
-        auto action = getActionFor(fState, trigger);
-        if (!action) {
-            if (fOnUnhandledTrigger) {
-                fOnUnhandledTrigger(fState, trigger);
+    // Looks the trigger up without interning it, so it can be called on a definition shared between threads.
+    // Returns std::nullopt for triggers which were never configured.
+    std::optional<TriggerHandle> findTrigger(TriggerKey trigger) const {
+        auto index = fTriggerIndices.find(trigger);
+        return index != fTriggerIndices.npos ? std::optional<TriggerHandle>(TriggerHandle{index}) : std::nullopt;
+    }
+
+    // Like findTrigger, std::nullopt for states which were never configured
+    std::optional<StateHandle> findState(StateKey state) const {
+        auto index = fStateIndices.find(state);
+        return index != fStateIndices.npos ? std::optional<StateHandle>(StateHandle{index}) : std::nullopt;
+    }
+
+    // Creates an instance in the given state. Instances only hold their state, everything else is shared.
+    Instance createInstance(S initialState) {
+        return Instance(getCachedMachineState(initialState)->fIndex);
+    }
+
+    // Creates an instance which can go back to substates with history, with a slot for each of up to History states
+    // configured with shallowHistory or deepHistory, in the order they were configured. States past the slots of the
+    // instance, like every state of other instances, take the initial transition every time. See getHistoryCount.
+    template <std::size_t History>
+    MachineInstance<S, History> createInstance(S initialState) {
+        return MachineInstance<S, History>(getCachedMachineState(initialState)->fIndex);
+    }
+
+    // Creates a configuration in the given state and its ancestors, plus the initial substates of every region of the
+    // orthogonal states among them. Like an instance, nothing is entered. Regions have to be configured beforehand.
+    Configuration createConfiguration(S initialState) {
+        auto initial = getCachedMachineState(initialState);
+        compile();
+        Configuration configuration;
+        auto activated = [](MachineState *){};
+        for (auto state = initial; state; state = state->fParent) {
+            configuration.setActive(state->fIndex, true);
+        }
+        for (auto state = initial; state; state = state->fParent) {
+            enterRegions(configuration, state, activated);
+        }
+        return configuration;
+    }
+
+    // The methods below take an instance and only read the definition, so a frozen definition can be shared
+    // by any number of threads, as long as each instance is used by one thread at a time.
+
+    const S &getState(const Instance &instance) const {
+        return fStateList[instance.fStateIndex]->fState;
+    }
+
+    bool canFire(const Instance &instance, TriggerKey trigger) const {
+        auto index = fTriggerIndices.find(trigger);
+        return index != fTriggerIndices.npos && canFire(instance, TriggerHandle{index});
+    }
+
+    bool canFire(const Instance &instance, TriggerHandle trigger) const {
+        // Lookup trigger for current state
+        return findAction(instance, trigger.fIndex) != npos;
+    }
+
+    template <typename ...Args, std::size_t History>
+    void fire(MachineInstance<S, History> &instance, TriggerKey trigger, Args...args) const {
+        auto index = fTriggerIndices.find(trigger);
+        if (index == fTriggerIndices.npos) {
+            unhandled(instance, T(trigger));
+            return;
+        }
+        fire<Args...>(instance, TriggerHandle{index}, args...);
+    }
+
+    template <typename ...Args, std::size_t History>
+    void fire(MachineInstance<S, History> &instance, TriggerHandle trigger, Args...args) const {
+        if (!fireUnlessDeferred<Args...>(instance, trigger, args...)) {
+            // An instance has nowhere to keep the trigger
+            unhandled(instance, fTriggerIndices.key(trigger.fIndex));
+        }
+    }
+
+    // Fires a trigger on an instance shared between threads, without locking. The next state is computed from the
+    // current one and committed with a compare and swap, when another thread changed the state in between it is
+    // computed again. Predicates may be evaluated more than once and have to be free of side effects, and transitions
+    // can't have entry or exit callbacks, internal actions or dynamic destinations. Returns false, leaving the state
+    // as it was, when the trigger is unhandled or when it leads to one of those.
+    bool fire(ConcurrentInstance &instance, TriggerKey trigger) const {
+        auto index = fTriggerIndices.find(trigger);
+        if (index == fTriggerIndices.npos) {
+            unhandled(instance.load(), T(trigger));
+            return false;
+        }
+        return fire(instance, TriggerHandle{index});
+    }
+
+    bool fire(ConcurrentInstance &instance, TriggerHandle trigger) const {
+        assert(fCompiled);
+        auto current = instance.fStateIndex.load(std::memory_order_acquire);
+        for (;;) {
+            auto next = fDirect[current * fTriggerCount + trigger.fIndex];
+            if (next == indirect) {
+                next = getConcurrentTransition(Instance(current), trigger);
             }
-            else {
-                assert(false);
+            if (next == unchanged) {
+                return true;
+            }
+            if (next == refused) {
+                return false;
+            }
+            if (next == indirect) {
+                unhandled(Instance(current), fTriggerIndices.key(trigger.fIndex));
+                return false;
+            }
+            if (instance.fStateIndex.compare_exchange_weak(current, static_cast<decltype(current)>(next), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                transitioned(fStateList[current], fStateList[next], trigger.fIndex);
+                return true;
             }
+        }
+    }
+
+    const S &getState(const ConcurrentInstance &instance) const {
+        return getState(instance.load());
+    }
+
+    bool isInState(const ConcurrentInstance &instance, StateKey state) const {
+        return isInState(instance.load(), state);
+    }
+
+    bool isInState(const ConcurrentInstance &instance, StateHandle state) const {
+        return isInState(instance.load(), state);
+    }
+
+    template <typename ...Args>
+    void fire(Configuration &configuration, TriggerKey trigger, Args...args) const {
+        auto index = fTriggerIndices.find(trigger);
+        if (index == fTriggerIndices.npos) {
+            auto &leaves = configuration.fLeaves;
+            auto first = leaves.size();
+            collectLeaves(configuration, leaves);
+            auto leaf = leaves[first];
+            leaves.resize(first);
+            unhandled(fStateList[leaf]->fState, T(trigger));
             return;
         }
-        // Check if it isn't an ignore or internal transition
-        if (!action->hasDestination()) {
-            // If it is an internal transition, call the action
-            action->call();
-            return; 
-        }
-        S state = action->getDestination();
-        auto destination = getMachineState(state);
-        // Call exit on old state, and get the highest state reachest when exiting
-        auto topLevelState = exit(source, destination, source == destination);
-        fState = destination->fState;
-        transitioned(source, destination, trigger);
-        // Call entry on new state
-        enter(topLevelState, destination, trigger, false);
+        fire<Args...>(configuration, TriggerHandle{index}, args...);
     }
 
+    // Fires the trigger in every active region in one pass. Each active leaf state takes its first valid action like
+    // an instance would, an action shared through a common ancestor runs once, and a transition leaving the state of
+    // another region exits that region before it sees the trigger. Reported as unhandled when no region handles it.
     template <typename ...Args>
-    void fire(T trigger, Args...args) {
-        // Lookup current state
-        auto source = getMachineState(fState);
-        // Lookup trigger action
-        auto action = getActionFor<Args...>(fState, trigger);
-        if (!action) {
-            if (fOnUnhandledTrigger) {
-                fOnUnhandledTrigger(fState, trigger);
+    void fire(Configuration &configuration, TriggerHandle trigger, Args...args) const {
+        assert(fCompiled);
+        // Appended to the lists of the configuration and removed afterwards, so callbacks firing on the configuration
+        // append theirs after them
+        auto &leaves = configuration.fLeaves;
+        auto &fired = configuration.fFired;
+        auto firstLeaf = leaves.size();
+        auto firstFired = fired.size();
+        collectLeaves(configuration, leaves);
+        auto lastLeaf = leaves.size();
+        for (auto i = firstLeaf; i != lastLeaf; i++) {
+            auto leaf = leaves[i];
+            if (!configuration.isActive(leaf)) {
+                continue;
             }
-            else {
-                assert(false);
+            auto entry = findAction<Args...>(leaf, trigger.fIndex);
+            if (entry == npos) {
+                continue;
+            }
+            auto &tableEntry = fTableEntries[entry];
+            auto action = tableEntry.fAction;
+            // Configurations don't keep deferred triggers
+            if (action->fKind == Action::Kind::Defer || std::find(fired.begin() + firstFired, fired.end(), action) != fired.end()) {
+                continue;
+            }
+            fired.push_back(action);
+            auto source = fStateList[leaf];
+            auto plan = tableEntry.fPlan;
+            switch (action->fKind) {
+                case Action::Kind::Ignore:
+                case Action::Kind::Defer:
+                    continue;
+                case Action::Kind::Internal: {
+                    std::tuple<Args&...> arguments(args...);
+                    action->fCallback(*this, &arguments);
+                    continue;
+                }
+                case Action::Kind::Transition:
+                    break;
+                case Action::Kind::Dynamic: {
+                    std::tuple<Args&...> arguments(args...);
+                    plan = findDynamicPlan(source, action->fCallback(*this, &arguments));
+                    break;
+                }
+            }
+            transition<Args...>(configuration, source, fPlans[plan], trigger.fIndex, args...);
+        }
+        auto handled = fired.size() != firstFired;
+        auto leaf = leaves[firstLeaf];
+        leaves.resize(firstLeaf);
+        fired.resize(firstFired);
+        if (!handled) {
+            unhandled(fStateList[leaf]->fState, fTriggerIndices.key(trigger.fIndex));
+        }
+    }
+
+    bool isInState(const Configuration &configuration, StateKey state) const {
+        auto index = fStateIndices.find(state);
+        return index != fStateIndices.npos && configuration.isActive(index);
+    }
+
+    bool isInState(const Configuration &configuration, StateHandle state) const {
+        return configuration.isActive(state.fIndex);
+    }
+
+    // Fires the trigger on every instance in the array, looking the trigger up once
+    template <typename ...Args>
+    void fireAll(Instance *instances, std::size_t count, TriggerKey trigger, Args...args) const {
+        auto index = fTriggerIndices.find(trigger);
+        if (index == fTriggerIndices.npos) {
+            for (std::size_t i = 0; i < count; i++) {
+                unhandled(instances[i], T(trigger));
             }
             return;
         }
-        // Check if it isn't an ignore or internal transition
-        if (!action->hasDestination()) {
-            // If it is an internal transition, call the action
-            action->call();
-            return; 
-        }
-        auto state = action->getDestination(args...);
-        auto destination = getMachineState(state);
-        // Call exit on old state, and get the highest state reachest when exiting
-        auto topLevelState = exit<Args...>(source, destination, trigger, source == destination, args...);
-        fState = destination->fState;
-        transitioned(source, destination, trigger);
-        // Call entry on new state
-        enter<Args...>(topLevelState, destination, trigger, false, args...);
+        fireAll<Args...>(instances, count, TriggerHandle{index}, args...);
     }
 
-    bool isInState(S state) {
-        if (fState == state) {
-            return true;
+    template <typename ...Args>
+    void fireAll(Instance *instances, std::size_t count, TriggerHandle trigger, Args...args) const {
+        for (std::size_t i = 0; i < count; i++) {
+            if constexpr (sizeof...(Args) == 0) {
+                fireDirect(instances[i], trigger);
+            }
+            else {
+                fire<Args...>(instances[i], trigger, args...);
+            }
         }
-        else {
-            auto currentState = getMachineState(fState);
-            while (currentState->fParentState) {
-                currentState = getMachineState(*currentState->fParentState);
-                if (!currentState) { return false; }
-                if (currentState->fState == state) {
-                    return true;
-                }
+    }
+
+    // Fires triggers[i] on instances[i] for every instance in the array
+    void fireAll(Instance *instances, const T *triggers, std::size_t count) const {
+        for (std::size_t i = 0; i < count; i++) {
+            auto index = fTriggerIndices.find(triggers[i]);
+            if (index == fTriggerIndices.npos) {
+                unhandled(instances[i], triggers[i]);
+            }
+            else {
+                fireDirect(instances[i], TriggerHandle{index});
             }
         }
-        return false;
     }
 
-    void onUnhandledTrigger(const std::function<void(S state, T trigger)> &callback) {
+    void fireAll(Instance *instances, const TriggerHandle *triggers, std::size_t count) const {
+        for (std::size_t i = 0; i < count; i++) {
+            fireDirect(instances[i], triggers[i]);
+        }
+    }
+
+    bool isInState(const Instance &instance, StateKey state) const {
+        auto index = fStateIndices.find(state);
+        return index != fStateIndices.npos && isInState(instance, StateHandle{index});
+    }
+
+    bool isInState(const Instance &instance, StateHandle state) const {
+        assert(fCompiled);
+        if (state.fIndex >= fStateList.size() || !fStateList[state.fIndex]) {
+            return false;
+        }
+        return fStateList[instance.fStateIndex]->isDescendantOf(fStateList[state.fIndex]);
+    }
+
+    template <typename F>
+    void onUnhandledTrigger(F callback) {
         fOnUnhandledTrigger = callback;
     }
 
-    void onTransitioned(const std::function<void(S source, S destination, T trigger)> &callback) {
+    template <typename F>
+    void onTransitioned(F callback) {
         fOnTransitioned = callback;
     }
 
-    void describe() {
-        std::cout << "Currently in " << fState;
-        auto currentState = getMachineState(fState);
-
+    void describe(const Instance &instance) const {
+        assert(fCompiled);
+        std::cout << "Currently in " << getState(instance);
         std::cout << ", possible triggers are:\n";
-        for (auto &pair : currentState->fTriggers) {
-            std::cout << "  " << pair.first << " to state " << (pair.second.first ? *pair.second.first : fState) << "\n";
+        for (std::size_t trigger = 0; trigger < fTriggerCount; trigger++) {
+            auto &cell = fTable[instance.fStateIndex * fTriggerCount + trigger];
+            for (auto j = cell.first; j != cell.second; j++) {
+                auto action = fTableEntries[j].fAction;
+                std::cout << "  " << fTriggerIndices.key(trigger);
+                if (action->fKind == Action::Kind::Transition) {
+                    std::cout << " to state " << action->fDestination->fState;
+                }
+                else if (action->fKind == Action::Kind::Defer) {
+                    std::cout << " deferred";
+                }
+                std::cout << "\n";
+            }
         }
-        while (currentState->fParentState) {
-            currentState = getMachineState(*currentState->fParentState);
+    }
+
+    // Writes the current state of the instance and its history to a versioned binary snapshot. Restoring it doesn't
+    // run any callback, and takes a definition configured the same way, on a machine with the same byte order.
+    template <std::size_t History>
+    void snapshot(const MachineInstance<S, History> &instance, std::ostream &stream) const {
+        snapshot(&instance, 1, stream);
+    }
+
+    // Writes an array of instances after a single header, the instances themselves in one write
+    template <std::size_t History>
+    void snapshot(const MachineInstance<S, History> *instances, std::size_t count, std::ostream &stream) const {
+        auto header = getSnapshotHeader<History>(count);
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        stream.write(reinterpret_cast<const char*>(instances), static_cast<std::streamsize>(count * sizeof(*instances)));
+    }
 
-            for (auto &pair : currentState->fTriggers) {
-                std::cout << "  " << pair.first << " to state " << (pair.second.first ? *pair.second.first : fState) << "\n";
+    // Returns false when the stream doesn't hold a snapshot of exactly this many instances which this definition
+    // can read. The instances may then be partly overwritten, and have to be restored again before firing them.
+    template <std::size_t History>
+    bool restore(MachineInstance<S, History> &instance, std::istream &stream) const {
+        return restore(&instance, 1, stream);
+    }
+
+    template <std::size_t History>
+    bool restore(MachineInstance<S, History> *instances, std::size_t count, std::istream &stream) const {
+        detail::SnapshotHeader header;
+        if (!stream.read(reinterpret_cast<char*>(&header), sizeof(header)) || !(header == getSnapshotHeader<History>(count))) {
+            return false;
+        }
+        return restoreInstances(instances, count, stream);
+    }
+
+    // Replaces the content of the vector with as many instances as the snapshot holds
+    template <std::size_t History>
+    bool restore(std::vector<MachineInstance<S, History>> &instances, std::istream &stream) const {
+        detail::SnapshotHeader header;
+        if (!stream.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            return false;
+        }
+        auto count = static_cast<std::size_t>(header.fCount);
+        if (count != header.fCount || !(header == getSnapshotHeader<History>(count))) {
+            return false;
+        }
+        // The count comes from the stream, so the vector grows as instances are read instead of being sized for it
+        constexpr std::size_t Batch = 4096;
+        instances.clear();
+        for (std::size_t read = 0; read < count;) {
+            auto batch = std::min(Batch, count - read);
+            instances.resize(read + batch, MachineInstance<S, History>(0));
+            if (!restoreInstances(instances.data() + read, batch, stream)) {
+                return false;
             }
+            read += batch;
         }
+        return true;
+    }
+
+protected:
+    using TimeoutCallback = detail::InlineFunction<void(Instance &instance, StateHandle state, const std::vector<Timeout> &timeouts, bool entered)>;
+
+    // Called when a state with timeouts is entered or exited, to arm or cancel its timers
+    template <typename F>
+    void onTimeoutState(F callback) {
+        fOnTimeoutState = callback;
+    }
+
+    // Calls the timeout callback for the current state and its ancestors, outermost first, as if they had just been
+    // entered. For states which became active without being entered: the initial state, or a restored one.
+    void enterTimeouts(Instance &instance) const {
+        assert(fCompiled);
+        enterTimeouts(instance, fStateList[instance.fStateIndex]);
+    }
+
+    void compile() {
+        if (!fCompiled) {
+            rebuild();
+        }
+    }
+
+    // Fires like fire, unless the current state defers the trigger, in which case nothing happens and it returns false
+    template <typename ...Args, std::size_t History>
+    bool fireUnlessDeferred(MachineInstance<S, History> &instance, TriggerHandle trigger, Args &...args) const {
+        NoInstrumentation observer;
+        return fireObserved<Args...>(instance, trigger, observer, args...);
+    }
+
+    // Like fireUnlessDeferred, running entry and exit callbacks through the instrumentation policy observer
+    template <typename ...Args, std::size_t History, typename Observer>
+    bool fireObserved(MachineInstance<S, History> &instance, TriggerHandle trigger, Observer &observer, Args &...args) const {
+        // Lookup current state
+        auto source = fStateList[instance.fStateIndex];
+        // Lookup trigger action
+        auto entry = findAction<Args...>(instance, trigger.fIndex);
+        if (entry == npos) {
+            unhandled(instance, fTriggerIndices.key(trigger.fIndex));
+            return true;
+        }
+        auto &tableEntry = fTableEntries[entry];
+        auto action = tableEntry.fAction;
+        auto plan = tableEntry.fPlan;
+        switch (action->fKind) {
+            case Action::Kind::Ignore:
+                return true;
+            case Action::Kind::Defer:
+                return false;
+            case Action::Kind::Internal: {
+                std::tuple<Args&...> arguments(args...);
+                action->fCallback(*this, &arguments);
+                return true;
+            }
+            case Action::Kind::Transition:
+                break;
+            case Action::Kind::Dynamic: {
+                std::tuple<Args&...> arguments(args...);
+                plan = findDynamicPlan(source, action->fCallback(*this, &arguments));
+                break;
+            }
+        }
+        transition<Args...>(instance, source, fPlans[plan], trigger.fIndex, observer, args...);
+        return true;
+    }
+
+    // Whether the current state may defer the trigger, through any of its actions or those of its ancestors
+    bool defers(const Instance &instance, std::size_t trigger) const {
+        assert(fCompiled);
+        return (fDeferMasks[instance.fStateIndex * fDeferWords + trigger / 64] >> (trigger % 64)) & 1;
+    }
+
+    // Whether the current state doesn't defer some of the triggers, a bit mask of trigger indices
+    bool recallsAny(const Instance &instance, const std::vector<std::uint64_t> &triggers) const {
+        assert(fCompiled && triggers.size() <= fDeferWords);
+        auto mask = &fDeferMasks[instance.fStateIndex * fDeferWords];
+        for (std::size_t i = 0; i < triggers.size(); i++) {
+            if (triggers[i] & ~mask[i]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The number of words of a bit mask of trigger indices
+    std::size_t getDeferWords() const {
+        return fDeferWords;
+    }
+
+    template <std::size_t History>
+    static std::size_t getStateIndex(const MachineInstance<S, History> &instance) {
+        return static_cast<std::size_t>(instance.fStateIndex);
+    }
+
+    // The key of a state index, nullptr for enum states which weren't configured
+    const S *findStateKey(std::size_t index) const {
+        return index < fStateList.size() && fStateList[index] ? &fStateList[index]->fState : nullptr;
+    }
+
+    T getTriggerKey(std::size_t index) const {
+        return fTriggerIndices.key(index);
     }
 
 private:
+    friend class detail::ImageWriter;
+
+    using Action = typename MachineState::Action;
+
+    static constexpr std::size_t npos = -1;
+
+    // A candidate action for a (state, trigger) pair, with the plan of its transition from that state.
+    // Dynamic transitions have no plan here, theirs are found in fDynamicPlans.
+    struct TableEntry {
+        Action          *fAction;
+        std::size_t     fPlan;
+    };
+
+    // Values of fDirect which are not a state index
+    static constexpr std::size_t indirect = npos;       // Needs a full fire
+    static constexpr std::size_t unchanged = npos - 1;  // Ignored without side effects
+    static constexpr std::size_t refused = npos - 2;    // Needs more than a state change, can't be fired concurrently
+
+    // The states exited and entered by a transition between two states, as ranges into fPlanStates
+    struct Plan {
+        std::size_t     fExitBegin;
+        std::size_t     fEntryBegin;
+        std::size_t     fInitialBegin; // Entered states from here on are reached through initial transitions
+        std::size_t     fEntryEnd;
+        MachineState    *fDestination;
+        bool            fHistory; // Whether the destination or its initial substates have history
+    };
+
     MachineState *getCachedMachineState(S state) {
-        auto i = fStates.find(state);
-        if (fStates.end() != i) {
-            return i->second.get();
+        auto index = fStateIndices.insert(state);
+        if (auto machineState = fStates.find(index)) {
+            return machineState;
         }
-        auto pair = fStates.insert_or_assign(state, std::make_unique<MachineState>(*this, state));
-        return pair.first->second.get();
+        invalidate();
+        auto machineState = &fStates.emplace(index, *this, state, index);
+        if (index >= fStateList.size()) {
+            fStateList.resize(index + 1);
+        }
+        fStateList[index] = machineState;
+        return machineState;
     }
 
-    MachineState *getMachineState(S state) {
-        assert(fStates.count(state));
-        return getCachedMachineState(state);
+    MachineState *getMachineState(StateKey state) const {
+        auto index = fStateIndices.find(state);
+        assert(index != fStateIndices.npos && fStateList[index]);
+        return fStateList[index];
     }
 
-    template <typename ...Args>
-    typename MachineState::template TriggerAction<Args...> *getActionFor(S state, T trigger) {
-        auto currentState = getMachineState(state);
-        auto destination = currentState->template getActionFor<Args...>(trigger);
-        return destination;
+    template <std::size_t History>
+    detail::SnapshotHeader getSnapshotHeader(std::size_t count) const {
+        using Index = typename Instance::Index;
+        // Instances are written as is, which is their state index followed by their history slots
+        static_assert(std::is_trivially_copyable_v<MachineInstance<S, History>>);
+        static_assert(sizeof(MachineInstance<S, History>) == (History + 1) * sizeof(Index));
+        static_assert(History <= std::numeric_limits<std::uint8_t>::max());
+        detail::SnapshotHeader header;
+        header.fIndexSize = sizeof(Index);
+        header.fHistory = History;
+        header.fStateCount = static_cast<std::uint32_t>(fStateList.size());
+        header.fHistoryCount = static_cast<std::uint32_t>(fHistoryCount);
+        header.fCount = count;
+        return header;
     }
 
-    void enter(MachineState *src, MachineState*dst, T trigger, bool initialTransition) {
-        if (!initialTransition) {
-            // Check if we need to enter the parent state first
-            if (dst->fParentState) {
-                // Since src has a parent state, it might be that dst is a descendant of src
-                /*
-                       parent          
-                         |
-                        src
-                         |
-                         *
-                         |
-                        dst
-                */
-                if (!src->isDescendantOf(*dst->fParentState)) {
-                    enter(src, getMachineState(*dst->fParentState), trigger, false);
+    // Reads the instances following a header in one read, then checks that they index configured states
+    template <std::size_t History>
+    bool restoreInstances(MachineInstance<S, History> *instances, std::size_t count, std::istream &stream) const {
+        if (!stream.read(reinterpret_cast<char*>(instances), static_cast<std::streamsize>(count * sizeof(*instances)))) {
+            return false;
+        }
+        auto configured = [this](std::size_t index) {
+            return index < fStateList.size() && fStateList[index];
+        };
+        for (std::size_t i = 0; i < count; i++) {
+            if (!configured(static_cast<std::size_t>(instances[i].fStateIndex))) {
+                return false;
+            }
+            if constexpr (History > 0) {
+                for (auto recorded : instances[i].fHistory) {
+                    if (recorded != 0 && !configured(static_cast<std::size_t>(recorded) - 1)) {
+                        return false;
+                    }
                 }
             }
         }
-        if (dst->fOnEntry) {
-            dst->fOnEntry();
+        return true;
+    }
+
+    // Marks the compiled table as stale after a configuration change
+    void invalidate() {
+        assert(!fFrozen);
+        fCompiled = false;
+    }
+
+    // Builds the numbering, the table and the transition plans from the configuration
+    void rebuild() {
+        fCompiled = true;
+        number();
+        fTriggerCount = fTriggerIndices.size();
+        fTable.assign(fStateList.size() * fTriggerCount, {0, 0});
+        fDirect.assign(fStateList.size() * fTriggerCount, indirect);
+        fDeferWords = (fTriggerCount + 63) / 64;
+        fDeferMasks.assign(fStateList.size() * fDeferWords, 0);
+        fTableEntries.clear();
+        fPlans.clear();
+        fPlanStates.clear();
+        fPlanCache.clear();
+        fDynamicPlans.clear();
+        std::vector<Action*> actions;
+        for (auto state : fStateList) {
+            if (!state) {
+                continue;
+            }
+            bool dynamic = false;
+            for (std::size_t trigger = 0; trigger < fTriggerCount; trigger++) {
+                auto &cell = fTable[state->fIndex * fTriggerCount + trigger];
+                actions.clear();
+                state->collectActionsFor(trigger, actions);
+                cell.first = fTableEntries.size();
+                for (auto action : actions) {
+                    // Plan static transitions from this state ahead of time
+                    fTableEntries.push_back({action, action->fKind == Action::Kind::Transition ? getPlan(state, action->fDestination) : npos});
+                    dynamic |= action->fKind == Action::Kind::Dynamic;
+                    if (action->fKind == Action::Kind::Defer) {
+                        fDeferMasks[state->fIndex * fDeferWords + trigger / 64] |= std::uint64_t(1) << (trigger % 64);
+                    }
+                }
+                cell.second = fTableEntries.size();
+                fDirect[state->fIndex * fTriggerCount + trigger] = getDirect(cell);
+            }
+            // A dynamic transition can go anywhere, plan them all so fire never has to modify the definition
+            if (dynamic) {
+                state->fDynamicPlans = fDynamicPlans.size();
+                for (auto destination : fStateList) {
+                    fDynamicPlans.push_back(destination ? getPlan(state, destination) : npos);
+                }
+            }
+        }
+    }
+
+    // A cell is direct when firing it without arguments can only change the state, then fDirect holds the new state.
+    // That is when its first action is unconditional, and either an ignore or a transition without callbacks.
+    std::size_t getDirect(const std::pair<std::size_t, std::size_t> &cell) {
+        if (cell.first == cell.second) {
+            return indirect;
+        }
+        auto &entry = fTableEntries[cell.first];
+        auto action = entry.fAction;
+        if (action->fPredicate || action->fSignature != detail::signature<>()) {
+            return indirect;
         }
-        if (/*src == dst &&*/ dst->fInitialState) {
-            fState = *dst->fInitialState;
-            auto currentState = getMachineState(fState);
-            assert(currentState->fParentState == dst->fState);
-            enter(dst, currentState, trigger, true);
+        if (action->fKind == Action::Kind::Ignore) {
+            return unchanged;
+        }
+        if (action->fKind != Action::Kind::Transition) {
+            return indirect;
+        }
+        auto &plan = fPlans[entry.fPlan];
+        for (auto i = plan.fExitBegin; i != plan.fEntryEnd; i++) {
+            if (fPlanStates[i]->hasCallbacks()) {
+                return indirect;
+            }
         }
+        return fPlanStates[plan.fEntryEnd - 1]->fIndex;
     }
 
+    // Numbers all states in depth first order of the hierarchy, which makes isDescendantOf two comparisons
+    void number() {
+        std::vector<std::vector<MachineState*>> children(fStateList.size());
+        std::vector<MachineState*> roots;
+        for (auto state : fStateList) {
+            if (state) {
+                (state->fParent ? children[state->fParent->fIndex] : roots).push_back(state);
+            }
+        }
+        std::size_t order = 0;
+        fPreOrder.assign(2 * fStateList.size(), nullptr);
+        for (auto root : roots) {
+            number(root, children, order);
+        }
+    }
+
+    void number(MachineState *state, const std::vector<std::vector<MachineState*>> &children, std::size_t &order) {
+        state->fPre = order++;
+        state->fChildren = children[state->fIndex];
+        fPreOrder[state->fPre] = state;
+        for (auto child : children[state->fIndex]) {
+            number(child, children, order);
+        }
+        state->fPost = order++;
+    }
+
+    // Finds the first valid action for the trigger in the current state, a single table lookup regardless of depth
+    // Returns the index of the entry in fTableEntries, or npos when there is none or the first valid action was
+    // configured with different argument types
     template <typename ...Args>
-    void enter(MachineState *src, MachineState*dst, T trigger, bool initialTransition, Args...args) {
-        if (!initialTransition) {
-            // Check if we need to enter the parent state first
-            if (dst->fParentState) {
-                // Since src has a parent state, it might be that dst is a descendant of src
-                /*
-                       parent          
-                         |
-                        src
-                         |
-                         *
-                         |
-                        dst
-                */
-                if (!src->isDescendantOf(*dst->fParentState)) {
-                    enter<Args...>(src, getMachineState(*dst->fParentState), trigger, false, args...);
+    std::size_t findAction(const Instance &instance, std::size_t trigger) const {
+        return findAction<Args...>(instance.fStateIndex, trigger);
+    }
+
+    template <typename ...Args>
+    std::size_t findAction(std::size_t state, std::size_t trigger) const {
+        assert(fCompiled);
+        auto &cell = fTable[state * fTriggerCount + trigger];
+        for (auto j = cell.first; j != cell.second; j++) {
+            auto action = fTableEntries[j].fAction;
+            if (action->isValid()) {
+                return action->fSignature == detail::signature<Args...>() ? j : npos;
+            }
+        }
+        return npos;
+    }
+
+    // Fires a trigger without arguments, through fDirect when nothing can observe it
+    void fireDirect(Instance &instance, TriggerHandle trigger) const {
+        assert(fCompiled);
+        auto next = fOnTransitioned ? indirect : fDirect[instance.fStateIndex * fTriggerCount + trigger.fIndex];
+        if (next < unchanged) {
+            instance.setState(next);
+        }
+        else if (next == indirect) {
+            fire(instance, trigger);
+        }
+    }
+
+    // The state a concurrent fire leads to when the cell isn't direct, unchanged for an ignore, indirect when unhandled,
+    // or refused for internal actions, dynamic destinations and transitions with callbacks.
+    // A concurrent instance has nowhere to keep deferred triggers, like other instances they are unhandled.
+    std::size_t getConcurrentTransition(const Instance &instance, TriggerHandle trigger) const {
+        auto entry = findAction(instance, trigger.fIndex);
+        if (entry == npos) {
+            return indirect;
+        }
+        auto &tableEntry = fTableEntries[entry];
+        if (tableEntry.fAction->fKind == Action::Kind::Ignore) {
+            return unchanged;
+        }
+        if (tableEntry.fAction->fKind == Action::Kind::Defer) {
+            return indirect;
+        }
+        if (tableEntry.fAction->fKind != Action::Kind::Transition) {
+            return refused;
+        }
+        auto &plan = fPlans[tableEntry.fPlan];
+        for (auto i = plan.fExitBegin; i != plan.fEntryEnd; i++) {
+            if (fPlanStates[i]->hasCallbacks()) {
+                return refused;
+            }
+        }
+        return fPlanStates[plan.fEntryEnd - 1]->fIndex;
+    }
+
+    void unhandled(const Instance &instance, const T &trigger) const {
+        unhandled(getState(instance), trigger);
+    }
+
+    void unhandled(const S &state, const T &trigger) const {
+        if (fOnUnhandledTrigger) {
+            fOnUnhandledTrigger(state, trigger);
+        }
+        else {
+            assert(false);
+        }
+    }
+
+    // Runs the entry callbacks of the state through the observer, when it has some
+    template <typename ...Args, typename Observer>
+    static void callEntry(const MachineState *state, std::size_t trigger, Observer &observer, Args &...args) {
+        if (state->fOnEntry || !state->fOnEntryWithParameters.empty()) {
+            observer.entered(state->fIndex, [&](){ state->template callOnEntry<Args...>(trigger, args...); });
+        }
+    }
+
+    template <typename ...Args, typename Observer>
+    static void callExit(const MachineState *state, std::size_t trigger, Observer &observer, Args &...args) {
+        if (state->fOnExit || !state->fOnExitWithParameters.empty()) {
+            observer.exited(state->fIndex, [&](){ state->template callOnExit<Args...>(trigger, args...); });
+        }
+    }
+
+    // Runs a planned transition: exit callbacks, the state change, then entry callbacks
+    template <typename ...Args, std::size_t History, typename Observer>
+    void transition(MachineInstance<S, History> &instance, MachineState *source, Plan plan, std::size_t trigger, Observer &observer, Args &...args) const {
+        for (auto i = plan.fExitBegin; i != plan.fEntryBegin; i++) {
+            callExit<Args...>(fPlanStates[i], trigger, observer, args...);
+            timeouts(instance, fPlanStates[i], false);
+            if constexpr (History > 0) {
+                // The state left is the first one exited, and the direct substate the one exited before
+                auto state = fPlanStates[i];
+                if (state->fHistory != MachineState::History::None && state->fHistorySlot < History && i != plan.fExitBegin) {
+                    auto substate = fPlanStates[state->fHistory == MachineState::History::Deep ? plan.fExitBegin : i - 1];
+                    instance.fHistory[state->fHistorySlot] = static_cast<typename Instance::Index>(substate->fIndex + 1);
                 }
             }
         }
-        dst->template callOnEntry<Args...>(trigger, args...);
-        if (/*src == dst &&*/ dst->fInitialState) {
-            fState = *dst->fInitialState;
-            auto currentState = getMachineState(fState);
-            assert(currentState->fParentState == dst->fState);
-            enter<Args...>(dst, currentState, trigger, true, args...);
+        instance.setState(plan.fDestination->fIndex);
+        transitioned(source, plan.fDestination, trigger);
+        // With history, the substates entered by default depend on the instance and can't be planned
+        auto end = History > 0 && plan.fHistory ? plan.fInitialBegin : plan.fEntryEnd;
+        for (auto i = plan.fEntryBegin; i != end; i++) {
+            // States reached through initial transitions become the current state before they are entered
+            if (i >= plan.fInitialBegin) {
+                instance.setState(fPlanStates[i]->fIndex);
+            }
+            callEntry<Args...>(fPlanStates[i], trigger, observer, args...);
+            timeouts(instance, fPlanStates[i], true);
+        }
+        if constexpr (History > 0) {
+            if (plan.fHistory) {
+                enterSubstates<Args...>(instance, plan.fDestination, trigger, observer, args...);
+            }
         }
     }
 
-    MachineState *exit(MachineState *src, MachineState *dst, bool reentry) {
-        // If dst is a descendant of src (or equal to src), there is no reason to exit the state
-        if (!reentry && dst->isDescendantOf(src->fState)) {
-            /*
-                    src
-                     |
-                     *
-                     |
-                    dst
-            */
-            return src;
-        }
-        if (src->fOnExit) { 
-            src->fOnExit();
-        }
-        // Check if we need to exit the parent state
-        if (src->fParentState) {
-            // If dst also has a parent state, it might have a common ancestor, which should not be exited
-            if (dst->fParentState) {
-                // If the destination is not a descendant of the parent of the source, exit the parent and travel up the graph
-                if (dst->isDescendantOf(*src->fParentState)) {
-                    /*
-                            parent   
-                               /\    
-                              /  *   
-                             /    \  
-                            src   dst                
-                    */
-                    return getMachineState(*src->fParentState);
+    // Enters the substates of a state entered by default: those recorded by its history, or its initial transition
+    template <typename ...Args, std::size_t History, typename Observer>
+    void enterSubstates(MachineInstance<S, History> &instance, MachineState *state, std::size_t trigger, Observer &observer, Args &...args) const {
+        for (;;) {
+            auto next = state->fInitial;
+            if (state->fHistory != MachineState::History::None && state->fHistorySlot < History && instance.fHistory[state->fHistorySlot]) {
+                auto recorded = fStateList[static_cast<std::size_t>(instance.fHistory[state->fHistorySlot]) - 1];
+                if (state->fHistory == MachineState::History::Deep) {
+                    enterDown<Args...>(instance, state, recorded, trigger, observer, args...);
+                    return;
                 }
-                else {
-                    /*
-                           ancestor           ancestor  ancestor
-                             /  \                 |        |
-                         parent  \             parent      |
-                           /      \               |        |
-                         src      dst            src      dst
-                    */
-                    return exit(getMachineState(*src->fParentState), dst, false);
+                next = recorded;
+            }
+            if (!next) {
+                return;
+            }
+            instance.setState(next->fIndex);
+            callEntry<Args...>(next, trigger, observer, args...);
+            timeouts(instance, next, true);
+            state = next;
+        }
+    }
+
+    // Enters the states from below ancestor down to state, outermost first
+    template <typename ...Args, std::size_t History, typename Observer>
+    void enterDown(MachineInstance<S, History> &instance, const MachineState *ancestor, MachineState *state, std::size_t trigger, Observer &observer, Args &...args) const {
+        if (state->fParent != ancestor) {
+            enterDown<Args...>(instance, ancestor, state->fParent, trigger, observer, args...);
+        }
+        instance.setState(state->fIndex);
+        callEntry<Args...>(state, trigger, observer, args...);
+        timeouts(instance, state, true);
+    }
+
+    // Runs a planned transition on a configuration. Every active state below the highest state exited is exited,
+    // innermost first, which includes the other regions of an orthogonal state being left. After the planned states
+    // are entered, the regions of the orthogonal states among them are entered in their initial substates.
+    template <typename ...Args>
+    void transition(Configuration &configuration, MachineState *source, Plan plan, std::size_t trigger, Args &...args) const {
+        // The highest state exited, with the active states below it. A leaf moving into its own substate exits
+        // nothing and stays active, only the states below it would be exited.
+        auto exits = plan.fExitBegin != plan.fEntryBegin;
+        auto top = exits ? fPlanStates[plan.fEntryBegin - 1] : source;
+        auto first = exits ? top->fPre : top->fPre + 1;
+        for (auto i = top->fPost; i-- > first;) {
+            auto state = fPreOrder[i];
+            if (state && configuration.isActive(state->fIndex)) {
+                state->template callOnExit<Args...>(trigger, args...);
+                configuration.setActive(state->fIndex, false);
+            }
+        }
+        transitioned(source, plan.fDestination, trigger);
+        for (auto i = plan.fEntryBegin; i != plan.fEntryEnd; i++) {
+            configuration.setActive(fPlanStates[i]->fIndex, true);
+            fPlanStates[i]->template callOnEntry<Args...>(trigger, args...);
+        }
+        auto entered = [&](MachineState *state) {
+            state->template callOnEntry<Args...>(trigger, args...);
+        };
+        for (auto i = plan.fEntryBegin; i != plan.fEntryEnd; i++) {
+            enterRegions(configuration, fPlanStates[i], entered);
+        }
+    }
+
+    // Enters the regions of an orthogonal state which aren't active, calling entered for each state entered
+    template <typename F>
+    void enterRegions(Configuration &configuration, const MachineState *state, F &entered) const {
+        if (!state->fOrthogonal) {
+            return;
+        }
+        for (auto region : state->fChildren) {
+            if (!configuration.isActive(region->fIndex)) {
+                enterDefault(configuration, region, entered);
+            }
+        }
+    }
+
+    // Enters the state and, in turn, its regions or its initial substate
+    template <typename F>
+    void enterDefault(Configuration &configuration, MachineState *state, F &entered) const {
+        configuration.setActive(state->fIndex, true);
+        entered(state);
+        if (state->fOrthogonal) {
+            enterRegions(configuration, state, entered);
+        }
+        else if (state->fInitial) {
+            enterDefault(configuration, state->fInitial, entered);
+        }
+    }
+
+    // Appends the active states which have no active substate, in order of state index
+    void collectLeaves(const Configuration &configuration, std::vector<std::size_t> &leaves) const {
+        auto first = leaves.size();
+        for (std::size_t word = 0; word < configuration.fActive.size(); word++) {
+            for (auto bits = configuration.fActive[word]; bits; bits &= bits - 1) {
+                auto index = word * 64 + detail::lowestBit(bits);
+                auto &children = fStateList[index]->fChildren;
+                if (std::none_of(children.begin(), children.end(), [&configuration](const MachineState *child){ return configuration.isActive(child->fIndex); })) {
+                    leaves.push_back(index);
                 }
             }
-            else {
-                // The destination is a top state, just exit the parent and travel up the graph
+        }
+        assert(leaves.size() != first);
+        (void)first;
+    }
+
+    void timeouts(Instance &instance, const MachineState *state, bool entered) const {
+        if (!state->fTimeouts.empty() && fOnTimeoutState) {
+            fOnTimeoutState(instance, StateHandle{state->fIndex}, state->fTimeouts, entered);
+        }
+    }
+
+    void enterTimeouts(Instance &instance, const MachineState *state) const {
+        if (state->fParent) {
+            enterTimeouts(instance, state->fParent);
+        }
+        timeouts(instance, state, true);
+    }
+
+    // Returns the index of the plan of a dynamic transition, all of which are planned by rebuild
+    std::size_t findDynamicPlan(MachineState *src, MachineState *dst) const {
+        return fDynamicPlans[src->fDynamicPlans + dst->fIndex];
+    }
+
+    // Returns the index of the plan for a transition between two states, planning it on first use
+    std::size_t getPlan(MachineState *src, MachineState *dst) {
+        auto key = src->fIndex * fStateList.size() + dst->fIndex;
+        auto i = fPlanCache.find(key);
+        if (fPlanCache.end() != i) {
+            return i->second;
+        }
+        Plan plan;
+        plan.fDestination = dst;
+        plan.fExitBegin = fPlanStates.size();
+        // Call exit on old state, and get the highest state reached when exiting
+        auto topLevelState = planExit(src, dst, src == dst);
+        plan.fEntryBegin = fPlanStates.size();
+        // Call entry on new state
+        planEnter(topLevelState, dst);
+        plan.fInitialBegin = fPlanStates.size();
+        planInitialTransitions(dst);
+        plan.fEntryEnd = fPlanStates.size();
+        plan.fHistory = std::any_of(fPlanStates.begin() + plan.fInitialBegin - 1, fPlanStates.end(), [](const MachineState *state){
+            return state->fHistory != MachineState::History::None;
+        });
+        fPlans.push_back(plan);
+        fPlanCache.insert({key, fPlans.size() - 1});
+        return fPlans.size() - 1;
+    }
+
+    // Appends the states to exit, innermost first, and returns the highest state reached
+    MachineState *planExit(MachineState *src, MachineState *dst, bool reentry) {
+        for (auto state = src; ; state = state->fParent, reentry = false) {
+            // If dst is a descendant of state (or equal to state), there is no reason to exit the state
+            if (!reentry && dst->isDescendantOf(state)) {
+                /*
+                        src          parent
+                         |             /\
+                         *            /  *
+                         |           /    \
+                        dst        src    dst
+                */
+                return state;
+            }
+            fPlanStates.push_back(state);
+            // If we come here without parent, the destination is in another tree or a top state
+            if (!state->fParent) {
                 /*
-                       ancestor   dst         
-                          |              
-                        parent               
-                          |                   
-                         src                
+                     src  dst       src   ancestor
+                                             |
+                                            dst
                 */
-                return exit(getMachineState(*src->fParentState), dst, false);
+                return state;
             }
+            // Otherwise exit the parent and travel up the graph
+            /*
+                   ancestor           ancestor  ancestor
+                     /  \                 |        |
+                 parent  \             parent      |
+                   /      \               |        |
+                 src      dst            src      dst
+            */
         }
-        // If we come here, src has no parent
+    }
+
+    // Appends the states to enter, outermost first, ending with dst
+    void planEnter(MachineState *src, MachineState *dst) {
+        auto first = fPlanStates.size();
+        // Parents which src isn't in need to be entered first
         /*
-             src  dst       src   ancestor
-                                     |
-                                    dst          
+               parent
+                 |
+                src
+                 |
+                 *
+                 |
+                dst
         */
-        return src;
+        for (auto state = dst; state->fParent && !src->isDescendantOf(state->fParent); state = state->fParent) {
+            fPlanStates.push_back(state->fParent);
+        }
+        std::reverse(fPlanStates.begin() + first, fPlanStates.end());
+        fPlanStates.push_back(dst);
+    }
+
+    // Appends the chain of initial substates of dst
+    void planInitialTransitions(MachineState *dst) {
+        for (auto state = dst; state->fInitial; state = state->fInitial) {
+            assert(state->fInitial->fParent == state);
+            fPlanStates.push_back(state->fInitial);
+        }
+    }
+
+    void transitioned(MachineState *from, MachineState *to, std::size_t trigger) const {
+        if (fOnTransitioned) {
+            fOnTransitioned(from->fState, to->fState, fTriggerIndices.key(trigger));
+        }
+    }
+
+    detail::KeyIndex<S>                                     fStateIndices;
+    detail::KeyIndex<T>                                     fTriggerIndices;
+    detail::IndexedStorage<S, MachineState>                 fStates;
+    std::vector<MachineState*>                              fStateList;
+    std::vector<MachineState*>                              fPreOrder; // States by fPre, nullptr at fPost numbers
+    std::size_t                                             fTriggerCount = 0;
+    std::vector<std::pair<std::size_t, std::size_t>>        fTable; // Range into fTableEntries for each (state, trigger)
+    std::vector<TableEntry>                                 fTableEntries;
+    std::vector<std::size_t>                                fDirect; // State after each (state, trigger) when it is direct
+    std::vector<Plan>                                       fPlans;
+    std::vector<MachineState*>                              fPlanStates; // States exited and entered by plans
+    std::unordered_map<std::size_t, std::size_t>            fPlanCache; // Plan for each (source, destination)
+    std::vector<std::size_t>                                fDynamicPlans; // Plan to every state, for each source of dynamic transitions
+    std::size_t                                             fDeferWords = 0;
+    std::size_t                                             fHistoryCount = 0; // States with history, each has a slot in instances
+    std::vector<std::uint64_t>                              fDeferMasks; // Triggers each state may defer, fDeferWords per state
+    bool                                                    fCompiled = false;
+    bool                                                    fFrozen = false;
+    detail::InlineFunction<void(S state, T trigger)>                    fOnUnhandledTrigger;
+    detail::InlineFunction<void(S source, S destination, T trigger)>    fOnTransitioned;
+    TimeoutCallback                                                     fOnTimeoutState;
+};
+
+// A definition with a single instance of its own, configured and fired in one place. The instrumentation policy
+// is told about every trigger fired and wraps entry and exit callbacks, the default one compiles to nothing.
+template <typename S, typename T, typename Instrumentation = NoInstrumentation>
+class Machine : public MachineDefinition<S, T> {
+public:
+    using Definition = MachineDefinition<S, T>;
+    using typename Definition::StateKey;
+    using typename Definition::TriggerKey;
+    using typename Definition::StateHandle;
+    using typename Definition::TriggerHandle;
+
+    Machine(S initialState) :
+    fInstance(Definition::template createInstance<MACHINE_HISTORY_CAPACITY>(initialState)) {
+
+    }
+
+    // Like its definition, a machine can't be copied or moved
+    Machine(const Machine &) = delete;
+    Machine &operator=(const Machine &) = delete;
+
+    // Freezes the definition. Returns false when more states have history than MACHINE_HISTORY_CAPACITY, the states
+    // configured last then take their initial transition every time.
+    bool freeze() {
+        Definition::freeze();
+        return Definition::getHistoryCount() <= MACHINE_HISTORY_CAPACITY;
+    }
+
+    const S &getState() {
+        return Definition::getState(fInstance);
+    }
+
+    bool canFire(TriggerKey trigger) {
+        Definition::compile();
+        return Definition::canFire(fInstance, trigger);
+    }
+
+    bool canFire(TriggerHandle trigger) {
+        Definition::compile();
+        return Definition::canFire(fInstance, trigger);
     }
 
+    // Triggers fired by callbacks while the machine is firing are queued, and fired once the current transition
+    // has completed. The trigger and a copy of the arguments are stored inline in the queue.
     template <typename ...Args>
-    MachineState *exit(MachineState *src, MachineState *dst, T trigger, bool reentry, Args...args) {
-        // If dst is a descendant of src (or equal to src), there is no reason to exit the state
-        if (!reentry && dst->isDescendantOf(src->fState)) {
-            /*
-                    src
-                     |
-                     *
-                     |
-                    dst
-            */
-            return src;
-        }
-        src->template callOnExit<Args...>(trigger, args...);
-        // Check if we need to exit the parent state
-        if (src->fParentState) {
-            // If dst also has a parent state, it might have a common ancestor, which should not be exited
-            if (dst->fParentState) {
-                // If the destination is not a descendant of the parent of the source, exit the parent and travel up the graph
-                if (dst->isDescendantOf(*src->fParentState)) {
-                    /*
-                            parent   
-                               /\    
-                              /  *   
-                             /    \  
-                            src   dst                
-                    */
-                    return getMachineState(*src->fParentState);
+    void fire(TriggerKey trigger, Args...args) {
+        Definition::compile();
+        if (auto handle = Definition::findTrigger(trigger)) {
+            fire<Args...>(*handle, args...);
+            return;
+        }
+        // Reports the unhandled trigger right away
+        Definition::template fire<Args...>(fInstance, trigger, args...);
+    }
+
+    template <typename ...Args>
+    void fire(TriggerHandle trigger, Args...args) {
+        Definition::compile();
+        if (fFiring) {
+            enqueue<Args...>(trigger, args...);
+            return;
+        }
+        run<Args...>(trigger, args...);
+    }
+
+    bool isInState(StateKey state) {
+        Definition::compile();
+        return Definition::isInState(fInstance, state);
+    }
+
+    bool isInState(StateHandle state) {
+        Definition::compile();
+        return Definition::isInState(fInstance, state);
+    }
+
+    void describe() {
+        Definition::compile();
+        Definition::describe(fInstance);
+    }
+
+    // Triggers deferred by the current state, or by states since left which are about to fire them again
+    std::size_t getDeferredCount() const {
+        return fDeferred.size();
+    }
+
+    // Writes the current state, its history and the deferred triggers, see MachineDefinition::snapshot. The arguments
+    // of deferred triggers can't be written, so nothing is written and it returns false when any of them has some.
+    bool snapshot(std::ostream &stream) {
+        assert(!fFiring);
+        Definition::compile();
+        std::vector<std::uint32_t> triggers;
+        triggers.reserve(fDeferred.size());
+        for (auto &deferred : fDeferred) {
+            if (deferred.fArguments) {
+                return false;
+            }
+            triggers.push_back(static_cast<std::uint32_t>(deferred.fTrigger));
+        }
+        Definition::snapshot(fInstance, stream);
+        auto count = static_cast<std::uint32_t>(triggers.size());
+        stream.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        stream.write(reinterpret_cast<const char*>(triggers.data()), static_cast<std::streamsize>(count * sizeof(count)));
+        return static_cast<bool>(stream);
+    }
+
+    // Goes back to a snapshot without running any callback, the triggers deferred then are deferred again.
+    // Returns false, leaving the machine as it was, when the snapshot can't be read.
+    bool restore(std::istream &stream) {
+        assert(!fFiring);
+        Definition::compile();
+        auto instance = fInstance;
+        std::uint32_t count = 0;
+        if (!Definition::restore(instance, stream) || !stream.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+            return false;
+        }
+        // A trigger can be deferred more than once, so the count can exceed the trigger count. Reading them one at a
+        // time, a corrupted count runs out of stream instead of allocating for it.
+        std::vector<std::uint32_t> triggers;
+        triggers.reserve(std::min<std::size_t>(count, Definition::getTriggerCount()));
+        for (std::uint32_t i = 0; i < count; i++) {
+            std::uint32_t trigger = 0;
+            if (!stream.read(reinterpret_cast<char*>(&trigger), sizeof(trigger)) || trigger >= Definition::getTriggerCount()) {
+                return false;
+            }
+            triggers.push_back(trigger);
+        }
+        fInstance = instance;
+        fDeferred.clear();
+        fDeferredTriggers.assign(Definition::getDeferWords(), 0);
+        for (auto trigger : triggers) {
+            fDeferredTriggers[trigger / 64] |= std::uint64_t(1) << (trigger % 64);
+            fDeferred.push_back({trigger, makeEvent<>(TriggerHandle{trigger}), false});
+        }
+        return true;
+    }
+
+    Instrumentation &getInstrumentation() {
+        return fInstrumentation;
+    }
+
+    const Instrumentation &getInstrumentation() const {
+        return fInstrumentation;
+    }
+
+    // Writes what the instrumentation policy measured, with the names of states and triggers
+    void dumpInstrumentation(std::ostream &stream) const {
+        fInstrumentation.dump(stream, [this](std::ostream &stream, std::size_t state) {
+            if (auto key = Definition::findStateKey(state)) {
+                stream << *key;
+            }
+        }, [this](std::ostream &stream, std::size_t trigger) {
+            stream << Definition::getTriggerKey(trigger);
+        });
+    }
+
+protected:
+    // A trigger with a copy of its arguments, fired later
+    using Event = detail::InlineFunction<void(Machine &machine)>;
+
+    template <typename ...Args>
+    static Event makeEvent(TriggerHandle trigger, const Args &...args) {
+        return [trigger, arguments = std::tuple<Args...>(args...)](Machine &machine) mutable {
+            std::apply([&machine, trigger](Args &...args) {
+                machine.dispatch<Args...>(trigger, args...);
+            }, arguments);
+        };
+    }
+
+    // Whether a transition is running, triggers fired meanwhile are queued
+    bool isFiring() const {
+        return fFiring;
+    }
+
+    // See MachineDefinition::enterTimeouts
+    void enterTimeouts() {
+        Definition::compile();
+        Definition::enterTimeouts(fInstance);
+    }
+
+    // Fires an event to completion, like fire
+    void runEvent(const Event &event) {
+        assert(!fFiring);
+        fFiring = true;
+        event(*this);
+        drain();
+    }
+
+private:
+    // A trigger deferred by the state the machine was in when it was fired
+    struct Deferred {
+        std::size_t fTrigger;
+        Event       fEvent;
+        bool        fArguments; // Whether the event carries arguments, which snapshots can't hold
+    };
+
+    // Fires the trigger, then the triggers queued meanwhile
+    template <typename ...Args>
+    void run(TriggerHandle trigger, Args &...args) {
+        fFiring = true;
+        dispatch<Args...>(trigger, args...);
+        drain();
+    }
+
+    template <typename ...Args>
+    void dispatch(TriggerHandle trigger, Args &...args) {
+        fInstrumentation.fired(Definition::getStateIndex(fInstance), trigger.fIndex, Definition::getStateCount(), Definition::getTriggerCount());
+        if (!Definition::template fireObserved<Args...>(fInstance, trigger, fInstrumentation, args...)) {
+            if (fDeferredTriggers.size() < Definition::getDeferWords()) {
+                fDeferredTriggers.resize(Definition::getDeferWords());
+            }
+            fDeferredTriggers[trigger.fIndex / 64] |= std::uint64_t(1) << (trigger.fIndex % 64);
+            fDeferred.push_back({trigger.fIndex, makeEvent<Args...>(trigger, args...), sizeof...(Args) > 0});
+        }
+    }
+
+    // Deferred triggers go first, as they were fired before any trigger still queued
+    void drain() {
+        for (;;) {
+            if (!fDeferred.empty()) {
+                recall();
+            }
+            if (fQueue.empty()) {
+                break;
+            }
+            fQueue.pop()(*this);
+        }
+        fFiring = false;
+    }
+
+    // Fires the deferred triggers which the current state doesn't defer, in the order they were fired, and keeps the
+    // others. The mask of deferred triggers makes this a few word comparisons when the state still defers them all.
+    void recall() {
+        while (!fDeferred.empty() && Definition::recallsAny(fInstance, fDeferredTriggers)) {
+            std::swap(fDeferred, fRecalling);
+            std::fill(fDeferredTriggers.begin(), fDeferredTriggers.end(), 0);
+            for (auto &deferred : fRecalling) {
+                // Checked one at a time, since each of them may change the state
+                if (Definition::defers(fInstance, deferred.fTrigger)) {
+                    fDeferredTriggers[deferred.fTrigger / 64] |= std::uint64_t(1) << (deferred.fTrigger % 64);
+                    fDeferred.push_back(std::move(deferred));
                 }
                 else {
-                    /*
-                           ancestor           ancestor  ancestor
-                             /  \                 |        |
-                         parent  \             parent      |
-                           /      \               |        |
-                         src      dst            src      dst
-                    */
-                    return exit<Args...>(getMachineState(*src->fParentState), dst, trigger, false, args...);
+                    deferred.fEvent(*this);
                 }
             }
-            else {
-                // The destination is a top state, just exit the parent and travel up the graph
-                /*
-                       ancestor   dst         
-                          |              
-                        parent               
-                          |                   
-                         src                
-                */
-                return exit<Args...>(getMachineState(*src->fParentState), dst, trigger, false, args...);
-            }
+            fRecalling.clear();
         }
-        // If we come here, src has no parent
-        /*
-             src  dst       src   ancestor
-                                     |
-                                    dst          
-        */
-        return src;
     }
 
-    void transitioned(MachineState *from, MachineState *to, T trigger) {
-        if (fOnTransitioned) {
-            fOnTransitioned(from->fState, to->fState, trigger);
+    template <typename ...Args>
+    void enqueue(TriggerHandle trigger, Args &...args) {
+        fQueue.push(makeEvent<Args...>(trigger, args...));
+    }
+
+    MachineInstance<S, MACHINE_HISTORY_CAPACITY>        fInstance;
+    bool                                                fFiring = false;
+    Instrumentation                                     fInstrumentation; // Empty by default, taking the padding after fFiring
+    detail::RingBuffer<Event, MACHINE_QUEUE_CAPACITY>   fQueue; // Triggers fired while firing, run to completion
+    std::vector<Deferred>                               fDeferred; // In the order they were fired
+    std::vector<Deferred>                               fRecalling; // Being fired again by recall, kept for its capacity
+    std::vector<std::uint64_t>                          fDeferredTriggers; // Mask of the triggers in fDeferred
+};
+
+// A definition with a single configuration of its own, for machines with orthogonal regions. Every trigger is fired
+// in all active regions at once. Like a Machine, triggers fired by callbacks while it is firing are queued, and
+// fired once every region has handled the current one.
+template <typename S, typename T>
+class OrthogonalMachine : public MachineDefinition<S, T> {
+public:
+    using Definition = MachineDefinition<S, T>;
+    using typename Definition::StateKey;
+    using typename Definition::TriggerKey;
+    using typename Definition::StateHandle;
+    using typename Definition::TriggerHandle;
+
+    OrthogonalMachine(S initialState) :
+    fInitialState(initialState) {
+
+    }
+
+    template <typename ...Args>
+    void fire(TriggerKey trigger, Args...args) {
+        auto &configuration = getConfiguration();
+        if (auto handle = Definition::findTrigger(trigger)) {
+            fire<Args...>(*handle, args...);
+            return;
+        }
+        // Reports the unhandled trigger right away
+        Definition::template fire<Args...>(configuration, trigger, args...);
+    }
+
+    template <typename ...Args>
+    void fire(TriggerHandle trigger, Args...args) {
+        auto &configuration = getConfiguration();
+        if (fFiring) {
+            fQueue.push([trigger, arguments = std::tuple<Args...>(args...)](OrthogonalMachine &machine) {
+                std::apply([&machine, trigger](const Args &...args) {
+                    machine.Definition::template fire<Args...>(machine.fConfiguration, trigger, args...);
+                }, arguments);
+            });
+            return;
+        }
+        fFiring = true;
+        Definition::template fire<Args...>(configuration, trigger, args...);
+        while (!fQueue.empty()) {
+            fQueue.pop()(*this);
+        }
+        fFiring = false;
+    }
+
+    bool isInState(StateKey state) {
+        return Definition::isInState(getConfiguration(), state);
+    }
+
+    bool isInState(StateHandle state) {
+        return Definition::isInState(getConfiguration(), state);
+    }
+
+private:
+    using Event = detail::InlineFunction<void(OrthogonalMachine &machine)>;
+
+    // Created on first use, once the regions have been configured
+    typename Definition::Configuration &getConfiguration() {
+        Definition::compile();
+        if (!fCreated) {
+            fConfiguration = Definition::createConfiguration(fInitialState);
+            fCreated = true;
         }
+        return fConfiguration;
     }
 
-    S                                                       fState;
-    std::map<S, std::unique_ptr<MachineState>>              fStates;
-    std::function<void(S state, T trigger)>                 fOnUnhandledTrigger;
-    std::function<void(S source, S destination, T trigger)> fOnTransitioned;
+    S                                                   fInitialState;
+    bool                                                fCreated = false;
+    typename Definition::Configuration                  fConfiguration;
+    bool                                                fFiring = false;
+    detail::RingBuffer<Event, MACHINE_QUEUE_CAPACITY>   fQueue; // Triggers fired while firing, run to completion
 };
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "machine.h"
+
+#include <limits>
+
+// Number of triggers other threads can post to a MailboxMachine before it dispatches them.
+// Define before including this header to change it.
+#ifndef MACHINE_MAILBOX_CAPACITY
+#define MACHINE_MAILBOX_CAPACITY 64
+#endif
+
+namespace detail {
+
+// A fixed capacity, lock free, multiple producer single consumer queue stored inline. Every slot carries a
+// sequence number telling whose turn it is: producers claim a position with a compare and swap on the tail,
+// then publish the slot by advancing its sequence, which is what the consumer waits for.
+//
+//   sequence == position                 free, a producer may claim it
+//   sequence == position + 1             written, the consumer may take it
+//   sequence == position + Capacity      taken, free again for the next round
+//
+// The tail and head sit on separate cache lines by default, smaller alignments save memory for large numbers of queues.
+template <typename V, std::size_t Capacity, std::size_t Alignment = 64>
+class MpscQueue {
+public:
+    MpscQueue() {
+        for (std::size_t i = 0; i < Capacity; i++) {
+            fSlots[i].fSequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    // Any thread. Returns false when the queue is full.
+    bool push(const V &value) {
+        auto position = fTail.load(std::memory_order_relaxed);
+        for (;;) {
+            auto &slot = fSlots[position % Capacity];
+            auto sequence = slot.fSequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+            if (difference == 0) {
+                if (fTail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    slot.fValue = value;
+                    slot.fSequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0) {
+                // The consumer hasn't taken this slot yet since the previous round
+                return false;
+            }
+            else {
+                position = fTail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only. Calls f with the value at the head, in place, and releases its slot afterwards.
+    // Returns false when no value has been published at the head.
+    template <typename F>
+    bool pop(F f) {
+        auto head = fHead.load(std::memory_order_relaxed);
+        auto &slot = fSlots[head % Capacity];
+        if (slot.fSequence.load(std::memory_order_acquire) != head + 1) {
+            return false;
+        }
+        f(slot.fValue);
+        slot.fValue = nullptr;
+        slot.fSequence.store(head + Capacity, std::memory_order_release);
+        fHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Any thread. A snapshot, exact only when no producer is pushing and the consumer isn't popping. The head is
+    // acquired first, so the tail read afterwards is at least as far as the pushes which were popped.
+    std::size_t size() const {
+        auto head = fHead.load(std::memory_order_acquire);
+        return fTail.load(std::memory_order_acquire) - head;
+    }
+
+private:
+    struct Slot {
+        std::atomic<std::size_t>    fSequence;
+        V                           fValue;
+    };
+
+    alignas(Alignment) std::atomic<std::size_t>     fTail{0};
+    alignas(Alignment) std::atomic<std::size_t>     fHead{0}; // Only written by the consumer, atomic for size
+    std::array<Slot, Capacity>                      fSlots;
+};
+
+}
+
+// A Machine which any thread can post triggers to. Posted triggers and a copy of their arguments are stored inline
+// in a lock free queue owned by the machine, and fired in order by the thread owning the machine when it calls
+// dispatchPending. Each of them runs to completion like fire. The machine has to be frozen before posting, and
+// posted triggers have to be configured.
+template <typename S, typename T, std::size_t Capacity = MACHINE_MAILBOX_CAPACITY>
+class MailboxMachine : public Machine<S, T> {
+public:
+    using Base = Machine<S, T>;
+    using typename Base::Definition;
+    using typename Base::TriggerKey;
+    using typename Base::TriggerHandle;
+
+    using Base::Base;
+
+    // Any thread. Returns false when the mailbox is full or the trigger isn't configured, in which case the trigger
+    // isn't posted.
+    template <typename ...Args>
+    bool post(TriggerKey trigger, Args...args) {
+        assert(this->isFrozen());
+        auto handle = Definition::findTrigger(trigger);
+        return handle && post<Args...>(*handle, args...);
+    }
+
+    template <typename ...Args>
+    bool post(TriggerHandle trigger, Args...args) {
+        assert(this->isFrozen());
+        return fMailbox.push(Base::template makeEvent<Args...>(trigger, args...));
+    }
+
+    // Owning thread. Fires up to limit posted triggers, in the order they were posted, and returns how many.
+    std::size_t dispatchPending(std::size_t limit = std::numeric_limits<std::size_t>::max()) {
+        std::size_t count = 0;
+        while (count < limit && fMailbox.pop([this](const typename Base::Event &event){ Base::runEvent(event); })) {
+            count++;
+        }
+        return count;
+    }
+
+    // Triggers posted but not dispatched yet, approximate while other threads are posting
+    std::size_t getPendingCount() const {
+        return fMailbox.size();
+    }
+
+private:
+    detail::MpscQueue<typename Base::Event, Capacity>   fMailbox;
+};
@@ -1,4 +1,22 @@
 #include "machine.h"
+#include "static_machine.h"
+#include "transition_table.h"
+#include "parallel.h"
+#include "mailbox.h"
+#include "scheduler.h"
+#include "timing_wheel.h"
+#include "image.h"
+#include "codegen.h"
+#include "statistics.h"
+#ifdef __cpp_impl_coroutine
+#include "coroutine.h"
+#endif
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
 
 /* Test cases */
 
@@ -450,6 +468,1956 @@ void testInternalTransitionSubState2() {
     assert(sequence == "");
 }
 
+void testFreeze() {
+    /*
+        A   B
+        |
+        C
+        |
+        D
+    */
+    std::cout << "-- testFreeze\n";
+    std::string sequence;
+    Machine<std::string, std::string> m("D");
+    m.configure("A")
+        .permit("X", "B")
+        .onEntry([&sequence](){ std::cout << "entering A\n"; sequence += ">A"; })
+        .onExit([&sequence](){ std::cout << "exiting A\n"; sequence += "<A"; });
+    m.configure("B")
+        .permit("X", "D")
+        .onEntry([&sequence](){ std::cout << "entering B\n"; sequence += ">B"; })
+        .onExit([&sequence](){ std::cout << "exiting B\n"; sequence += "<B"; });
+    m.configure("C")
+        .substateOf("A")
+        .onEntry([&sequence](){ std::cout << "entering C\n"; sequence += ">C"; })
+        .onExit([&sequence](){ std::cout << "exiting C\n"; sequence += "<C"; });
+    m.configure("D")
+        .substateOf("C")
+        .onEntry([&sequence](){ std::cout << "entering D\n"; sequence += ">D"; })
+        .onExit([&sequence](){ std::cout << "exiting D\n"; sequence += "<D"; });
+    m.freeze();
+    assert(m.isFrozen());
+    assert(m.isInState("D"));
+    assert(m.canFire("X"));
+    assert(!m.canFire("Y"));
+    m.fire("X");
+    assert(m.isInState("B"));
+    m.fire("X");
+    assert(m.isInState("D"));
+    std::cout << sequence << "\n";
+    assert(sequence == "<D<C<A>B<B>A>C>D");
+}
+
+enum class EditorState { Play, Edit, Translate, Rotate, Count };
+enum class EditorTrigger { Play, Edit, Rotate };
+
+template <>
+struct enum_count<EditorTrigger> : std::integral_constant<std::size_t, 3> {};
+
+void testEnumStorage() {
+    /*
+        Play   Edit
+                |
+          Translate Rotate
+    */
+    std::cout << "-- testEnumStorage\n";
+    std::string sequence;
+    Machine<EditorState, EditorTrigger> m(EditorState::Play);
+    m.configure(EditorState::Play)
+        .permit(EditorTrigger::Edit, EditorState::Edit)
+        .onExit([&sequence](){ sequence += "<Play"; });
+    m.configure(EditorState::Edit)
+        .initialTransition(EditorState::Translate)
+        .permit(EditorTrigger::Play, EditorState::Play)
+        .onEntry([&sequence](){ sequence += ">Edit"; });
+    m.configure(EditorState::Translate)
+        .substateOf(EditorState::Edit)
+        .permit(EditorTrigger::Rotate, EditorState::Rotate)
+        .onEntry([&sequence](){ sequence += ">Translate"; });
+    m.configure(EditorState::Rotate)
+        .substateOf(EditorState::Edit)
+        .onEntry([&sequence](){ sequence += ">Rotate"; });
+    assert(m.isInState(EditorState::Play));
+    m.fire(EditorTrigger::Edit);
+    assert(m.isInState(EditorState::Edit));
+    assert(m.isInState(EditorState::Translate));
+    assert(!m.canFire(EditorTrigger::Edit));
+    m.fire(EditorTrigger::Rotate);
+    assert(m.isInState(EditorState::Rotate));
+    m.fire(EditorTrigger::Play);
+    assert(m.isInState(EditorState::Play));
+    std::cout << sequence << "\n";
+    assert(sequence == "<Play>Edit>Translate>Rotate");
+}
+
+void testSharedDefinition() {
+    /*
+        Play   Edit
+                |
+          Translate Rotate
+    */
+    std::cout << "-- testSharedDefinition\n";
+    // States point back to their definition, which can only be shared by reference
+    static_assert(!std::is_copy_constructible_v<MachineDefinition<EditorState, EditorTrigger>>);
+    static_assert(!std::is_move_constructible_v<MachineDefinition<EditorState, EditorTrigger>>);
+    static_assert(!std::is_move_constructible_v<Machine<EditorState, EditorTrigger>>);
+    std::atomic<int> entered(0);
+    MachineDefinition<EditorState, EditorTrigger> definition;
+    definition.configure(EditorState::Play)
+        .permit(EditorTrigger::Edit, EditorState::Edit);
+    definition.configure(EditorState::Edit)
+        .initialTransition(EditorState::Translate)
+        .permit(EditorTrigger::Play, EditorState::Play)
+        .onEntry([&entered](){ entered++; });
+    definition.configure(EditorState::Translate)
+        .substateOf(EditorState::Edit)
+        .permit(EditorTrigger::Rotate, EditorState::Rotate);
+    definition.configure(EditorState::Rotate)
+        .substateOf(EditorState::Edit);
+    auto play = definition.createInstance(EditorState::Play);
+    auto rotate = definition.createInstance(EditorState::Rotate);
+    definition.freeze();
+    static_assert(sizeof(play) == sizeof(EditorState), "An instance only holds its state");
+
+    // Instances advance independently
+    definition.fire(play, EditorTrigger::Edit);
+    assert(definition.isInState(play, EditorState::Translate));
+    assert(definition.isInState(rotate, EditorState::Rotate));
+    definition.fire(rotate, EditorTrigger::Play);
+    assert(definition.getState(rotate) == EditorState::Play);
+    assert(definition.canFire(play, EditorTrigger::Rotate));
+    assert(!definition.canFire(rotate, EditorTrigger::Rotate));
+
+    // A frozen definition is only read, so threads can share it
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&definition](){
+            std::vector<MachineInstance<EditorState>> instances(100, definition.createInstance(EditorState::Play));
+            for (auto &instance : instances) {
+                definition.fire(instance, EditorTrigger::Edit);
+                definition.fire(instance, EditorTrigger::Rotate);
+                assert(definition.isInState(instance, EditorState::Rotate));
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    std::cout << entered << "\n";
+    assert(entered == 401);
+}
+
+void testHistory() {
+    /*
+        Play   Edit
+                 Transform   Select
+                   Translate   Rotate
+    */
+    std::cout << "-- testHistory\n";
+    for (bool deep : {false, true}) {
+        std::string sequence;
+        Machine<std::string, std::string> m("Play");
+        for (std::string state : {"Play", "Edit", "Transform", "Translate", "Rotate", "Select"}) {
+            m.configure(state).onEntry([&sequence, state](){ sequence += ">" + state; });
+        }
+        m.configure("Play")
+            .permit("Edit", "Edit")
+            .permit("Select", "Select");
+        m.configure("Edit")
+            .initialTransition("Transform")
+            .permit("Play", "Play")
+            .permit("Select", "Select");
+        deep ? m.configure("Edit").deepHistory() : m.configure("Edit").shallowHistory();
+        m.configure("Transform")
+            .substateOf("Edit")
+            .initialTransition("Translate")
+            .permit("Rotate", "Rotate");
+        m.configure("Translate").substateOf("Transform");
+        m.configure("Rotate").substateOf("Transform");
+        m.configure("Select").substateOf("Edit");
+
+        // The first time, the initial transitions are taken
+        m.fire("Edit");
+        assert(sequence == ">Edit>Transform>Translate");
+        m.fire("Rotate");
+        m.fire("Play");
+
+        // Shallow history goes back to Transform, which takes its initial transition, deep history to Rotate
+        sequence.clear();
+        m.fire("Edit");
+        assert(sequence == (deep ? ">Edit>Transform>Rotate" : ">Edit>Transform>Translate"));
+        assert(m.isInState(deep ? "Rotate" : "Translate"));
+
+        // Entering a substate directly doesn't use the history, but leaving it records it
+        m.fire("Select");
+        m.fire("Play");
+        sequence.clear();
+        m.fire("Select");
+        assert(sequence == ">Edit>Select");
+        m.fire("Play");
+        sequence.clear();
+        m.fire("Edit");
+        assert(sequence == ">Edit>Select");
+    }
+
+    // Each instance of a shared definition keeps its own history in a few bytes
+    MachineDefinition<EditorState, EditorTrigger> definition;
+    definition.configure(EditorState::Play)
+        .permit(EditorTrigger::Edit, EditorState::Edit);
+    definition.configure(EditorState::Edit)
+        .initialTransition(EditorState::Translate)
+        .shallowHistory()
+        .permit(EditorTrigger::Play, EditorState::Play);
+    definition.configure(EditorState::Translate)
+        .substateOf(EditorState::Edit)
+        .permit(EditorTrigger::Rotate, EditorState::Rotate);
+    definition.configure(EditorState::Rotate)
+        .substateOf(EditorState::Edit);
+    definition.freeze();
+    auto rotated = definition.createInstance<1>(EditorState::Play);
+    auto translated = definition.createInstance<1>(EditorState::Play);
+    auto plain = definition.createInstance(EditorState::Play);
+    static_assert(sizeof(rotated) == 2 * sizeof(EditorState), "A slot per state with history");
+    for (auto trigger : {EditorTrigger::Edit, EditorTrigger::Rotate, EditorTrigger::Play, EditorTrigger::Edit}) {
+        definition.fire(rotated, trigger);
+        definition.fire(plain, trigger);
+    }
+    definition.fire(translated, EditorTrigger::Edit);
+    definition.fire(translated, EditorTrigger::Play);
+    definition.fire(translated, EditorTrigger::Edit);
+    assert(definition.isInState(rotated, EditorState::Rotate));
+    assert(definition.isInState(translated, EditorState::Translate));
+    // Without slots, the initial transition is taken every time
+    assert(definition.isInState(plain, EditorState::Translate));
+
+    // A machine keeps the history of the first states configured with it, those past its capacity have none
+    Machine<std::string, std::string> many("Home");
+    auto count = MACHINE_HISTORY_CAPACITY + 2;
+    for (int i = 0; i < count; i++) {
+        auto state = "S" + std::to_string(i);
+        many.configure("Home").permit("Go" + std::to_string(i), state);
+        many.configure(state).initialTransition(state + "First").shallowHistory().permit("Home", "Home");
+        many.configure(state + "First").substateOf(state).permit("Next", state + "Second");
+        many.configure(state + "Second").substateOf(state);
+    }
+    [[maybe_unused]] auto frozen = many.freeze();
+    assert(!frozen && many.getHistoryCount() == static_cast<std::size_t>(count));
+    for (int i = 0; i < count; i++) {
+        auto state = "S" + std::to_string(i);
+        for (auto trigger : {"Go" + std::to_string(i), std::string("Next"), std::string("Home"), "Go" + std::to_string(i)}) {
+            many.fire(trigger);
+        }
+        assert(many.isInState(state + (i < MACHINE_HISTORY_CAPACITY ? "Second" : "First")));
+        many.fire("Home");
+    }
+}
+
+void testSnapshot() {
+    std::cout << "-- testSnapshot\n";
+    auto configure = [](MachineDefinition<EditorState, EditorTrigger> &definition) {
+        definition.configure(EditorState::Play)
+            .permit(EditorTrigger::Edit, EditorState::Edit);
+        definition.configure(EditorState::Edit)
+            .initialTransition(EditorState::Translate)
+            .shallowHistory()
+            .permit(EditorTrigger::Play, EditorState::Play);
+        definition.configure(EditorState::Translate)
+            .substateOf(EditorState::Edit)
+            .permit(EditorTrigger::Rotate, EditorState::Rotate);
+        definition.configure(EditorState::Rotate)
+            .substateOf(EditorState::Edit);
+    };
+    MachineDefinition<EditorState, EditorTrigger> definition;
+    configure(definition);
+    definition.freeze();
+
+    // A whole array with its history, restored into another process's definition
+    std::vector<MachineInstance<EditorState, 1>> instances(3, definition.createInstance<1>(EditorState::Play));
+    for (auto trigger : {EditorTrigger::Edit, EditorTrigger::Rotate, EditorTrigger::Play}) {
+        definition.fire(instances[1], trigger);
+    }
+    definition.fire(instances[2], EditorTrigger::Edit);
+    std::stringstream stream;
+    definition.snapshot(instances.data(), instances.size(), stream);
+    assert(stream.str().size() == sizeof(detail::SnapshotHeader) + 3 * 2 * sizeof(EditorState));
+
+    MachineDefinition<EditorState, EditorTrigger> other;
+    configure(other);
+    other.freeze();
+    std::vector<MachineInstance<EditorState, 1>> restored;
+    [[maybe_unused]] auto restoredOk = other.restore(restored, stream);
+    assert(restoredOk && restored.size() == 3);
+    assert(other.isInState(restored[0], EditorState::Play));
+    assert(other.isInState(restored[1], EditorState::Play));
+    assert(other.isInState(restored[2], EditorState::Translate));
+    other.fire(restored[1], EditorTrigger::Edit);
+    assert(other.isInState(restored[1], EditorState::Rotate));
+
+    // The count, the number of history slots and the definition have to match
+    stream.clear();
+    stream.seekg(0);
+    [[maybe_unused]] auto fewer = definition.restore(instances.data(), 2, stream);
+    assert(!fewer);
+    stream.clear();
+    stream.seekg(0);
+    std::vector<MachineInstance<EditorState>> plain;
+    [[maybe_unused]] auto withoutHistory = definition.restore(plain, stream);
+    assert(!withoutHistory);
+    MachineDefinition<EditorState, EditorTrigger> changed;
+    configure(changed);
+    changed.configure(EditorState::Rotate).shallowHistory();
+    stream.clear();
+    stream.seekg(0);
+    [[maybe_unused]] auto changedOk = changed.restore(restored, stream);
+    assert(!changedOk);
+
+    // States which aren't configured are refused
+    auto corrupted = stream.str();
+    corrupted[sizeof(detail::SnapshotHeader)] = 4;
+    std::stringstream corruptedStream(corrupted);
+    [[maybe_unused]] auto corruptedOk = definition.restore(restored, corruptedStream);
+    assert(!corruptedOk);
+
+    // A corrupted count runs out of stream instead of allocating for it
+    auto huge = stream.str();
+    detail::SnapshotHeader hugeHeader;
+    std::memcpy(&hugeHeader, huge.data(), sizeof(hugeHeader));
+    hugeHeader.fCount = std::numeric_limits<decltype(hugeHeader.fCount)>::max() / 2;
+    std::memcpy(&huge[0], &hugeHeader, sizeof(hugeHeader));
+    std::stringstream hugeStream(huge);
+    [[maybe_unused]] auto hugeOk = other.restore(restored, hugeStream);
+    assert(!hugeOk);
+
+    // A machine keeps its deferred triggers, and no callback runs while restoring
+    std::string sequence;
+    auto makeMachine = [&sequence]() {
+        auto m = std::make_unique<Machine<std::string, std::string>>("Idle");
+        m->configure("Idle")
+            .onEntry([&sequence](){ sequence += ">I"; })
+            .permit("Job", "Busy")
+            .permit<int>("Stop", "Stopped");
+        m->configure("Busy")
+            .onEntry([&sequence](){ sequence += ">B"; })
+            .permit("Done", "Idle")
+            .defer("Job")
+            .defer<int>("Stop");
+        return m;
+    };
+    auto m = makeMachine();
+    m->fire("Job");
+    m->fire("Job");
+    assert(m->getDeferredCount() == 1);
+    std::stringstream machineStream;
+    [[maybe_unused]] auto written = m->snapshot(machineStream);
+    assert(written);
+
+    sequence.clear();
+    auto copy = makeMachine();
+    [[maybe_unused]] auto copied = copy->restore(machineStream);
+    assert(copied);
+    assert(sequence.empty());
+    assert(copy->isInState("Busy") && copy->getDeferredCount() == 1);
+    copy->fire("Done");
+    assert(sequence == ">I>B");
+    assert(copy->isInState("Busy") && copy->getDeferredCount() == 0);
+
+    // Arguments of deferred triggers can't be written
+    m->fire("Stop", 1);
+    std::stringstream argumentStream;
+    [[maybe_unused]] auto withArguments = m->snapshot(argumentStream);
+    assert(!withArguments);
+    assert(argumentStream.str().empty());
+
+    // A failed restore leaves the machine as it was
+    std::stringstream truncated(machineStream.str().substr(0, sizeof(detail::SnapshotHeader)));
+    [[maybe_unused]] auto truncatedOk = copy->restore(truncated);
+    assert(!truncatedOk);
+    assert(copy->isInState("Busy"));
+    auto bigCount = machineStream.str();
+    std::uint32_t deferredCount = 0xffffffff;
+    std::memcpy(&bigCount[bigCount.size() - 2 * sizeof(deferredCount)], &deferredCount, sizeof(deferredCount));
+    std::stringstream bigCountStream(bigCount);
+    [[maybe_unused]] auto bigCountOk = copy->restore(bigCountStream);
+    assert(!bigCountOk);
+    assert(copy->isInState("Busy") && copy->getDeferredCount() == 0);
+}
+
+void testImage() {
+    /*
+        Idle   Active
+                 Loading   Running
+                             Fast
+    */
+    std::cout << "-- testImage\n";
+    std::string sequence;
+    bool ready = false;
+    int internal = 0;
+    MachineDefinition<std::string, std::string> definition;
+    definition.configure("Idle")
+        .permit("Start", "Active")
+        .ignore("Stop");
+    definition.configure("Active")
+        .initialTransition("Loading")
+        .onEntry([&sequence](){ sequence += ">A"; })
+        .onExit([&sequence](){ sequence += "<A"; })
+        .permit("Stop", "Idle")
+        .internalTransition("Ping", [&internal](){ internal++; });
+    definition.configure("Loading")
+        .substateOf("Active")
+        .onEntry([&sequence](){ sequence += ">L"; })
+        .permitIf("Tick", "Running", [&ready](){ return ready; })
+        .ignoreIf("Tick", [&ready](){ return !ready; });
+    definition.configure("Running")
+        .substateOf("Active")
+        .initialTransition("Fast")
+        .permitReentry("Tick");
+    definition.configure("Fast")
+        .substateOf("Running")
+        .onExit([&sequence](){ sequence += "<F"; });
+    definition.freeze();
+
+    std::stringstream stream;
+    [[maybe_unused]] auto written = MachineImage::write(definition, stream);
+    assert(written);
+    // Loaded in memory here, as it would be mapped from a file
+    auto bytes = stream.str();
+    std::vector<std::uint64_t> data(bytes.size() / sizeof(std::uint64_t) + 1);
+    std::memcpy(data.data(), bytes.data(), bytes.size());
+    MachineImage image(data.data(), bytes.size());
+    assert(image.isValid());
+    assert(image.getStateCount() == definition.getStateCount());
+
+    // Callbacks are bound by name, every one of them is needed
+    CallbackRegistry registry;
+    registry
+        .onEntry("Active", [&sequence](){ sequence += ">A"; })
+        .onExit("Active", [&sequence](){ sequence += "<A"; })
+        .internalAction("Active", "Ping", [&internal](){ internal++; })
+        .onEntry("Loading", [&sequence](){ sequence += ">L"; })
+        .guard("Loading", "Tick", [&ready](){ return ready; });
+    [[maybe_unused]] auto boundEarly = image.bind(registry);
+    assert(!boundEarly && !image.isBound());
+    registry
+        .guard("Loading", "Tick", [&ready](){ return !ready; }, 1)
+        .onExit("Fast", [&sequence](){ sequence += "<F"; });
+    [[maybe_unused]] auto bound = image.bind(registry);
+    assert(bound);
+
+    // The image behaves like the definition it was written from
+    auto instance = definition.createInstance("Idle");
+    auto imageInstance = image.createInstance(*image.findState("Idle"));
+    for (std::string trigger : {"Stop", "Start", "Tick", "Ping", "Ready", "Tick", "Tick", "Stop", "Start"}) {
+        if (trigger == "Ready") {
+            ready = true;
+            continue;
+        }
+        sequence.clear();
+        definition.fire(instance, trigger);
+        auto expected = sequence;
+        sequence.clear();
+        image.fire(imageInstance, trigger);
+        assert(sequence == expected);
+        assert(image.getState(imageInstance) == definition.getState(instance));
+    }
+    assert(internal == 2);
+    assert(image.isInState(imageInstance, "Active") && image.isInState(imageInstance, "Loading"));
+    assert(!image.isInState(imageInstance, "Running") && !image.isInState(imageInstance, "Unknown"));
+
+    std::string unhandled;
+    image.onUnhandledTrigger([&unhandled](std::string_view state, std::string_view trigger){
+        unhandled = std::string(state) + " " + std::string(trigger);
+    });
+    image.fire(imageInstance, "Unknown");
+    assert(unhandled == "Loading Unknown");
+
+#ifdef MACHINE_IMAGE_MMAP
+    // Mapped from a file, shared read only
+    auto path = "/tmp/machine_test.image";
+    {
+        std::ofstream file(path, std::ios::binary);
+        [[maybe_unused]] auto fileWritten = MachineImage::write(definition, file);
+        assert(fileWritten);
+    }
+    {
+        MappedFile mapped(path);
+        assert(mapped.isOpen());
+        MachineImage mappedImage(mapped.data(), mapped.size());
+        [[maybe_unused]] auto mappedBound = mappedImage.bind(registry);
+        assert(mappedBound);
+        auto mappedInstance = mappedImage.createInstance(*mappedImage.findState("Loading"));
+        mappedImage.fire(mappedInstance, "Tick");
+        assert(mappedImage.isInState(mappedInstance, "Fast"));
+    }
+    std::remove(path);
+#endif
+
+    // Anything else than an image of this version is refused
+    bytes[0] ^= 1;
+    std::memcpy(data.data(), bytes.data(), bytes.size());
+    assert(!MachineImage(data.data(), bytes.size()).isValid());
+    assert(!MachineImage(data.data(), sizeof(detail::ImageHeader) - 1).isValid());
+
+    // Dynamic transitions can't be saved
+    MachineDefinition<std::string, std::string> dynamic;
+    dynamic.configure("A").permitDynamic("X", [](){ return std::string("B"); });
+    dynamic.configure("B");
+    dynamic.freeze();
+    std::stringstream dynamicStream;
+    [[maybe_unused]] auto dynamicWritten = MachineImage::write(dynamic, dynamicStream);
+    assert(!dynamicWritten);
+    assert(dynamicStream.str().empty());
+}
+
+// The machine of examples/generated/player.h, written by CodeGenerator
+void configurePlayer(MachineDefinition<std::string, std::string> &definition, std::string &sequence, const bool &buffered) {
+    /*
+        Stopped   Active
+                    Playing    Paused
+                      Buffering
+                      Streaming
+    */
+    definition.configure("Stopped")
+        .permit("Play", "Active")
+        .ignore("Stop");
+    definition.configure("Active")
+        .initialTransition("Playing")
+        .onEntry([&sequence](){ sequence += ">Active"; })
+        .onExit([&sequence](){ sequence += "<Active"; })
+        .permit("Stop", "Stopped")
+        .internalTransition("Seek", [&sequence](){ sequence += "~Seek"; });
+    definition.configure("Playing")
+        .substateOf("Active")
+        .initialTransition("Buffering")
+        .permit("Pause", "Paused");
+    definition.configure("Buffering")
+        .substateOf("Playing")
+        .onEntry([&sequence](){ sequence += ">Buffering"; })
+        .permitIf("Tick", "Streaming", [&buffered](){ return buffered; })
+        .ignoreIf("Tick", [&buffered](){ return !buffered; });
+    definition.configure("Streaming")
+        .substateOf("Playing")
+        .onExit([&sequence](){ sequence += "<Streaming"; })
+        .permitReentry("Tick")
+        .internalTransitionIf("Seek", [&sequence](){ sequence += "~Skip"; }, [&buffered](){ return buffered; });
+    definition.configure("Paused")
+        .substateOf("Active")
+        .permit("Play", "Playing");
+    definition.freeze();
+}
+
+#include "examples/generated/player.h"
+
+struct PlayerCallbacks {
+    void onEntry_Active() { sequence += ">Active"; }
+    void onExit_Active() { sequence += "<Active"; }
+    void action_Active_Seek_0() { sequence += "~Seek"; }
+    void onEntry_Buffering() { sequence += ">Buffering"; }
+    bool guard_Buffering_Tick_0() { return buffered; }
+    bool guard_Buffering_Tick_1() { return !buffered; }
+    void onExit_Streaming() { sequence += "<Streaming"; }
+    void action_Streaming_Seek_0() { sequence += "~Skip"; }
+    bool guard_Streaming_Seek_0() { return buffered; }
+
+    std::string &sequence;
+    const bool  &buffered;
+};
+
+void testCodeGenerator() {
+    std::cout << "-- testCodeGenerator\n";
+    std::string sequence;
+    bool buffered = false;
+    MachineDefinition<std::string, std::string> definition;
+    configurePlayer(definition, sequence, buffered);
+
+    // The checked in header, compiled into the tests, is what the generator writes for this definition. Its
+    // checksum is compared, so the tests don't have to find the header at run time.
+    std::ostringstream code;
+    [[maybe_unused]] auto generatedOk = CodeGenerator::generate(definition, "player", code);
+    assert(generatedOk);
+    auto text = code.str();
+    auto checksum = text.find("Checksum = 0x");
+    assert(checksum != std::string::npos);
+    if (std::stoull(text.substr(checksum + 13), nullptr, 16) != player::Checksum) {
+        std::ofstream("player.h.new") << text;
+        std::cout << "Generated code changed, see player.h.new\n";
+        assert(false);
+    }
+
+    // The same triggers take the generated and the runtime machine through the same states and callbacks
+    PlayerCallbacks callbacks{sequence, buffered};
+    player::Machine<PlayerCallbacks> generated(callbacks, player::State::Stopped);
+    auto instance = definition.createInstance("Stopped");
+    bool handled = true;
+    definition.onUnhandledTrigger([&handled](const std::string &, const std::string &){ handled = false; });
+    std::uint32_t random = 1;
+    for (int i = 0; i < 2000; i++) {
+        random = random * 1664525u + 1013904223u;
+        if ((random >> 24) % 8 == 0) {
+            buffered = !buffered;
+        }
+        auto trigger = static_cast<player::Trigger>((random >> 16) % player::TriggerCount);
+        sequence.clear();
+        handled = true;
+        definition.fire(instance, player::toString(trigger));
+        auto expectedSequence = sequence;
+        sequence.clear();
+        [[maybe_unused]] auto generatedHandled = generated.fire(trigger);
+        assert(generatedHandled == handled);
+        assert(sequence == expectedSequence);
+        assert(definition.getState(instance) == player::toString(generated.getState()));
+    }
+    for ([[maybe_unused]] auto state : {player::State::Active, player::State::Playing, player::State::Streaming, player::State::Paused}) {
+        player::Machine<PlayerCallbacks> streaming(callbacks, player::State::Streaming);
+        assert(streaming.isInState(state) == (state != player::State::Paused));
+    }
+
+    // Names which would not compile are refused
+    for (auto reserved : {"delete", "__Idle", "_Idle"}) {
+        MachineDefinition<std::string, std::string> keyword;
+        keyword.configure(reserved).permit("Go", "Idle");
+        keyword.configure("Idle");
+        keyword.freeze();
+        std::ostringstream refused;
+        [[maybe_unused]] auto generated = CodeGenerator::generate(keyword, "keyword", refused);
+        assert(!generated && refused.str().empty());
+    }
+    MachineDefinition<std::string, std::string> colliding;
+    colliding.configure("A_B").permitIf("C", "A", [](){ return true; });
+    colliding.configure("A").permitIf("B_C", "A_B", [](){ return true; });
+    colliding.freeze();
+    std::ostringstream refused;
+    [[maybe_unused]] auto collided = CodeGenerator::generate(colliding, "colliding", refused);
+    assert(!collided);
+    MachineDefinition<std::string, std::string> underscored;
+    underscored.configure("A_").permitIf("B", "C", [](){ return true; });
+    underscored.configure("C");
+    underscored.freeze();
+    [[maybe_unused]] auto doubled = CodeGenerator::generate(underscored, "underscored", refused);
+    assert(!doubled);
+
+    // Names are escaped in string literals
+    MachineDefinition<std::string, std::string> escaped;
+    escaped.configure("Line\nBreak").permit("\"quoted\"", "Tab\t");
+    escaped.configure("Tab\t");
+    escaped.freeze();
+    std::ostringstream escapedCode;
+    [[maybe_unused]] auto escapedOk = CodeGenerator::generate(escaped, "escaped", escapedCode);
+    assert(escapedOk);
+    assert(escapedCode.str().find("return \"Line\\012Break\";") != std::string::npos);
+    assert(escapedCode.str().find("return \"Tab\\011\";") != std::string::npos);
+    assert(escapedCode.str().find("return \"\\\"quoted\\\"\";") != std::string::npos);
+}
+
+void testStatistics() {
+    /*
+        Idle   Busy
+                |
+               Slow
+    */
+    std::cout << "-- testStatistics\n";
+    static_assert(std::is_empty_v<NoInstrumentation>);
+    static_assert(sizeof(Machine<int, int, NoInstrumentation>) == sizeof(Machine<int, int>));
+    int entered = 0;
+    Machine<std::string, std::string, MachineStatistics> machine("Idle");
+    machine.configure("Idle")
+        .permit("Start", "Busy")
+        .ignore("Stop");
+    machine.configure("Busy")
+        .onEntry([&entered](){ entered++; })
+        .permit("Stop", "Idle")
+        .permit("Wait", "Slow");
+    machine.configure("Slow")
+        .substateOf("Busy")
+        .onEntry([](){ std::this_thread::sleep_for(std::chrono::milliseconds(1)); });
+
+    for (auto trigger : {"Start", "Stop", "Stop", "Start", "Wait", "Stop", "Start"}) {
+        machine.fire(trigger);
+    }
+    [[maybe_unused]] auto idle = machine.getStateHandle("Idle");
+    [[maybe_unused]] auto busy = machine.getStateHandle("Busy");
+    auto slow = machine.getStateHandle("Slow");
+    [[maybe_unused]] auto start = machine.getTriggerHandle("Start");
+    [[maybe_unused]] auto stop = machine.getTriggerHandle("Stop");
+    [[maybe_unused]] auto wait = machine.getTriggerHandle("Wait");
+    auto &statistics = machine.getInstrumentation();
+    assert(statistics.getCount(idle, start) == 3);
+    assert(statistics.getCount(idle, stop) == 1);
+    assert(statistics.getCount(busy, stop) == 1);
+    assert(statistics.getCount(busy, wait) == 1);
+    assert(statistics.getCount(slow, stop) == 1);
+    assert(statistics.getCount(slow, start) == 0);
+
+    // One histogram entry per callback run, states without callbacks have none
+    assert(statistics.getEntryLatency(busy.fIndex).total() == static_cast<std::uint64_t>(entered));
+    assert(statistics.getEntryLatency(idle.fIndex).total() == 0);
+    assert(statistics.getExitLatency(busy.fIndex).total() == 0);
+    [[maybe_unused]] auto &sleeping = statistics.getEntryLatency(slow.fIndex);
+    assert(sleeping.total() == 1);
+    for (std::size_t bucket = 0; bucket < 19; bucket++) {
+        assert(sleeping.fCounts[bucket] == 0);
+    }
+
+    std::ostringstream dump;
+    machine.dumpInstrumentation(dump);
+    auto text = dump.str();
+    assert(text.find("fired\n  Idle Start 3\n  Idle Stop 1\n") == 0);
+    assert(text.find("  Slow Stop 1\n") != std::string::npos);
+    assert(text.find("callbacks\n  entry Busy 3:") != std::string::npos);
+    assert(text.find("  entry Slow 1:") != std::string::npos);
+
+    // Merged statistics add up, reset ones are empty
+    MachineStatistics merged;
+    merged.merge(statistics);
+    merged.merge(statistics);
+    assert(merged.getCount(idle, start) == 6);
+    assert(merged.getEntryLatency(slow.fIndex).total() == 2);
+    merged.reset();
+    assert(merged.getCount(idle, start) == 0);
+    assert(merged.getEntryLatency(busy.fIndex).total() == 0);
+}
+
+void testFireAll() {
+    /*
+        A   B   C
+                |
+                D
+    */
+    std::cout << "-- testFireAll\n";
+    enum class State { A, B, C, D, Count };
+    enum class Trigger { X, Y, Count };
+    int entered = 0;
+    bool allowed = false;
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::A)
+        .permit(Trigger::X, State::B)
+        .ignore(Trigger::Y);
+    definition.configure(State::B)
+        .permit(Trigger::X, State::C)
+        .permitIf(Trigger::Y, State::A, [&allowed](){ return allowed; })
+        .ignore(Trigger::Y);
+    definition.configure(State::C)
+        .initialTransition(State::D)
+        .permit(Trigger::X, State::A)
+        .ignore(Trigger::Y)
+        .onEntry([&entered](){ entered++; });
+    definition.configure(State::D)
+        .substateOf(State::C);
+    std::vector<MachineInstance<State>> instances;
+    for (auto state : {State::A, State::B, State::D, State::A}) {
+        instances.push_back(definition.createInstance(state));
+    }
+    definition.freeze();
+
+    // A to B is direct, B to C calls onEntry of C and ends in D
+    definition.fireAll(instances.data(), instances.size(), Trigger::X);
+    assert(definition.isInState(instances[0], State::B));
+    assert(definition.isInState(instances[1], State::D));
+    assert(definition.isInState(instances[2], State::A));
+    assert(definition.isInState(instances[3], State::B));
+    assert(entered == 1);
+
+    // Ignored in A and D, guarded in B
+    allowed = true;
+    const Trigger triggers[] = {Trigger::Y, Trigger::Y, Trigger::Y, Trigger::X};
+    definition.fireAll(instances.data(), triggers, instances.size());
+    assert(definition.isInState(instances[0], State::A));
+    assert(definition.isInState(instances[1], State::D));
+    assert(definition.isInState(instances[2], State::A));
+    assert(definition.isInState(instances[3], State::C));
+    assert(entered == 2);
+
+    // Direct cells still report transitions when someone listens
+    int transitions = 0;
+    definition.onTransitioned([&transitions](State, State, Trigger){ transitions++; });
+    definition.fireAll(instances.data(), instances.size(), Trigger::X);
+    assert(transitions == 4);
+}
+
+template <typename Index>
+void testTransitionTable(typename TransitionTable<Index>::Kernel kernel) {
+    /*
+        A   B   C
+            |
+            D
+    */
+    enum class State { A, B, C, D, Count };
+    enum class Trigger { X, Y, Z, Count };
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::A)
+        .permit(Trigger::X, State::B)
+        .permit(Trigger::Y, State::C);
+    definition.configure(State::B)
+        .initialTransition(State::D)
+        .permit(Trigger::Y, State::A)
+        .ignore(Trigger::Z);
+    definition.configure(State::C)
+        .permitReentry(Trigger::X)
+        .permit(Trigger::Z, State::D);
+    definition.configure(State::D)
+        .substateOf(State::B)
+        .permit(Trigger::X, State::C);
+    definition.freeze();
+    auto table = *TransitionTable<Index>::tryCreate(definition);
+    table.setKernel(kernel);
+
+    // Odd counts exercise the scalar tail of the vector kernels
+    std::vector<Index> states, triggers;
+    std::vector<MachineInstance<State>> instances;
+    definition.onUnhandledTrigger([](State, Trigger){});
+    for (std::size_t i = 0; i < 1001; i++) {
+        states.push_back(static_cast<Index>(i * 7 % 4));
+        triggers.push_back(static_cast<Index>(i * 5 % 3));
+        instances.push_back(definition.createInstance(static_cast<State>(states.back())));
+    }
+    for (int round = 0; round < 3; round++) {
+        table.fireAll(states.data(), triggers.data(), states.size());
+        for (std::size_t i = 0; i < instances.size(); i++) {
+            definition.fire(instances[i], static_cast<Trigger>(triggers[i]));
+            assert(definition.getState(instances[i]) == static_cast<State>(states[i]));
+        }
+        table.fireAll(states.data(), static_cast<Index>(Trigger::X), states.size());
+        definition.fireAll(instances.data(), instances.size(), Trigger::X);
+        for (std::size_t i = 0; i < instances.size(); i++) {
+            assert(definition.getState(instances[i]) == static_cast<State>(states[i]));
+        }
+    }
+}
+
+void testTransitionTable() {
+    std::cout << "-- testTransitionTable\n";
+    for (auto kernel : {TransitionTable<std::uint8_t>::Kernel::Scalar, TransitionTable<std::uint8_t>::Kernel::AVX2, TransitionTable<std::uint8_t>::Kernel::AVX512}) {
+        if (TransitionTable<std::uint8_t>::isSupported(kernel)) {
+            std::cout << "kernel " << static_cast<int>(kernel) << "\n";
+            testTransitionTable<std::uint8_t>(kernel);
+            testTransitionTable<std::uint16_t>(static_cast<TransitionTable<std::uint16_t>::Kernel>(kernel));
+        }
+    }
+
+    // Conditions can't be expressed in a table
+    bool allowed = true;
+    MachineDefinition<std::string, std::string> guarded;
+    guarded.configure("A").permitIf("X", "B", [&allowed](){ return allowed; });
+    guarded.configure("B").permit("X", "A");
+    guarded.freeze();
+    assert(!TransitionTable<std::uint8_t>::tryCreate(guarded));
+}
+
+void testParallelFireAll() {
+    /*
+        Idle   Busy
+    */
+    std::cout << "-- testParallelFireAll\n";
+    enum class State { Idle, Busy, Count };
+    enum class Trigger { Start, Stop, Count };
+    std::atomic<int> started(0);
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::Idle)
+        .permit(Trigger::Start, State::Busy)
+        .ignore(Trigger::Stop);
+    definition.configure(State::Busy)
+        .permit(Trigger::Stop, State::Idle)
+        .ignore(Trigger::Start)
+        .onEntry([&started](){ started++; });
+    const std::size_t count = 100000;
+    std::vector<MachineInstance<State>> instances;
+    std::vector<Trigger> triggers;
+    for (std::size_t i = 0; i < count; i++) {
+        instances.push_back(definition.createInstance(i % 3 ? State::Idle : State::Busy));
+        triggers.push_back(i % 5 ? Trigger::Start : Trigger::Stop);
+    }
+    definition.freeze();
+    auto expected = instances;
+    definition.fireAll(expected.data(), triggers.data(), count);
+    started = 0;
+
+    ThreadPool pool(4);
+    assert(pool.getThreadCount() == 4);
+    fireAll(pool, definition, instances.data(), triggers.data(), count);
+    for (std::size_t i = 0; i < count; i++) {
+        assert(definition.getState(instances[i]) == definition.getState(expected[i]));
+    }
+    fireAll(pool, definition, instances.data(), count, Trigger::Stop);
+    fireAll(pool, definition, instances.data(), count, Trigger::Start);
+    for ([[maybe_unused]] auto &instance : instances) {
+        assert(definition.isInState(instance, State::Busy));
+    }
+    std::cout << started << "\n";
+    assert(started == 53333 + 100000);
+
+    // Small loops run on the calling thread
+    std::thread::id caller;
+    pool.parallelFor(10, [&caller](std::size_t, std::size_t){ caller = std::this_thread::get_id(); });
+    assert(caller == std::this_thread::get_id());
+}
+
+void testConcurrentInstance() {
+    /*
+        A > B > C > D > A
+    */
+    std::cout << "-- testConcurrentInstance\n";
+    enum class State { A, B, C, D, E, Count };
+    enum class Trigger { Next, Back, Poke, Count };
+    std::atomic<bool> canGoBack(false);
+    int poked = 0;
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::A)
+        .permit(Trigger::Next, State::B)
+        .defer(Trigger::Back);
+    definition.configure(State::B)
+        .permit(Trigger::Next, State::C)
+        .internalTransition(Trigger::Poke, [&poked](){ poked++; });
+    definition.configure(State::C)
+        .permit(Trigger::Next, State::D)
+        .permit(Trigger::Poke, State::E);
+    definition.configure(State::E).onEntry([&poked](){ poked++; });
+    definition.configure(State::D)
+        .permit(Trigger::Next, State::A)
+        .permitIf(Trigger::Back, State::A, [&canGoBack](){ return canGoBack.load(); })
+        .ignore(Trigger::Back);
+    ConcurrentMachineInstance<State> instance(definition.createInstance(State::A));
+    definition.freeze();
+
+    // Every fire is applied exactly once, so 4000 steps bring the ring back to A
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&definition, &instance](){
+            for (int i = 0; i < 1000; i++) {
+                definition.fire(instance, Trigger::Next);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    assert(definition.isInState(instance, State::A));
+    definition.fire(instance, Trigger::Next);
+    assert(definition.isInState(instance, State::B));
+    definition.fire(instance, Trigger::Next);
+    definition.fire(instance, Trigger::Next);
+    assert(definition.getState(instance) == State::D);
+
+    // Guards are evaluated, ignores keep the state
+    definition.fire(instance, Trigger::Back);
+    assert(definition.isInState(instance, State::D));
+    canGoBack = true;
+    definition.fire(instance, Trigger::Back);
+    assert(definition.isInState(instance, State::A));
+
+    // Deferred in A, but the instance can't keep it
+    bool unhandled = false;
+    definition.onUnhandledTrigger([&unhandled](State, Trigger){ unhandled = true; });
+    [[maybe_unused]] auto fired = definition.fire(instance, Trigger::Back);
+    assert(!fired && unhandled && definition.isInState(instance, State::A));
+
+    // Internal actions and transitions with callbacks are refused, without running anything
+    unhandled = false;
+    fired = definition.fire(instance, Trigger::Next);
+    assert(fired && definition.isInState(instance, State::B));
+    fired = definition.fire(instance, Trigger::Poke);
+    assert(!fired && definition.isInState(instance, State::B));
+    fired = definition.fire(instance, Trigger::Next);
+    assert(fired && definition.isInState(instance, State::C));
+    fired = definition.fire(instance, Trigger::Poke);
+    assert(!fired && definition.isInState(instance, State::C));
+    assert(poked == 0 && !unhandled);
+}
+
+void testRunToCompletion() {
+    /*
+        A   B   C
+    */
+    std::cout << "-- testRunToCompletion\n";
+    std::string sequence;
+    Machine<std::string, std::string> m("A");
+    m.configure("A")
+        .permit("X", "B")
+        .onExit([&sequence](){ sequence += "<A"; });
+    m.configure("B")
+        .permit<int>("Y", "C")
+        .onEntryFrom("X", [&sequence, &m](){
+            // Fired while entering B, runs after B has been entered
+            m.fire("Y", 42);
+            m.fire("Z");
+            sequence += ">B";
+        })
+        .onExit([&sequence](){ sequence += "<B"; });
+    m.configure("C")
+        .onEntryFrom<int>("Y", [&sequence, &m]([[maybe_unused]] int i){
+            assert(i == 42);
+            assert(m.isInState("C"));
+            sequence += ">C";
+        })
+        .internalTransition("Z", [&sequence, &m](){
+            sequence += "*";
+            m.fire("W");
+        })
+        .ignore("W");
+    m.fire("X");
+    std::cout << sequence << "\n";
+    assert(sequence == "<A>B<B>C*");
+    assert(m.isInState("C"));
+
+    // More triggers than the queue holds inline are fired in order all the same
+    std::vector<int> counted;
+    Machine<std::string, std::string> counter("Counting");
+    counter.configure("Counting")
+        .internalTransition("Start", [&counter](){
+            for (int i = 0; i < 3 * MACHINE_QUEUE_CAPACITY; i++) {
+                counter.fire("Count", i);
+            }
+        })
+        .permitReentry<int>("Count")
+        .onEntryFrom<int>("Count", [&counted, &counter](int i){
+            counted.push_back(i);
+            if (i == MACHINE_QUEUE_CAPACITY) {
+                counter.fire("Count", -1);
+            }
+        });
+    counter.fire("Start");
+    assert(counted.size() == 3 * MACHINE_QUEUE_CAPACITY + 1);
+    assert(counted[MACHINE_QUEUE_CAPACITY] == MACHINE_QUEUE_CAPACITY && counted.back() == -1);
+    for (int i = 0; i < 3 * MACHINE_QUEUE_CAPACITY; i++) {
+        assert(counted[static_cast<std::size_t>(i)] == i);
+    }
+    counted.clear();
+    counter.fire("Start");
+    assert(counted.size() == 3 * MACHINE_QUEUE_CAPACITY + 1);
+
+    // Same for orthogonal regions
+    int regionCount = 0;
+    OrthogonalMachine<std::string, std::string> regions("Both");
+    regions.configure("Both").orthogonal();
+    regions.configure("Left")
+        .substateOf("Both")
+        .internalTransition("Start", [&regions](){
+            for (int i = 0; i < 2 * MACHINE_QUEUE_CAPACITY; i++) {
+                regions.fire("Count");
+            }
+        })
+        .internalTransition("Count", [&regionCount](){ regionCount++; });
+    regions.configure("Right").substateOf("Both");
+    regions.fire("Start");
+    assert(regionCount == 2 * MACHINE_QUEUE_CAPACITY);
+}
+
+void testDeferredTriggers() {
+    /*
+        Idle   Working
+                 Busy
+                 Saving
+    */
+    std::cout << "-- testDeferredTriggers\n";
+    std::string sequence;
+    Machine<std::string, std::string> m("Idle");
+    m.configure("Idle")
+        .permit<int>("Job", "Busy")
+        .permit("Stop", "Stopped");
+    m.configure("Working")
+        .defer<int>("Job")
+        .defer("Stop");
+    m.configure("Busy")
+        .substateOf("Working")
+        .onEntryFrom<int>("Job", [&sequence](int job){ sequence += ">B" + std::to_string(job); })
+        .permit("Done", "Saving");
+    m.configure("Saving")
+        .substateOf("Working")
+        .onEntry([&sequence, &m](){
+            // Queued, and fired before the deferred triggers are looked at again
+            m.fire("Saved");
+            sequence += ">S";
+        })
+        .permit("Saved", "Idle");
+
+    m.fire("Job", 1);
+    m.fire("Job", 2);
+    m.fire("Stop");
+    m.fire("Job", 3);
+    assert(m.isInState("Busy") && m.getDeferredCount() == 3);
+
+    // Idle fires Job 2 again, Stop and Job 3 stay deferred by Busy, in order
+    m.fire("Done");
+    assert(sequence == ">B1>S>B2");
+    assert(m.isInState("Busy") && m.getDeferredCount() == 2);
+
+    // Idle fires Stop again, then Job 3 which Stopped doesn't handle
+    std::string unhandled;
+    m.onUnhandledTrigger([&unhandled](const std::string &state, const std::string &trigger){ unhandled = state + " " + trigger; });
+    m.fire("Done");
+    assert(sequence == ">B1>S>B2>S");
+    assert(m.isInState("Stopped") && m.getDeferredCount() == 0);
+    assert(unhandled == "Stopped Job");
+
+    // An instance has nowhere to keep deferred triggers
+    MachineDefinition<std::string, std::string> definition;
+    definition.configure("Idle").defer("Stop");
+    definition.onUnhandledTrigger([&unhandled](const std::string &state, const std::string &trigger){ unhandled = state + " " + trigger; });
+    definition.freeze();
+    auto instance = definition.createInstance("Idle");
+    definition.fire(instance, "Stop");
+    assert(unhandled == "Idle Stop");
+}
+
+void testOrthogonalRegions() {
+    /*
+        Off   Editing
+                Text        Mode
+                  Plain       Insert
+                  Bold        Overwrite
+    */
+    std::cout << "-- testOrthogonalRegions\n";
+    std::string sequence;
+    int saved = 0;
+    OrthogonalMachine<std::string, std::string> m("Off");
+    for (std::string state : {"Off", "Editing", "Text", "Plain", "Bold", "Mode", "Insert", "Overwrite"}) {
+        m.configure(state)
+            .onEntry([&sequence, state](){ sequence += ">" + state; })
+            .onExit([&sequence, state](){ sequence += "<" + state; });
+    }
+    m.configure("Off")
+        .permit("Open", "Editing")
+        .permit("Jump", "Overwrite");
+    m.configure("Editing")
+        .orthogonal()
+        .permit("Close", "Off")
+        .internalTransition("Save", [&saved, &m](){
+            saved++;
+            // Queued until both regions have handled Save
+            m.fire("Toggle");
+        });
+    m.configure("Text")
+        .substateOf("Editing")
+        .initialTransition("Plain");
+    m.configure("Plain")
+        .substateOf("Text")
+        .permit("Toggle", "Bold");
+    m.configure("Bold")
+        .substateOf("Text")
+        .permit("Toggle", "Plain");
+    m.configure("Mode")
+        .substateOf("Editing")
+        .initialTransition("Insert");
+    m.configure("Insert")
+        .substateOf("Mode")
+        .permit("Toggle", "Overwrite");
+    m.configure("Overwrite")
+        .substateOf("Mode")
+        .permit("Toggle", "Insert")
+        .ignore("Save");
+    m.freeze();
+
+    // Entering the orthogonal state enters every region
+    m.fire("Open");
+    assert(sequence == "<Off>Editing>Text>Plain>Mode>Insert");
+    assert(m.isInState("Editing") && m.isInState("Plain") && m.isInState("Insert") && !m.isInState("Bold"));
+
+    // One trigger moves both regions
+    sequence.clear();
+    m.fire("Toggle");
+    assert(sequence == "<Plain>Bold<Insert>Overwrite");
+    assert(m.isInState("Bold") && m.isInState("Overwrite"));
+
+    // Overwrite ignores Save, Bold gets it from Editing
+    m.fire("Save");
+    assert(saved == 1 && m.isInState("Plain") && m.isInState("Insert"));
+    m.fire("Save");
+    assert(saved == 2 && m.isInState("Bold") && m.isInState("Overwrite"));
+
+    // Leaving the orthogonal state exits every region, innermost first
+    sequence.clear();
+    m.fire("Close");
+    assert(sequence == "<Overwrite<Mode<Bold<Text<Editing>Off");
+    assert(m.isInState("Off") && !m.isInState("Editing") && !m.isInState("Text"));
+
+    // Entering one region enters the others in their initial substates
+    sequence.clear();
+    m.fire("Jump");
+    assert(sequence == "<Off>Editing>Mode>Overwrite>Text>Plain");
+    assert(m.isInState("Overwrite") && m.isInState("Plain"));
+
+    // A trigger no region handles is reported once
+    int unhandled = 0;
+    m.onUnhandledTrigger([&unhandled](const std::string &, const std::string &){ unhandled++; });
+    m.fire("Open");
+    m.fire("Unknown");
+    assert(unhandled == 2);
+
+    // A configuration created inside a region starts the other regions in their initial substates
+    MachineDefinition<std::string, std::string> &definition = m;
+    auto configuration = definition.createConfiguration("Bold");
+    assert(definition.isInState(configuration, "Bold") && definition.isInState(configuration, "Insert"));
+    assert(definition.isInState(configuration, "Editing") && !definition.isInState(configuration, "Plain"));
+
+    // A region without initial transition is a leaf, and moves into its own substate without being exited
+    OrthogonalMachine<std::string, std::string> regions("Both");
+    regions.configure("Both").orthogonal();
+    regions.configure("Left").substateOf("Both").permit("Go", "Child").onExit([&sequence](){ sequence += "<Left"; });
+    regions.configure("Child").substateOf("Left").onEntry([&sequence](){ sequence += ">Child"; });
+    regions.configure("Right").substateOf("Both");
+    regions.freeze();
+    sequence.clear();
+    regions.fire("Go");
+    assert(sequence == ">Child");
+    assert(regions.isInState("Left") && regions.isInState("Child") && regions.isInState("Right"));
+}
+
+void testMailbox() {
+    /*
+        Counting > Stopped
+    */
+    std::cout << "-- testMailbox\n";
+    enum class State { Counting, Stopped, Count };
+    enum class Trigger { Add, Stop, Count };
+    long total = 0;
+    int dispatched = 0;
+    MailboxMachine<State, Trigger, 8> m(State::Counting);
+    m.configure(State::Counting)
+        .permitReentry<int>(Trigger::Add)
+        .onEntryFrom<int>(Trigger::Add, [&total, &dispatched](int value){ total += value; dispatched++; })
+        .permit(Trigger::Stop, State::Stopped);
+    m.configure(State::Stopped)
+        .ignore<int>(Trigger::Add);
+    m.freeze();
+
+    // Posting from the owning thread doesn't fire anything until dispatched
+    [[maybe_unused]] auto posted = m.post(Trigger::Add, 5);
+    assert(posted && total == 0 && m.getPendingCount() == 1);
+    [[maybe_unused]] auto count = m.dispatchPending();
+    assert(count == 1 && total == 5 && m.getPendingCount() == 0);
+
+    // A full mailbox refuses further triggers
+    for (int i = 0; i < 8; i++) {
+        posted = m.post(m.getTriggerHandle(Trigger::Add), 1);
+        assert(posted);
+    }
+    posted = m.post(Trigger::Add, 1);
+    assert(!posted);
+    count = m.dispatchPending(3);
+    assert(count == 3);
+    count = m.dispatchPending();
+    assert(count == 5 && total == 13);
+
+    // Producers retry while the mailbox is full, the owner dispatches until everything has arrived
+    total = 0;
+    dispatched = 0;
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; t++) {
+        producers.emplace_back([&m](){
+            for (int i = 1; i <= 1000; i++) {
+                while (!m.post(Trigger::Add, i)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    while (dispatched < 4000) {
+        m.dispatchPending();
+    }
+    for (auto &producer : producers) {
+        producer.join();
+    }
+    assert(total == 4 * 500500);
+
+    m.post(Trigger::Stop);
+    m.post(Trigger::Add, 1);
+    count = m.dispatchPending();
+    assert(count == 2);
+    assert(m.isInState(State::Stopped));
+    assert(total == 4 * 500500);
+
+    // Triggers which aren't configured are refused
+    MailboxMachine<std::string, std::string> named("Idle");
+    named.configure("Idle").permit("Go", "Busy");
+    named.configure("Busy");
+    named.freeze();
+    posted = named.post("Unknown");
+    assert(!posted && named.getPendingCount() == 0);
+    posted = named.post("Go");
+    count = named.dispatchPending();
+    assert(posted && count == 1 && named.isInState("Busy"));
+}
+
+void testScheduler() {
+    /*
+        Running
+    */
+    std::cout << "-- testScheduler\n";
+    enum class State { Running, Count };
+    enum class Trigger { Add, Relay, Count };
+    using CounterActor = Actor<State, Trigger>;
+    std::atomic<long> total(0);
+    std::atomic<int> relays(0);
+    std::deque<CounterActor> actors;
+    MachineDefinition<State, Trigger> definition;
+    definition.configure(State::Running)
+        .permitReentry<int>(Trigger::Add)
+        .onEntryFrom<int>(Trigger::Add, [&total](int value){ total += value; })
+        .permitReentry<std::size_t>(Trigger::Relay)
+        .onEntryFrom<std::size_t>(Trigger::Relay, [&actors, &relays](std::size_t hops){
+            // Posted from a worker, fired in a later slice
+            relays++;
+            if (hops > 0) {
+                actors[hops % actors.size()].post(Trigger::Relay, hops - 1);
+            }
+        });
+    definition.freeze();
+
+    Scheduler scheduler(2, 2);
+    for (int i = 0; i < 100; i++) {
+        actors.emplace_back(scheduler, definition, definition.createInstance(State::Running));
+    }
+
+    // Two threads post to every actor, retrying while mailboxes are full
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 2; t++) {
+        producers.emplace_back([&actors](){
+            for (int i = 1; i <= 10; i++) {
+                for (auto &actor : actors) {
+                    while (!actor.post(Trigger::Add, i)) {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+        });
+    }
+    for (auto &producer : producers) {
+        producer.join();
+    }
+    scheduler.waitIdle();
+    assert(total == 2 * 100 * 55);
+
+    // Actors posting to each other
+    actors[0].post(Trigger::Relay, std::size_t(1000));
+    scheduler.waitIdle();
+    assert(relays == 1001);
+
+    [[maybe_unused]] auto stats = scheduler.getStats();
+    assert(stats.fEvents == 2000 + 1001);
+    assert(stats.fSlices * scheduler.getBudget() >= stats.fEvents);
+    assert(stats.fMaxMailboxDepth <= MACHINE_ACTOR_CAPACITY);
+    assert(stats.fMaxRunQueueDepth <= actors.size());
+    scheduler.resetStats();
+    assert(scheduler.getStats().fEvents == 0);
+
+    // A busy actor yields after its budget, triggers of one actor keep their order
+    std::vector<int> sequence;
+    MachineDefinition<State, Trigger> recording;
+    recording.configure(State::Running)
+        .permitReentry<int>(Trigger::Add)
+        .onEntryFrom<int>(Trigger::Add, [&sequence](int value){ sequence.push_back(value); });
+    recording.freeze();
+    CounterActor actor(scheduler, recording, recording.createInstance(State::Running));
+    for (int i = 0; i < 4; i++) {
+        while (!actor.post(Trigger::Add, i)) {
+            std::this_thread::yield();
+        }
+    }
+    scheduler.waitIdle();
+    assert((sequence == std::vector<int>{0, 1, 2, 3}));
+    assert(scheduler.getStats().fSlices >= 2);
+    assert(actor.isInState(State::Running) && actor.getPendingCount() == 0);
+
+    // Triggers which aren't configured are refused
+    MachineDefinition<std::string, std::string> named;
+    named.configure("Idle").permit("Go", "Busy");
+    named.configure("Busy");
+    named.freeze();
+    Actor<std::string, std::string> namedActor(scheduler, named, named.createInstance("Idle"));
+    [[maybe_unused]] auto posted = namedActor.post("Unknown");
+    assert(!posted && namedActor.getPendingCount() == 0);
+    posted = namedActor.post("Go");
+    scheduler.waitIdle();
+    assert(posted && namedActor.isInState("Busy"));
+}
+
+#ifdef __cpp_impl_coroutine
+// Stands in for an event loop: awaiting an operation suspends until the loop completes it
+struct FakeIo {
+    struct Operation {
+        bool await_ready() {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting) {
+            fIo.fPending.push_back(awaiting);
+        }
+
+        void await_resume() {}
+
+        FakeIo &fIo;
+    };
+
+    Operation operation() {
+        return {*this};
+    }
+
+    // Completes the operations started so far
+    void run() {
+        auto pending = std::move(fPending);
+        fPending.clear();
+        for (auto &awaiting : pending) {
+            awaiting.resume();
+        }
+    }
+
+    std::vector<std::coroutine_handle<>> fPending;
+};
+
+void testAsync() {
+    /*
+        Idle > Connecting > Connected
+    */
+    std::cout << "-- testAsync\n";
+    std::string sequence;
+    FakeIo io;
+    AsyncMachine<std::string, std::string> m("Idle");
+    m.configure("Idle")
+        .permit<int>("Connect", "Connecting")
+        .onExit(m.async([&sequence, &io]() -> Task {
+            sequence += "<I";
+            co_await io.operation();
+            sequence += "<I+";
+        }));
+    m.configure("Connecting")
+        .onEntryFrom<int>("Connect", m.async([&sequence, &io]([[maybe_unused]] int port) -> Task {
+            assert(port == 80);
+            sequence += ">C";
+            co_await io.operation();
+            sequence += ">C+";
+        }))
+        .permit("Done", "Connected");
+    m.configure("Connected")
+        .onEntry([&sequence](){ sequence += ">D"; });
+
+    auto client = [&m, &sequence]() -> Task {
+        co_await m.fireAsync("Connect", 80);
+        sequence += "!";
+        co_await m.fireAsync("Done");
+        sequence += "!";
+    };
+    auto watcher = [&m, &sequence]() -> Task {
+        co_await m.awaitState("Connected");
+        sequence += "@";
+    };
+
+    auto watching = watcher();
+    auto connecting = client();
+    // Both actions run until their I/O, the transition waits for them
+    assert(sequence == "<I>C");
+    assert(m.isInState("Connecting") && m.isBusy() && !connecting.done());
+    // Unhandled triggers are reported right away, even while busy
+    bool unhandled = false;
+    m.onUnhandledTrigger([&unhandled](const std::string &, const std::string &){ unhandled = true; });
+    m.fire("Unknown");
+    assert(unhandled);
+    io.run();
+    assert(sequence == "<I>C<I+>C+!>D@!");
+    assert(connecting.done() && watching.done() && !m.isBusy());
+    assert(m.isInState("Connected"));
+
+    // Plain fire waits for the async actions too, awaiting a state already reached doesn't suspend
+    m.configure("Connected").permit("Reset", "Idle");
+    m.configure("Idle").permit("Connect", "Connecting");
+    sequence.clear();
+    m.fire("Reset");
+    auto reset = [&m]() -> Task { co_await m.awaitState("Idle"); };
+    // Started outside the assert, so release builds run it too
+    [[maybe_unused]] auto resetting = reset();
+    assert(resetting.done());
+    m.fire<int>("Connect", 80);
+    m.fire("Done");
+    assert(sequence == "<I>C" && m.isInState("Connecting"));
+    io.run();
+    assert(sequence == "<I>C<I+>C+>D" && m.isInState("Connected"));
+
+    // Tasks finishing before the transition returns resume the awaiting coroutine once, after it has suspended
+    AsyncMachine<std::string, std::string> closing("Open");
+    closing.configure("Open")
+        .permit("Close", "Closed")
+        .onExit(closing.async([&io]() -> Task { co_await io.operation(); }));
+    closing.configure("Closed")
+        .onEntry([&io](){ io.run(); });
+    closing.freeze();
+    auto closer = [&closing, &sequence]() -> Task {
+        co_await closing.fireAsync("Close");
+        sequence += "!";
+    };
+    sequence.clear();
+    auto closed = closer();
+    assert(closed.done() && sequence == "!");
+    assert(closing.isInState("Closed") && !closing.isBusy());
+
+    // A frozen machine can be awaited in a state it doesn't have, which is never reached
+    auto nowhere = [&closing]() -> Task { co_await closing.awaitState("Nowhere"); };
+    [[maybe_unused]] auto waiting = nowhere();
+    assert(!waiting.done());
+}
+#endif
+
+void testTimingWheel() {
+    std::cout << "-- testTimingWheel\n";
+    using namespace std::chrono;
+    auto start = TimingWheel::Clock::time_point();
+    TimingWheel wheel(milliseconds(1), start);
+    std::vector<std::pair<int, std::uint64_t>> fired;
+    auto record = [&fired, &wheel, start](int id) {
+        return [&fired, &wheel, start, id](){
+            fired.push_back({id, std::uint64_t(duration_cast<milliseconds>(wheel.now() - start).count())});
+        };
+    };
+
+    // Delays on every level of the wheel, and beyond it
+    const std::uint64_t delays[] = {0, 1, 255, 256, 257, 65535, 65536, 70000, (1u << 24) + 5, (std::uint64_t(1) << 32) + 7};
+    for (int i = 0; i < 10; i++) {
+        wheel.schedule(milliseconds(delays[i]), record(i));
+    }
+    auto cancelled = wheel.schedule(milliseconds(300), record(-1));
+    assert(wheel.size() == 11);
+    [[maybe_unused]] auto cancel = wheel.cancel(cancelled);
+    assert(cancel);
+    cancel = wheel.cancel(cancelled);
+    assert(!cancel);
+    assert(wheel.size() == 10);
+
+    // Each timer fires at the first advance reaching its expiry
+    for (int i = 0; i < 10; i++) {
+        [[maybe_unused]] auto before = fired.size();
+        if (delays[i] > 0) {
+            wheel.advance(start + milliseconds(delays[i]) - microseconds(1));
+            assert(fired.size() == before);
+        }
+        wheel.advance(start + milliseconds(delays[i]));
+        assert(fired.size() == before + 1 && fired.back().first == i);
+    }
+    assert(wheel.size() == 0);
+
+    // Timers round up to the next tick, several fire in order of expiry within one advance
+    fired.clear();
+    wheel.advance(wheel.now() + microseconds(500));
+    wheel.schedule(milliseconds(2), record(2));
+    wheel.schedule(milliseconds(1), record(1));
+    wheel.schedule(microseconds(1), record(0));
+    [[maybe_unused]] auto expired = wheel.advance(wheel.now() + milliseconds(10));
+    assert(expired == 3);
+    assert(fired.size() == 3 && fired[0].first == 0 && fired[1].first == 1 && fired[2].first == 2);
+
+    // Callbacks can schedule and cancel other timers
+    fired.clear();
+    wheel.advance(start + ceil<milliseconds>(wheel.now() - start));
+    TimingWheel::TimerHandle victim;
+    wheel.schedule(milliseconds(5), [&](){
+        wheel.cancel(victim);
+        wheel.schedule(milliseconds(0), record(1));
+        wheel.schedule(milliseconds(256), record(2));
+    });
+    victim = wheel.schedule(milliseconds(5), record(-1));
+    wheel.advance(wheel.now() + milliseconds(5));
+    wheel.advance(wheel.now() + milliseconds(1));
+    assert(fired.size() == 1 && fired[0].first == 1);
+    wheel.advance(wheel.now() + milliseconds(300));
+    assert(fired.size() == 2 && fired[1].first == 2 && wheel.size() == 0);
+}
+
+void testTimedMachine() {
+    /*
+        Idle   Online
+                 Handshaking
+                 Connected
+    */
+    std::cout << "-- testTimedMachine\n";
+    using namespace std::chrono;
+    auto start = TimingWheel::Clock::time_point();
+    TimingWheel wheel(milliseconds(1), start);
+    std::string sequence;
+    TimedMachine<std::string, std::string> m(wheel, "Idle");
+    m.configure("Idle")
+        .permit("Connect", "Handshaking")
+        .onEntryFrom("IdleTimeout", [&sequence](){ sequence += ">I(idle)"; })
+        .onEntryFrom("HandshakeTimeout", [&sequence](){ sequence += ">I(handshake)"; });
+    m.configure("Online")
+        .permitAfter("IdleTimeout", seconds(60), "Idle");
+    m.configure("Handshaking")
+        .substateOf("Online")
+        .permitAfter("HandshakeTimeout", milliseconds(100), "Idle")
+        .permit("Done", "Connected");
+    m.configure("Connected")
+        .substateOf("Online")
+        .permitReentry("Activity");
+    m.freeze();
+
+    // The handshake times out
+    m.fire("Connect");
+    assert(m.getTimerCount() == 2 && wheel.size() == 2);
+    wheel.advance(start + milliseconds(99));
+    assert(m.isInState("Handshaking"));
+    wheel.advance(start + milliseconds(100));
+    assert(m.isInState("Idle") && sequence == ">I(handshake)");
+    assert(m.getTimerCount() == 0 && wheel.size() == 0);
+
+    // Leaving Handshaking cancels its timer, the Online timer keeps running through Connected
+    m.fire("Connect");
+    wheel.advance(start + milliseconds(150));
+    m.fire("Done");
+    assert(m.isInState("Connected") && wheel.size() == 1);
+    wheel.advance(start + seconds(10));
+    m.fire("Activity");
+    assert(m.isInState("Connected"));
+    wheel.advance(start + milliseconds(100) + seconds(60) - milliseconds(1));
+    assert(m.isInState("Connected"));
+    wheel.advance(start + milliseconds(100) + seconds(60));
+    assert(m.isInState("Idle") && sequence == ">I(handshake)>I(idle)");
+    assert(wheel.size() == 0);
+
+    // Timers of a destroyed machine are cancelled
+    {
+        TimedMachine<std::string, std::string> other(wheel, "Idle");
+        other.configure("Idle").permitAfter("Tick", milliseconds(1), "Other");
+        other.configure("Other").permit("Back", "Idle");
+        other.fire("Tick");
+        other.fire("Back");
+        assert(wheel.size() == 1);
+    }
+    assert(wheel.size() == 0);
+
+    // The timers of the initial state and its ancestors are scheduled by freeze
+    auto configure = [](TimedMachine<std::string, std::string> &machine) {
+        machine.configure("Online")
+            .permitAfter("IdleTimeout", seconds(60), "Idle");
+        machine.configure("Handshaking")
+            .substateOf("Online")
+            .permitAfter("HandshakeTimeout", milliseconds(100), "Idle");
+        machine.freeze();
+    };
+    TimedMachine<std::string, std::string> session(wheel, "Handshaking");
+    configure(session);
+    assert(session.getTimerCount() == 2 && wheel.size() == 2);
+    wheel.advance(wheel.now() + milliseconds(100));
+    assert(session.isInState("Idle") && wheel.size() == 0);
+
+    // A restored session times out again, its timers are scheduled from the time it is restored
+    TimedMachine<std::string, std::string> saved(wheel, "Handshaking");
+    configure(saved);
+    std::stringstream stream;
+    [[maybe_unused]] auto written = saved.snapshot(stream);
+    [[maybe_unused]] auto restored = session.restore(stream);
+    assert(written && restored);
+    assert(session.isInState("Handshaking") && session.getTimerCount() == 2);
+    wheel.advance(wheel.now() + milliseconds(99));
+    assert(session.isInState("Handshaking"));
+    wheel.advance(wheel.now() + milliseconds(1));
+    assert(session.isInState("Idle") && saved.isInState("Idle"));
+}
+
+void testHandles() {
+    /*
+        A   B
+    */
+    std::cout << "-- testHandles\n";
+    std::string sequence;
+    Machine<std::string, std::string> m("A");
+    m.configure("A")
+        .permit("X", "B")
+        .onEntry([&sequence](){ std::cout << "entering A\n"; sequence += ">A"; })
+        .onExit([&sequence](){ std::cout << "exiting A\n"; sequence += "<A"; });
+    m.configure("B")
+        .permit("X", "A")
+        .onEntry([&sequence](){ std::cout << "entering B\n"; sequence += ">B"; })
+        .onExit([&sequence](){ std::cout << "exiting B\n"; sequence += "<B"; });
+    m.onUnhandledTrigger([&sequence](std::string state, std::string trigger){ sequence += "!" + state + trigger; });
+    auto x = m.getTriggerHandle("X");
+    [[maybe_unused]] auto a = m.getStateHandle("A");
+    [[maybe_unused]] auto b = m.getStateHandle("B");
+    m.freeze();
+    assert(m.isInState(a));
+    m.fire(x);
+    assert(m.isInState(b));
+    assert(m.isInState(std::string_view("B")));
+    m.fire(std::string_view("X"));
+    assert(m.isInState(a));
+    m.fire("Y");
+    assert(m.getState() == "A");
+    std::cout << sequence << "\n";
+    assert(sequence == "<A>B<B>A!AY");
+}
+
+void testArgumentMismatch() {
+    /*
+        A ~ B
+    */
+    std::cout << "-- testArgumentMismatch\n";
+    std::string sequence;
+    Machine<std::string, std::string> m("A");
+    m.configure("A")
+        .permitDynamic<int>("X", [](int){ return std::string("B"); });
+    m.configure("B");
+    m.onUnhandledTrigger([&sequence](std::string state, std::string trigger){ sequence += "!" + state + trigger; });
+    m.fire("X");
+    assert(m.isInState("A"));
+    m.fire("X", 1.0f);
+    assert(m.isInState("A"));
+    m.fire("X", 1);
+    assert(m.isInState("B"));
+    std::cout << sequence << "\n";
+    assert(sequence == "!AX!AX");
+}
+
+void testEntryFromSignatures() {
+    /*
+        A ~ B
+    */
+    std::cout << "-- testEntryFromSignatures\n";
+    std::string sequence;
+    std::string name = "B";
+    Machine<std::string, std::string> m("A");
+    m.configure("A")
+        .permitDynamic<int>("X", [](int){ return std::string("B"); })
+        .permitDynamic<std::string>("X", [](std::string){ return std::string("B"); });
+    m.configure("B")
+        .permitReentry<int>("X")
+        .onEntryFrom<int>("X", [&sequence, name](int i){ sequence += ">" + name + std::to_string(i); })
+        .onEntryFrom<std::string>("X", [&sequence, name](std::string s){ sequence += ">" + name + s; })
+        .onEntryFrom<int>("X", [&sequence, name](int i){ sequence += "=>" + name + std::to_string(i); })
+        .onExit([&sequence](){ sequence += "<B"; });
+    m.fire("X", 1);
+    assert(m.isInState("B"));
+    m.fire("X", 2);
+    std::cout << sequence << "\n";
+    assert(sequence == "=>B1<B=>B2");
+}
+
+void testIsInStateHierarchy() {
+    /*
+            A
+           / \
+          B   E
+          |
+          C
+          |
+          D
+    */
+    std::cout << "-- testIsInStateHierarchy\n";
+    Machine<std::string, std::string> m("D");
+    m.configure("A");
+    m.configure("B").substateOf("A");
+    m.configure("C").substateOf("B");
+    m.configure("D").substateOf("C").permit("X", "E");
+    m.configure("E").substateOf("A").permit("X", "D");
+    assert(m.isInState("A"));
+    assert(m.isInState("B"));
+    assert(m.isInState("C"));
+    assert(m.isInState("D"));
+    assert(!m.isInState("E"));
+    assert(!m.isInState("F"));
+    m.fire("X");
+    assert(m.isInState("A"));
+    assert(!m.isInState("B"));
+    assert(!m.isInState("D"));
+    assert(m.isInState("E"));
+    m.configure("F").substateOf("E");
+    assert(m.isInState("E"));
+    assert(!m.isInState("F"));
+}
+
+void testEnterThroughInitialState() {
+    /*
+            A
+           / \
+          B   C
+             / \
+            D   E
+    */
+    std::cout << "-- testEnterThroughInitialState\n";
+    std::string sequence;
+    Machine<std::string, std::string> m("B");
+    m.configure("A")
+        .onEntry([&sequence](){ std::cout << "entering A\n"; sequence += ">A"; })
+        .onExit([&sequence](){ std::cout << "exiting A\n"; sequence += "<A"; });
+    m.configure("B")
+        .substateOf("A")
+        .permit("X", "D")
+        .permitDynamic("Y", [](){ return std::string("C"); })
+        .onEntry([&sequence](){ std::cout << "entering B\n"; sequence += ">B"; })
+        .onExit([&sequence](){ std::cout << "exiting B\n"; sequence += "<B"; });
+    m.configure("C")
+        .substateOf("A")
+        .initialTransition("E")
+        .permit("X", "B")
+        .onEntry([&sequence](){ std::cout << "entering C\n"; sequence += ">C"; })
+        .onExit([&sequence](){ std::cout << "exiting C\n"; sequence += "<C"; });
+    m.configure("D")
+        .substateOf("C")
+        .onEntry([&sequence](){ std::cout << "entering D\n"; sequence += ">D"; })
+        .onExit([&sequence](){ std::cout << "exiting D\n"; sequence += "<D"; });
+    m.configure("E")
+        .substateOf("C")
+        .onEntry([&sequence](){ std::cout << "entering E\n"; sequence += ">E"; })
+        .onExit([&sequence](){ std::cout << "exiting E\n"; sequence += "<E"; });
+    m.fire("X");
+    assert(m.isInState("D"));
+    assert(!m.isInState("E"));
+    m.fire("X");
+    assert(m.isInState("B"));
+    m.fire("Y");
+    assert(m.isInState("E"));
+    m.fire("X");
+    m.fire("Y");
+    assert(m.isInState("E"));
+    std::cout << sequence << "\n";
+    assert(sequence == "<B>C>D<D<C>B<B>C>E<E<C>B<B>C>E");
+}
+
+std::string staticSequence;
+bool staticPowered = false;
+
+template <char State>
+void staticEntering() {
+    staticSequence += '>';
+    staticSequence += State;
+}
+
+template <char State>
+void staticExiting() {
+    staticSequence += '<';
+    staticSequence += State;
+}
+
+void staticToggled() {
+    staticSequence += '*';
+}
+
+bool isStaticPowered() {
+    return staticPowered;
+}
+
+void testStaticMachine() {
+    /*
+            A
+           / \
+          B   C
+             / \
+            D   E
+    */
+    std::cout << "-- testStaticMachine\n";
+    enum class State { A, B, C, D, E, Count };
+    enum class Trigger { X, Y, Z, Power, Count };
+
+    using namespace def;
+    using Static = StaticMachine<State, Trigger,
+        state<State::A,
+            permitReentry<Trigger::Z>,
+            internalTransition<Trigger::Power, staticToggled>,
+            onEntry<staticEntering<'A'>>, onExit<staticExiting<'A'>>>,
+        state<State::B,
+            substateOf<State::A>,
+            permitIf<Trigger::X, State::D, isStaticPowered>,
+            ignore<Trigger::X>,
+            permit<Trigger::Y, State::C>,
+            onEntry<staticEntering<'B'>>, onExit<staticExiting<'B'>>>,
+        state<State::C,
+            substateOf<State::A>,
+            initialTransition<State::E>,
+            permit<Trigger::X, State::B>,
+            onEntry<staticEntering<'C'>>, onExit<staticExiting<'C'>>>,
+        state<State::D,
+            substateOf<State::C>,
+            onEntry<staticEntering<'D'>>, onExit<staticExiting<'D'>>>,
+        state<State::E,
+            substateOf<State::C>,
+            onEntry<staticEntering<'E'>>, onExit<staticExiting<'E'>>>>;
+
+    // The same machine configured at run time
+    Machine<State, Trigger> m(State::B);
+    m.configure(State::A)
+        .permitReentry(Trigger::Z)
+        .internalTransition(Trigger::Power, staticToggled)
+        .onEntry(staticEntering<'A'>).onExit(staticExiting<'A'>);
+    m.configure(State::B)
+        .substateOf(State::A)
+        .permitIf(Trigger::X, State::D, isStaticPowered)
+        .ignore(Trigger::X)
+        .permit(Trigger::Y, State::C)
+        .onEntry(staticEntering<'B'>).onExit(staticExiting<'B'>);
+    m.configure(State::C)
+        .substateOf(State::A)
+        .initialTransition(State::E)
+        .permit(Trigger::X, State::B)
+        .onEntry(staticEntering<'C'>).onExit(staticExiting<'C'>);
+    m.configure(State::D)
+        .substateOf(State::C)
+        .onEntry(staticEntering<'D'>).onExit(staticExiting<'D'>);
+    m.configure(State::E)
+        .substateOf(State::C)
+        .onEntry(staticEntering<'E'>).onExit(staticExiting<'E'>);
+
+    Static s(State::B);
+    const Trigger triggers[] = {Trigger::X, Trigger::Power, Trigger::X, Trigger::X, Trigger::Y, Trigger::Z, Trigger::Power};
+    std::string expected;
+    for (auto trigger : triggers) {
+        if (trigger == Trigger::Power) {
+            staticPowered = !staticPowered;
+        }
+        staticSequence.clear();
+        m.fire(trigger);
+        expected += staticSequence;
+        staticSequence.clear();
+        assert(s.canFire(trigger));
+        s.fire(trigger);
+        assert(s.getState() == m.getState());
+        for ([[maybe_unused]] auto state : {State::A, State::B, State::C, State::D, State::E}) {
+            assert(s.isInState(state) == m.isInState(state));
+        }
+        std::cout << staticSequence << "\n";
+        assert(staticSequence == expected.substr(expected.size() - staticSequence.size()));
+    }
+    std::cout << expected << "\n";
+    assert(expected == "*<B>C>D<D<C>B<B>C>E<E<C>A*");
+    assert(s.isInState<State::A>() && !s.isInState<State::C>());
+
+    // A trigger given at compile time
+    staticSequence.clear();
+    s.fire<Trigger::Z>();
+    assert(staticSequence == "<A>A");
+    assert(s.isInState<State::A>());
+    assert(!s.canFire(Trigger::Y));
+    bool unhandled = false;
+    s.onUnhandledTrigger([&unhandled](State, Trigger){ unhandled = true; });
+    s.fire(Trigger::Y);
+    assert(unhandled);
+    staticPowered = false;
+
+    // Going back to a parent with an initial transition exits the child and enters it again, more states than
+    // the machine has
+    enum class Pair { P, Q, Count };
+    using Nested = StaticMachine<Pair, Trigger,
+        state<Pair::P,
+            initialTransition<Pair::Q>,
+            permitReentry<Trigger::Y>,
+            onEntry<staticEntering<'P'>>, onExit<staticExiting<'P'>>>,
+        state<Pair::Q,
+            substateOf<Pair::P>,
+            permit<Trigger::X, Pair::P>,
+            onEntry<staticEntering<'Q'>>, onExit<staticExiting<'Q'>>>>;
+    Machine<Pair, Trigger> nested(Pair::Q);
+    nested.configure(Pair::P)
+        .initialTransition(Pair::Q)
+        .permitReentry(Trigger::Y)
+        .onEntry(staticEntering<'P'>).onExit(staticExiting<'P'>);
+    nested.configure(Pair::Q)
+        .substateOf(Pair::P)
+        .permit(Trigger::X, Pair::P)
+        .onEntry(staticEntering<'Q'>).onExit(staticExiting<'Q'>);
+    Nested n(Pair::Q);
+    for (auto trigger : {Trigger::X, Trigger::Y}) {
+        staticSequence.clear();
+        nested.fire(trigger);
+        expected = staticSequence;
+        staticSequence.clear();
+        n.fire(trigger);
+        assert(staticSequence == expected);
+        assert(n.getState() == Pair::Q && nested.getState() == Pair::Q);
+    }
+    assert(expected.find(">P>Q") != std::string::npos);
+}
+
 int main() {
     testPermit();
     testInitialSubState();
@@ -468,6 +2436,34 @@ int main() {
     testInternalTransitionTwoStates();
     testInternalTransitionSubState();
     testInternalTransitionSubState2();
+    testFreeze();
+    testEnumStorage();
+    testSharedDefinition();
+    testHistory();
+    testSnapshot();
+    testImage();
+    testCodeGenerator();
+    testStatistics();
+    testFireAll();
+    testTransitionTable();
+    testParallelFireAll();
+    testConcurrentInstance();
+    testRunToCompletion();
+    testDeferredTriggers();
+    testOrthogonalRegions();
+    testMailbox();
+    testScheduler();
+#ifdef __cpp_impl_coroutine
+    testAsync();
+#endif
+    testTimingWheel();
+    testTimedMachine();
+    testHandles();
+    testArgumentMismatch();
+    testEntryFromSignatures();
+    testIsInStateHierarchy();
+    testEnterThroughInitialState();
+    testStaticMachine();
 
     std::cout << "Finished!\n";
 }
\ No newline at end of file
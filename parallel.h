@@ -0,0 +1,138 @@
+#pragma once
+
+#include "machine.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// A fixed set of threads which split loops between them. The thread calling parallelFor works along with the
+// workers, so a pool of one thread runs everything inline.
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+        for (std::size_t i = 1; i < threads; i++) {
+            fWorkers.emplace_back([this](){ work(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fStop = true;
+        }
+        fWake.notify_all();
+        for (auto &worker : fWorkers) {
+            worker.join();
+        }
+    }
+
+    std::size_t getThreadCount() const {
+        return fWorkers.size() + 1;
+    }
+
+    // Calls f(begin, end) for consecutive chunks of [0, count) on all threads and returns when all chunks are done.
+    // Chunks are handed out in order to whichever thread is free. Only one loop runs at a time.
+    template <typename F>
+    void parallelFor(std::size_t count, std::size_t chunk, F f) {
+        assert(chunk > 0);
+        if (fWorkers.empty() || count <= chunk) {
+            f(std::size_t(0), count);
+            return;
+        }
+        std::lock_guard<std::mutex> call(fCallMutex);
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fJob = [&f](std::size_t begin, std::size_t end){ f(begin, end); };
+            fCount = count;
+            fChunk = chunk;
+            fNext = 0;
+            fPending = fWorkers.size();
+            fGeneration++;
+        }
+        fWake.notify_all();
+        runChunks();
+        std::unique_lock<std::mutex> lock(fMutex);
+        fDone.wait(lock, [this](){ return fPending == 0; });
+        fJob = nullptr;
+    }
+
+    // Splits the loop in a few chunks per thread, but not so small that handing them out dominates
+    template <typename F>
+    void parallelFor(std::size_t count, F f) {
+        parallelFor(count, std::max<std::size_t>(4096, count / (getThreadCount() * 8) + 1), f);
+    }
+
+private:
+    void work() {
+        std::size_t generation = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(fMutex);
+                fWake.wait(lock, [this, generation](){ return fStop || fGeneration != generation; });
+                if (fStop) {
+                    return;
+                }
+                generation = fGeneration;
+            }
+            runChunks();
+            {
+                std::lock_guard<std::mutex> lock(fMutex);
+                if (--fPending == 0) {
+                    fDone.notify_one();
+                }
+            }
+        }
+    }
+
+    void runChunks() {
+        for (;;) {
+            auto begin = fNext.fetch_add(fChunk);
+            if (begin >= fCount) {
+                return;
+            }
+            fJob(begin, std::min(begin + fChunk, fCount));
+        }
+    }
+
+    std::vector<std::thread>                                fWorkers;
+    std::mutex                                              fCallMutex; // Held for the duration of a parallelFor
+    std::mutex                                              fMutex;
+    std::condition_variable                                 fWake;
+    std::condition_variable                                 fDone;
+    detail::InlineFunction<void(std::size_t, std::size_t)>  fJob;
+    std::size_t                                             fCount = 0;
+    std::size_t                                             fChunk = 1;
+    std::atomic<std::size_t>                                fNext{0};
+    std::size_t                                             fPending = 0; // Workers still running chunks of the job
+    std::size_t                                             fGeneration = 0;
+    bool                                                    fStop = false;
+};
+
+// Parallel versions of MachineDefinition::fireAll. The instances are split in chunks, each advanced by one thread,
+// so all callbacks of an instance run on the thread which owns its chunk. The definition has to be frozen.
+
+template <typename S, typename T, typename ...Args>
+void fireAll(ThreadPool &pool, const MachineDefinition<S, T> &definition, MachineInstance<S> *instances, std::size_t count, typename MachineDefinition<S, T>::TriggerKey trigger, Args...args) {
+    pool.parallelFor(count, [&](std::size_t begin, std::size_t end){
+        definition.template fireAll<Args...>(instances + begin, end - begin, trigger, args...);
+    });
+}
+
+template <typename S, typename T, typename ...Args>
+void fireAll(ThreadPool &pool, const MachineDefinition<S, T> &definition, MachineInstance<S> *instances, std::size_t count, typename MachineDefinition<S, T>::TriggerHandle trigger, Args...args) {
+    pool.parallelFor(count, [&](std::size_t begin, std::size_t end){
+        definition.template fireAll<Args...>(instances + begin, end - begin, trigger, args...);
+    });
+}
+
+template <typename S, typename T>
+void fireAll(ThreadPool &pool, const MachineDefinition<S, T> &definition, MachineInstance<S> *instances, const T *triggers, std::size_t count) {
+    pool.parallelFor(count, [&](std::size_t begin, std::size_t end){
+        definition.fireAll(instances + begin, triggers + begin, end - begin);
+    });
+}
@@ -0,0 +1,348 @@
+#pragma once
+
+#include "mailbox.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Number of triggers an Actor can hold before post fails. Kept small since there may be millions of actors.
+// Define before including this header to change it.
+#ifndef MACHINE_ACTOR_CAPACITY
+#define MACHINE_ACTOR_CAPACITY 4
+#endif
+
+class Scheduler;
+
+namespace detail {
+
+// What a Scheduler knows about an actor, whatever its machine
+class ActorBase {
+protected:
+    // Fires up to budget posted triggers and returns how many
+    using Run = std::size_t (*)(ActorBase &actor, std::size_t budget);
+
+    ActorBase(Scheduler &scheduler, Run run) :
+    fScheduler(scheduler),
+    fRun(run) {
+
+    }
+
+    ActorBase(const ActorBase &) = delete;
+    ActorBase &operator=(const ActorBase &) = delete;
+
+    // Accounts for a posted trigger, and schedules the actor when it had nothing to do
+    void notify();
+
+private:
+    friend class ::Scheduler;
+
+    Scheduler                       &fScheduler;
+    Run                             fRun;
+    std::atomic<std::ptrdiff_t>     fPending{0}; // Triggers posted and not yet accounted for by a slice
+};
+
+}
+
+// Runs actors with posted triggers on a fixed set of worker threads, each with its own run queue of actors.
+// Actors scheduled by a worker, when callbacks post to other actors, go to that worker's queue, the others are
+// spread round robin. Workers take actors from the front of their queue, and steal from the back of another
+// queue when theirs is empty.
+//
+// An actor sits in at most one queue and is run by one worker at a time, so its triggers are fired in order and
+// each runs to completion, without locks. A worker fires at most budget triggers of an actor before moving it to
+// the back of its queue, so busy actors don't starve the others.
+class Scheduler {
+public:
+    struct Stats {
+        std::size_t     fEvents = 0;            // Triggers fired
+        std::size_t     fSlices = 0;            // Times an actor was run
+        std::size_t     fSteals = 0;            // Actors taken from the queue of another worker
+        std::size_t     fMaxRunQueueDepth = 0;  // Most actors waiting in the queue of a worker
+        std::size_t     fMaxMailboxDepth = 0;   // Most triggers pending for an actor when it was run
+    };
+
+    explicit Scheduler(std::size_t threads = std::max(1u, std::thread::hardware_concurrency()), std::size_t budget = 16) :
+    fBudget(budget) {
+        assert(threads > 0 && budget > 0);
+        for (std::size_t i = 0; i < threads; i++) {
+            fWorkers.push_back(std::make_unique<Worker>());
+            fWorkers.back()->fScheduler = this;
+            fWorkers.back()->fIndex = i;
+        }
+        for (auto &worker : fWorkers) {
+            worker->fThread = std::thread([this, worker = worker.get()](){ work(*worker); });
+        }
+    }
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+    // Triggers still pending are dropped, call waitIdle first to fire them
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(fSleepMutex);
+            fStop = true;
+        }
+        fWake.notify_all();
+        for (auto &worker : fWorkers) {
+            worker->fThread.join();
+        }
+    }
+
+    std::size_t getThreadCount() const {
+        return fWorkers.size();
+    }
+
+    std::size_t getBudget() const {
+        return fBudget;
+    }
+
+    // Blocks until every posted trigger has been fired, including those posted meanwhile by callbacks
+    void waitIdle() {
+        std::unique_lock<std::mutex> lock(fIdleMutex);
+        fIdle.wait(lock, [this](){ return fActive.load(std::memory_order_acquire) == 0; });
+    }
+
+    // Sums the counters of all workers. Exact once idle.
+    Stats getStats() const {
+        Stats stats;
+        for (auto &worker : fWorkers) {
+            stats.fEvents += worker->fEvents.load(std::memory_order_relaxed);
+            stats.fSlices += worker->fSlices.load(std::memory_order_relaxed);
+            stats.fSteals += worker->fSteals.load(std::memory_order_relaxed);
+            stats.fMaxRunQueueDepth = std::max(stats.fMaxRunQueueDepth, worker->fMaxRunQueueDepth.load(std::memory_order_relaxed));
+            stats.fMaxMailboxDepth = std::max(stats.fMaxMailboxDepth, worker->fMaxMailboxDepth.load(std::memory_order_relaxed));
+        }
+        return stats;
+    }
+
+    // Only while idle
+    void resetStats() {
+        for (auto &worker : fWorkers) {
+            worker->fEvents = 0;
+            worker->fSlices = 0;
+            worker->fSteals = 0;
+            worker->fMaxRunQueueDepth = 0;
+            worker->fMaxMailboxDepth = 0;
+        }
+    }
+
+private:
+    friend class detail::ActorBase;
+
+    // Counters are only written by the owning worker, or under fMutex, and read by getStats
+    struct alignas(64) Worker {
+        Scheduler                           *fScheduler = nullptr;
+        std::size_t                         fIndex = 0;
+        std::thread                         fThread;
+        std::mutex                          fMutex;
+        std::deque<detail::ActorBase*>      fQueue;
+        std::atomic<std::size_t>            fEvents{0};
+        std::atomic<std::size_t>            fSlices{0};
+        std::atomic<std::size_t>            fSteals{0};
+        std::atomic<std::size_t>            fMaxRunQueueDepth{0};
+        std::atomic<std::size_t>            fMaxMailboxDepth{0};
+    };
+
+    // The worker running on this thread, if any
+    static Worker *&current() {
+        static thread_local Worker *worker = nullptr;
+        return worker;
+    }
+
+    static void add(std::atomic<std::size_t> &counter, std::size_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static void raise(std::atomic<std::size_t> &counter, std::size_t value) {
+        if (value > counter.load(std::memory_order_relaxed)) {
+            counter.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    void schedule(detail::ActorBase &actor) {
+        fActive.fetch_add(1, std::memory_order_relaxed);
+        auto worker = current();
+        if (!worker || worker->fScheduler != this) {
+            static thread_local std::size_t next = 0;
+            worker = fWorkers[next++ % fWorkers.size()].get();
+        }
+        push(*worker, actor);
+        // A worker going to sleep counts itself before looking at the queues one last time, so either it finds the
+        // actor or it is counted here
+        if (fSleeping.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(fSleepMutex);
+            fEpoch++;
+            fWake.notify_one();
+        }
+    }
+
+    void push(Worker &worker, detail::ActorBase &actor) {
+        std::lock_guard<std::mutex> lock(worker.fMutex);
+        worker.fQueue.push_back(&actor);
+        raise(worker.fMaxRunQueueDepth, worker.fQueue.size());
+    }
+
+    detail::ActorBase *take(Worker &worker) {
+        {
+            std::lock_guard<std::mutex> lock(worker.fMutex);
+            if (!worker.fQueue.empty()) {
+                auto actor = worker.fQueue.front();
+                worker.fQueue.pop_front();
+                return actor;
+            }
+        }
+        for (std::size_t i = 1; i < fWorkers.size(); i++) {
+            auto &victim = *fWorkers[(worker.fIndex + i) % fWorkers.size()];
+            std::lock_guard<std::mutex> lock(victim.fMutex);
+            if (!victim.fQueue.empty()) {
+                auto actor = victim.fQueue.back();
+                victim.fQueue.pop_back();
+                add(worker.fSteals, 1);
+                return actor;
+            }
+        }
+        return nullptr;
+    }
+
+    void work(Worker &worker) {
+        current() = &worker;
+        std::size_t idle = 0;
+        while (!fStop.load(std::memory_order_relaxed)) {
+            if (auto actor = take(worker)) {
+                run(worker, *actor);
+                idle = 0;
+                continue;
+            }
+            // Yields a few times before sleeping, waking up again is much slower when actors trickle in
+            if (idle++ < 64) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(fSleepMutex);
+            fSleeping.fetch_add(1, std::memory_order_relaxed);
+            auto actor = take(worker);
+            if (!actor) {
+                auto epoch = fEpoch;
+                fWake.wait(lock, [this, epoch](){ return fStop || fEpoch != epoch; });
+            }
+            fSleeping.fetch_sub(1, std::memory_order_relaxed);
+            lock.unlock();
+            if (actor) {
+                run(worker, *actor);
+            }
+            idle = 0;
+        }
+    }
+
+    void run(Worker &worker, detail::ActorBase &actor) {
+        raise(worker.fMaxMailboxDepth, std::max<std::ptrdiff_t>(0, actor.fPending.load(std::memory_order_relaxed)));
+        auto count = actor.fRun(actor, fBudget);
+        add(worker.fEvents, count);
+        add(worker.fSlices, 1);
+        // Triggers counted after they were posted may already have been fired, leaving fPending below zero until
+        // their post catches up, which then doesn't schedule the actor again
+        auto pending = actor.fPending.fetch_sub(static_cast<std::ptrdiff_t>(count), std::memory_order_acq_rel) - static_cast<std::ptrdiff_t>(count);
+        if (pending > 0) {
+            push(worker, actor);
+        }
+        else if (fActive.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(fIdleMutex);
+            fIdle.notify_all();
+        }
+    }
+
+    std::size_t                             fBudget;
+    std::vector<std::unique_ptr<Worker>>    fWorkers;
+    std::atomic<std::size_t>                fActive{0};     // Actors queued or running
+    std::atomic<std::size_t>                fSleeping{0};   // Workers which found nothing to do, counted under fSleepMutex
+    std::size_t                             fEpoch = 0;     // Incremented under fSleepMutex to wake workers
+    std::atomic<bool>                       fStop{false};
+    std::mutex                              fSleepMutex;
+    std::condition_variable                 fWake;
+    std::mutex                              fIdleMutex;
+    std::condition_variable                 fIdle;
+};
+
+inline void detail::ActorBase::notify() {
+    if (fPending.fetch_add(1, std::memory_order_acq_rel) == 0) {
+        fScheduler.schedule(*this);
+    }
+}
+
+// An instance of a shared, frozen definition with its own mailbox, run by a Scheduler. Any thread may post triggers
+// to an actor, they are fired in order by one worker at a time. Triggers posted by callbacks, to their own actor
+// or to others, are fired in a later slice, so every trigger runs to completion. Actors don't move once created.
+template <typename S, typename T, std::size_t Capacity = MACHINE_ACTOR_CAPACITY>
+class Actor : public detail::ActorBase {
+public:
+    using Definition = MachineDefinition<S, T>;
+    using StateKey = typename Definition::StateKey;
+    using TriggerKey = typename Definition::TriggerKey;
+    using StateHandle = typename Definition::StateHandle;
+    using TriggerHandle = typename Definition::TriggerHandle;
+
+    Actor(Scheduler &scheduler, const Definition &definition, typename Definition::Instance instance) :
+    ActorBase(scheduler, &run),
+    fDefinition(definition),
+    fInstance(instance) {
+        assert(definition.isFrozen());
+    }
+
+    // Any thread. Returns false when the mailbox is full or the trigger isn't configured, in which case the trigger
+    // isn't posted.
+    template <typename ...Args>
+    bool post(TriggerKey trigger, Args...args) {
+        auto handle = fDefinition.findTrigger(trigger);
+        return handle && post<Args...>(*handle, args...);
+    }
+
+    template <typename ...Args>
+    bool post(TriggerHandle trigger, Args...args) {
+        auto pushed = fMailbox.push([trigger, arguments = std::tuple<Args...>(args...)](Actor &actor) {
+            std::apply([&actor, trigger](const Args &...args) {
+                actor.fDefinition.template fire<Args...>(actor.fInstance, trigger, args...);
+            }, arguments);
+        });
+        if (pushed) {
+            notify();
+        }
+        return pushed;
+    }
+
+    // The state is only stable from the callbacks of this actor, or once the scheduler is idle
+    const S &getState() const {
+        return fDefinition.getState(fInstance);
+    }
+
+    bool isInState(StateKey state) const {
+        return fDefinition.isInState(fInstance, state);
+    }
+
+    bool isInState(StateHandle state) const {
+        return fDefinition.isInState(fInstance, state);
+    }
+
+    // Triggers posted but not fired yet, approximate while the actor is busy
+    std::size_t getPendingCount() const {
+        return fMailbox.size();
+    }
+
+private:
+    using Event = detail::InlineFunction<void(Actor &actor)>;
+
+    static std::size_t run(detail::ActorBase &base, std::size_t budget) {
+        auto &actor = static_cast<Actor&>(base);
+        std::size_t count = 0;
+        while (count < budget && actor.fMailbox.pop([&actor](const Event &event){ event(actor); })) {
+            count++;
+        }
+        return count;
+    }
+
+    const Definition                                        &fDefinition;
+    typename Definition::Instance                           fInstance;
+    detail::MpscQueue<Event, Capacity, alignof(std::size_t)> fMailbox; // Packed, there may be millions of actors
+};
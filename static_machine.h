@@ -0,0 +1,432 @@
+#pragma once
+
+#include "machine.h"
+
+#include <utility>
+
+// Compile time machine definitions
+//
+// A StaticMachine is described by types instead of configure() calls. The states, transitions and callbacks are all
+// template arguments, so fire compiles down to a switch on the current state with the callbacks inlined, as if the
+// machine was written by hand. Callbacks and predicates are functions, since they have to be known at compile time.
+//
+//   using Switch = StaticMachine<State, Trigger,
+//       def::state<State::Off, def::permit<Trigger::Switch, State::On>>,
+//       def::state<State::On, def::permit<Trigger::Switch, State::Off>, def::onEntry<flicker>>>;
+namespace def {
+
+namespace detail {
+
+enum class Kind {
+    Ignore,
+    Transition,
+    Reentry,
+    Internal
+};
+
+// Every element answers all queries, with nullptr meaning it does not apply
+struct Element {
+    static constexpr std::nullptr_t trigger = nullptr;
+    static constexpr std::nullptr_t parent = nullptr;
+    static constexpr std::nullptr_t initial = nullptr;
+    static constexpr std::nullptr_t entry = nullptr;
+    static constexpr std::nullptr_t exit = nullptr;
+};
+
+template <Kind K, auto Trigger, auto Destination = nullptr, auto Predicate = nullptr, auto Callback = nullptr>
+struct Action : Element {
+    static constexpr Kind kind = K;
+    static constexpr auto trigger = Trigger;
+    static constexpr auto destination = Destination;
+    static constexpr auto predicate = Predicate;
+    static constexpr auto action = Callback;
+};
+
+}
+
+// Transition from one state to another state
+template <auto Trigger, auto Destination>
+struct permit : detail::Action<detail::Kind::Transition, Trigger, Destination> {};
+
+// Conditional transition from one state to another state
+template <auto Trigger, auto Destination, auto Predicate>
+struct permitIf : detail::Action<detail::Kind::Transition, Trigger, Destination, Predicate> {};
+
+// Transition from one state to the same state
+template <auto Trigger>
+struct permitReentry : detail::Action<detail::Kind::Reentry, Trigger> {};
+
+// Conditional transition from one state to the same state
+template <auto Trigger, auto Predicate>
+struct permitReentryIf : detail::Action<detail::Kind::Reentry, Trigger, nullptr, Predicate> {};
+
+// No transition, but also no handler exception
+template <auto Trigger>
+struct ignore : detail::Action<detail::Kind::Ignore, Trigger> {};
+
+// Conditionally no transition, but also no handler exception
+template <auto Trigger, auto Predicate>
+struct ignoreIf : detail::Action<detail::Kind::Ignore, Trigger, nullptr, Predicate> {};
+
+// No transition, but calls action
+template <auto Trigger, auto Callback>
+struct internalTransition : detail::Action<detail::Kind::Internal, Trigger, nullptr, nullptr, Callback> {};
+
+// Conditionally no transition, but calls action
+template <auto Trigger, auto Callback, auto Predicate>
+struct internalTransitionIf : detail::Action<detail::Kind::Internal, Trigger, nullptr, Predicate, Callback> {};
+
+// Makes the state a substate of the given state
+template <auto Parent>
+struct substateOf : detail::Element {
+    static constexpr auto parent = Parent;
+};
+
+// When entering the state, immediatelly go to the given substate
+template <auto Initial>
+struct initialTransition : detail::Element {
+    static constexpr auto initial = Initial;
+};
+
+// Callback for when the state is entered
+template <auto Callback>
+struct onEntry : detail::Element {
+    static constexpr auto entry = Callback;
+};
+
+// Callback for when the state is exited
+template <auto Callback>
+struct onExit : detail::Element {
+    static constexpr auto exit = Callback;
+};
+
+// A state and everything configured on it, the equivalent of configure(State)
+template <auto State, typename ...Elements>
+struct state {
+    static constexpr auto value = State;
+    using elements = std::tuple<Elements...>;
+};
+
+}
+
+template <typename S, typename T, typename ...States>
+class StaticMachine {
+public:
+    StaticMachine(S initialState) {
+        fStateIndex = indexOf(initialState);
+        assert(fStateIndex != npos);
+    }
+
+    const S &getState() {
+        return keys[fStateIndex];
+    }
+
+    bool canFire(T trigger) {
+        return dispatch<false>(trigger, std::make_index_sequence<N>());
+    }
+
+    void fire(T trigger) {
+        if (!dispatch<true>(trigger, std::make_index_sequence<N>())) {
+            unhandled(trigger);
+        }
+    }
+
+    // Firing a trigger known at compile time leaves only the actions for that trigger in the switch
+    template <auto Trigger>
+    void fire() {
+        static_assert(std::is_same_v<decltype(Trigger), T>, "Trigger is not of the trigger type");
+        if (!dispatch<true, Trigger>(Trigger, std::make_index_sequence<N>())) {
+            unhandled(Trigger);
+        }
+    }
+
+    bool isInState(S state) {
+        auto index = indexOf(state);
+        return index != npos && contains[index][fStateIndex];
+    }
+
+    template <auto State>
+    bool isInState() {
+        static_assert(indexOf(State) != npos, "State is not defined");
+        return contains[indexOf(State)][fStateIndex];
+    }
+
+    template <typename F>
+    void onUnhandledTrigger(F callback) {
+        fOnUnhandledTrigger = callback;
+    }
+
+    template <typename F>
+    void onTransitioned(F callback) {
+        fOnTransitioned = callback;
+    }
+
+private:
+    static constexpr std::size_t N = sizeof...(States);
+    static constexpr std::size_t npos = -1;
+
+    template <std::size_t I>
+    using StateAt = std::tuple_element_t<I, std::tuple<States...>>;
+
+    static constexpr std::array<S, N> keys = {States::value...};
+
+    static constexpr std::size_t indexOf(S state) {
+        for (std::size_t i = 0; i < N; i++) {
+            if (keys[i] == state) {
+                return i;
+            }
+        }
+        return npos;
+    }
+
+    // The index of the state a value refers to, or npos for nullptr
+    template <auto State>
+    static constexpr std::size_t referenceTo() {
+        if constexpr (std::is_null_pointer_v<decltype(State)>) {
+            return npos;
+        }
+        else {
+            static_assert(std::is_same_v<decltype(State), S>, "State is not of the state type");
+            static_assert(indexOf(State) != npos, "State is not defined");
+            return indexOf(State);
+        }
+    }
+
+    // The only state referenced by the elements through Get, or npos
+    template <typename Get, typename ...Elements>
+    static constexpr std::size_t referenceIn(Get get, std::tuple<Elements...> *) {
+        std::size_t indices[] = {npos, get(Elements())...};
+        std::size_t index = npos;
+        for (auto i : indices) {
+            assert(i == npos || index == npos);
+            index = i != npos ? i : index;
+        }
+        return index;
+    }
+
+    template <typename Get>
+    static constexpr std::array<std::size_t, N> references(Get get) {
+        return {referenceIn(get, static_cast<typename States::elements*>(nullptr))...};
+    }
+
+    static constexpr auto parents = references([](auto element){ return referenceTo<decltype(element)::parent>(); });
+    static constexpr auto initials = references([](auto element){ return referenceTo<decltype(element)::initial>(); });
+
+    static constexpr bool isDescendantOf(std::size_t state, std::size_t ancestor) {
+        for (std::size_t i = 0; state != npos && i <= N; i++, state = parents[state]) {
+            if (state == ancestor) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // contains[a][b] is true when b is a or one of its descendants
+    static constexpr std::array<std::array<bool, N>, N> makeContains() {
+        std::array<std::array<bool, N>, N> result{};
+        for (std::size_t a = 0; a < N; a++) {
+            for (std::size_t b = 0; b < N; b++) {
+                result[a][b] = isDescendantOf(b, a);
+            }
+        }
+        return result;
+    }
+
+    static constexpr auto contains = makeContains();
+
+    static constexpr bool isWellFormed() {
+        for (std::size_t i = 0; i < N; i++) {
+            // Check for cycles, a chain of parents can't be longer than the number of states
+            std::size_t depth = 0;
+            for (auto state = parents[i]; state != npos; state = parents[state]) {
+                if (state == i || ++depth > N) {
+                    return false;
+                }
+            }
+            // Initial substates have to be children
+            if (initials[i] != npos && parents[initials[i]] != i) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static_assert(isWellFormed(), "States form a cycle or an initial transition does not go to a child");
+
+    // A plan may go through a state twice, exiting it and entering it again through an initial transition, but
+    // exits and entries each go through a state at most once
+    static constexpr std::size_t PlanCapacity = 2 * N + 1;
+
+    // The states exited and entered by a transition, computed like Machine::getPlan
+    struct Plan {
+        std::array<std::size_t, PlanCapacity>   fStates{};
+        std::size_t                             fEntryBegin = 0;
+        std::size_t                             fInitialBegin = 0;
+        std::size_t                             fEntryEnd = 0;
+    };
+
+    static constexpr Plan makePlan(std::size_t src, std::size_t dst, bool reentry) {
+        Plan plan;
+        std::size_t count = 0;
+        // Exit up to the highest state which doesn't contain dst
+        auto top = src;
+        for (; ; top = parents[top], reentry = false) {
+            if (!reentry && isDescendantOf(dst, top)) {
+                break;
+            }
+            plan.fStates[count++] = top;
+            if (parents[top] == npos) {
+                break;
+            }
+        }
+        plan.fEntryBegin = count;
+        // Enter the parents of dst which top isn't in, outermost first
+        for (auto state = dst; parents[state] != npos && !isDescendantOf(top, parents[state]); state = parents[state]) {
+            plan.fStates[count++] = parents[state];
+        }
+        for (std::size_t i = plan.fEntryBegin, j = count; i + 1 < j; i++, j--) {
+            auto state = plan.fStates[i];
+            plan.fStates[i] = plan.fStates[j - 1];
+            plan.fStates[j - 1] = state;
+        }
+        plan.fStates[count++] = dst;
+        plan.fInitialBegin = count;
+        for (auto state = initials[dst]; state != npos; state = initials[state]) {
+            plan.fStates[count++] = state;
+        }
+        plan.fEntryEnd = count;
+        return plan;
+    }
+
+    template <std::size_t Src, std::size_t Dst, bool Reentry>
+    static constexpr Plan plan = makePlan(Src, Dst, Reentry);
+
+    // The actions of a state followed by those of its ancestors, in order of precedence
+    template <std::size_t I, typename A>
+    struct Declared : A {
+        static constexpr std::size_t owner = I; // The state the action is configured on
+    };
+
+    template <std::size_t I, typename ...Elements>
+    static auto ownActions(std::tuple<Elements...> *) {
+        return std::tuple_cat(std::conditional_t<std::is_null_pointer_v<decltype(Elements::trigger)>, std::tuple<>, std::tuple<Declared<I, Elements>>>()...);
+    }
+
+    template <std::size_t I>
+    static auto actions() {
+        if constexpr (I == npos) {
+            return std::tuple<>();
+        }
+        else {
+            return std::tuple_cat(ownActions<I>(static_cast<typename StateAt<I>::elements*>(nullptr)), actions<parents[I]>());
+        }
+    }
+
+    // Folds into a switch on the current state, with a branch per action of that state
+    template <bool Perform, auto Trigger = nullptr, std::size_t ...I>
+    bool dispatch(T trigger, std::index_sequence<I...>) {
+        bool handled = false;
+        ((fStateIndex == I && (handled = dispatchFrom<Perform, Trigger, I>(trigger), true)) || ...);
+        return handled;
+    }
+
+    template <bool Perform, auto Trigger, std::size_t I>
+    bool dispatchFrom(T trigger) {
+        return std::apply([this, trigger](auto ...actions){
+            return (tryAction<Perform, Trigger, I>(trigger, actions) || ...);
+        }, actions<I>());
+    }
+
+    template <bool Perform, auto Trigger, std::size_t I, typename A>
+    bool tryAction(T trigger, A) {
+        static_assert(std::is_same_v<std::decay_t<decltype(A::trigger)>, T>, "Trigger is not of the trigger type");
+        if constexpr (!std::is_null_pointer_v<decltype(Trigger)>) {
+            if constexpr (A::trigger != Trigger) {
+                return false;
+            }
+        }
+        if (A::trigger != trigger || !isValid<A::predicate>()) {
+            return false;
+        }
+        if constexpr (Perform) {
+            perform<I, A>(trigger);
+        }
+        return true;
+    }
+
+    template <std::size_t I, typename A>
+    void perform(T trigger) {
+        if constexpr (A::kind == def::detail::Kind::Internal) {
+            call<A::action>();
+        }
+        else if constexpr (A::kind == def::detail::Kind::Transition) {
+            transition<I, referenceTo<A::destination>(), false>(trigger, std::make_index_sequence<PlanCapacity>());
+        }
+        else if constexpr (A::kind == def::detail::Kind::Reentry) {
+            transition<I, A::owner, I == A::owner>(trigger, std::make_index_sequence<PlanCapacity>());
+        }
+    }
+
+    // Calls the function F, unless it is nullptr
+    template <auto F>
+    static void call() {
+        if constexpr (!std::is_null_pointer_v<decltype(F)>) {
+            F();
+        }
+    }
+
+    template <auto Predicate>
+    static bool isValid() {
+        if constexpr (std::is_null_pointer_v<decltype(Predicate)>) {
+            return true;
+        }
+        else {
+            return Predicate();
+        }
+    }
+
+    template <std::size_t I>
+    static void callOnEntry() {
+        std::apply([](auto ...elements){ (call<decltype(elements)::entry>(), ...); }, typename StateAt<I>::elements());
+    }
+
+    template <std::size_t I>
+    static void callOnExit() {
+        std::apply([](auto ...elements){ (call<decltype(elements)::exit>(), ...); }, typename StateAt<I>::elements());
+    }
+
+    // Runs a planned transition: exit callbacks, the state change, then entry callbacks.
+    // The plan is a constant, so every step is a direct call.
+    template <std::size_t Src, std::size_t Dst, bool Reentry, std::size_t ...I>
+    void transition(T trigger, std::index_sequence<I...>) {
+        constexpr auto &p = plan<Src, Dst, Reentry>;
+        ((I < p.fEntryBegin ? callOnExit<p.fStates[I]>() : void()), ...);
+        fStateIndex = Dst;
+        if (fOnTransitioned) {
+            fOnTransitioned(keys[Src], keys[Dst], trigger);
+        }
+        ((I >= p.fEntryBegin && I < p.fEntryEnd ? enter<p.fStates[I], I >= p.fInitialBegin>() : void()), ...);
+    }
+
+    // States reached through initial transitions become the current state before they are entered
+    template <std::size_t I, bool Initial>
+    void enter() {
+        if constexpr (Initial) {
+            fStateIndex = I;
+        }
+        callOnEntry<I>();
+    }
+
+    void unhandled(T trigger) {
+        if (fOnUnhandledTrigger) {
+            fOnUnhandledTrigger(getState(), trigger);
+        }
+        else {
+            assert(false);
+        }
+    }
+
+    std::size_t                                                         fStateIndex;
+    detail::InlineFunction<void(S state, T trigger)>                    fOnUnhandledTrigger;
+    detail::InlineFunction<void(S source, S destination, T trigger)>    fOnTransitioned;
+};
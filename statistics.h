@@ -0,0 +1,213 @@
+#pragma once
+
+#include "machine.h"
+
+namespace detail {
+
+// Index of the highest set bit, bits can't be 0
+inline std::size_t highestBit(std::uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - static_cast<std::size_t>(__builtin_clzll(bits));
+#else
+    std::size_t index = 0;
+    while (bits >>= 1) {
+        index++;
+    }
+    return index;
+#endif
+}
+
+}
+
+// An instrumentation policy for Machine which counts the triggers fired in each state, and keeps a histogram of
+// the time taken by the entry and exit callbacks of each state:
+//
+//   Machine<State, Trigger, MachineStatistics> machine(State::Idle);
+//   ...
+//   machine.getInstrumentation().getCount(state, trigger);
+//   machine.dumpInstrumentation(std::cout);
+//
+// Counts are kept in rows of whole cache lines, one row per state, and every histogram takes whole cache lines,
+// so machines on different threads can be merged afterwards without their statistics having shared lines.
+// Firing costs one increment, and two clock reads for each callback run.
+class MachineStatistics {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Bucket b counts durations from 2^b to 2^(b+1) nanoseconds, the first one also shorter ones and the last one
+    // also longer ones
+    static constexpr std::size_t Buckets = 32;
+
+    struct alignas(64) Histogram {
+        std::array<std::uint64_t, Buckets>  fCounts{};
+
+        std::uint64_t total() const {
+            std::uint64_t total = 0;
+            for (auto count : fCounts) {
+                total += count;
+            }
+            return total;
+        }
+
+        void add(Clock::duration duration) {
+            auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+            auto bucket = nanoseconds > 1 ? detail::highestBit(static_cast<std::uint64_t>(nanoseconds)) : 0;
+            fCounts[std::min(bucket, Buckets - 1)]++;
+        }
+    };
+
+    // The number of times the trigger was fired while in the state, deferred triggers count each time they are fired
+    std::uint64_t getCount(std::size_t state, std::size_t trigger) const {
+        if (state >= fStateCount || trigger >= fTriggerCount) {
+            return 0;
+        }
+        return count(state, trigger);
+    }
+
+    template <typename StateHandle, typename TriggerHandle>
+    std::uint64_t getCount(StateHandle state, TriggerHandle trigger) const {
+        return getCount(state.fIndex, trigger.fIndex);
+    }
+
+    // Histograms of the entry and exit callbacks, empty for states whose callbacks haven't run
+    const Histogram &getEntryLatency(std::size_t state) const {
+        return state < fEntry.size() ? fEntry[state] : empty();
+    }
+
+    const Histogram &getExitLatency(std::size_t state) const {
+        return state < fExit.size() ? fExit[state] : empty();
+    }
+
+    // Adds the statistics of another machine with the same definition
+    void merge(const MachineStatistics &other) {
+        resize(std::max(fStateCount, other.fStateCount), std::max(fTriggerCount, other.fTriggerCount));
+        for (std::size_t state = 0; state < other.fStateCount; state++) {
+            for (std::size_t trigger = 0; trigger < other.fTriggerCount; trigger++) {
+                count(state, trigger) += other.count(state, trigger);
+            }
+            for (std::size_t bucket = 0; bucket < Buckets; bucket++) {
+                fEntry[state].fCounts[bucket] += other.fEntry[state].fCounts[bucket];
+                fExit[state].fCounts[bucket] += other.fExit[state].fCounts[bucket];
+            }
+        }
+    }
+
+    void reset() {
+        std::fill(fLines.begin(), fLines.end(), Line{});
+        std::fill(fEntry.begin(), fEntry.end(), Histogram{});
+        std::fill(fExit.begin(), fExit.end(), Histogram{});
+    }
+
+    // Hooks called by Machine
+    void fired(std::size_t state, std::size_t trigger, std::size_t stateCount, std::size_t triggerCount) {
+        if (stateCount != fStateCount || triggerCount != fTriggerCount) {
+            // States and triggers added since the last fire
+            resize(stateCount, triggerCount);
+        }
+        count(state, trigger)++;
+    }
+
+    template <typename F>
+    void entered(std::size_t state, F callback) {
+        auto start = Clock::now();
+        callback();
+        fEntry[state].add(Clock::now() - start);
+    }
+
+    template <typename F>
+    void exited(std::size_t state, F callback) {
+        auto start = Clock::now();
+        callback();
+        fExit[state].add(Clock::now() - start);
+    }
+
+    // Writes the non zero counts, then the histograms of the callbacks which ran, naming states and triggers by
+    // calling stateName(stream, index) and triggerName(stream, index)
+    template <typename StateName, typename TriggerName>
+    void dump(std::ostream &stream, StateName stateName, TriggerName triggerName) const {
+        stream << "fired\n";
+        for (std::size_t state = 0; state < fStateCount; state++) {
+            for (std::size_t trigger = 0; trigger < fTriggerCount; trigger++) {
+                if (auto fired = count(state, trigger)) {
+                    stream << "  ";
+                    stateName(stream, state);
+                    stream << " ";
+                    triggerName(stream, trigger);
+                    stream << " " << fired << "\n";
+                }
+            }
+        }
+        stream << "callbacks\n";
+        for (std::size_t state = 0; state < fStateCount; state++) {
+            dumpHistogram(stream, "entry", state, fEntry[state], stateName);
+            dumpHistogram(stream, "exit", state, fExit[state], stateName);
+        }
+    }
+
+private:
+    static constexpr std::size_t LineCounts = 64 / sizeof(std::uint64_t);
+
+    struct alignas(64) Line {
+        std::array<std::uint64_t, LineCounts>   fValues{};
+    };
+
+    static const Histogram &empty() {
+        static const Histogram histogram;
+        return histogram;
+    }
+
+    std::uint64_t &count(std::size_t state, std::size_t trigger) {
+        return fLines[state * fRowLines + trigger / LineCounts].fValues[trigger % LineCounts];
+    }
+
+    std::uint64_t count(std::size_t state, std::size_t trigger) const {
+        return fLines[state * fRowLines + trigger / LineCounts].fValues[trigger % LineCounts];
+    }
+
+    // Lays the counts out again for more states or triggers, keeping those counted so far
+    void resize(std::size_t stateCount, std::size_t triggerCount) {
+        auto rowLines = (triggerCount + LineCounts - 1) / LineCounts;
+        std::vector<Line> lines(stateCount * rowLines);
+        for (std::size_t state = 0; state < fStateCount; state++) {
+            for (std::size_t trigger = 0; trigger < fTriggerCount; trigger++) {
+                lines[state * rowLines + trigger / LineCounts].fValues[trigger % LineCounts] = count(state, trigger);
+            }
+        }
+        fLines = std::move(lines);
+        fRowLines = rowLines;
+        fStateCount = stateCount;
+        fTriggerCount = triggerCount;
+        fEntry.resize(stateCount);
+        fExit.resize(stateCount);
+    }
+
+    template <typename StateName>
+    static void dumpHistogram(std::ostream &stream, const char *kind, std::size_t state, const Histogram &histogram, StateName &stateName) {
+        auto total = histogram.total();
+        if (!total) {
+            return;
+        }
+        stream << "  " << kind << " ";
+        stateName(stream, state);
+        stream << " " << total << ":";
+        for (std::size_t bucket = 0; bucket < Buckets; bucket++) {
+            if (!histogram.fCounts[bucket]) {
+                continue;
+            }
+            if (bucket + 1 < Buckets) {
+                stream << " <" << (std::uint64_t(1) << (bucket + 1)) << "ns " << histogram.fCounts[bucket];
+            }
+            else {
+                stream << " >=" << (std::uint64_t(1) << bucket) << "ns " << histogram.fCounts[bucket];
+            }
+        }
+        stream << "\n";
+    }
+
+    std::vector<Line>       fLines; // fRowLines per state
+    std::size_t             fRowLines = 0;
+    std::size_t             fStateCount = 0;
+    std::size_t             fTriggerCount = 0;
+    std::vector<Histogram>  fEntry;
+    std::vector<Histogram>  fExit;
+};
@@ -0,0 +1,333 @@
+#pragma once
+
+#include "machine.h"
+
+#include <limits>
+
+// Timers kept on a hierarchical timing wheel and fired by advance, so time is whatever the caller says it is.
+// Time is counted in ticks of a fixed resolution, and each level of the wheel has 256 slots spanning 256 times
+// more ticks than the level below:
+//
+//   level 3   256 slots of 2^24 ticks
+//   level 2   256 slots of 2^16 ticks
+//   level 1   256 slots of 2^8 ticks
+//   level 0   256 slots of 1 tick        fired from here
+//
+// A timer is linked into the slot of the lowest level whose span covers its delay, so scheduling and cancelling
+// take constant time whatever the number of timers. Each time a level wraps around, the next slot of the level
+// above is spread over the levels below, which moves a timer at most once per level.
+class TimingWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = detail::InlineFunction<void()>;
+
+    // Identifies a scheduled timer, stale once it has fired or was cancelled
+    struct TimerHandle {
+        std::uint32_t   fIndex = 0;
+        std::uint32_t   fGeneration = 0;
+    };
+
+    explicit TimingWheel(Clock::duration resolution = std::chrono::milliseconds(1), Clock::time_point start = Clock::now()) :
+    fResolution(resolution),
+    fStart(start),
+    fNow(start),
+    fNodes(Sentinels) {
+        assert(resolution.count() > 0);
+        for (std::uint32_t i = 0; i < Sentinels; i++) {
+            fNodes[i].fPrev = i;
+            fNodes[i].fNext = i;
+        }
+    }
+
+    TimingWheel(const TimingWheel &) = delete;
+    TimingWheel &operator=(const TimingWheel &) = delete;
+
+    // Calls the callback from the first advance which reaches the delay past the time of the last advance.
+    // Timers never fire early, and at most one tick late.
+    template <typename Rep, typename Period>
+    TimerHandle schedule(std::chrono::duration<Rep, Period> delay, Callback callback) {
+        assert(delay.count() >= 0);
+        auto elapsed = (fNow - fStart) + std::chrono::duration_cast<Clock::duration>(delay);
+        auto expiry = static_cast<std::uint64_t>((elapsed.count() + fResolution.count() - 1) / fResolution.count());
+        auto index = allocate();
+        auto &node = fNodes[index];
+        node.fExpiry = std::max(expiry, fTick);
+        node.fCallback = callback;
+        insert(index);
+        fSize++;
+        return {index, node.fGeneration};
+    }
+
+    // Returns false when the timer has already fired or was cancelled
+    bool cancel(TimerHandle timer) {
+        if (timer.fIndex < Sentinels || timer.fIndex >= fNodes.size()) {
+            return false;
+        }
+        auto &node = fNodes[timer.fIndex];
+        if (node.fGeneration != timer.fGeneration || node.fPrev == Unused) {
+            return false;
+        }
+        unlink(timer.fIndex);
+        release(timer.fIndex);
+        fSize--;
+        return true;
+    }
+
+    // Fires every timer due by now, in order of their expiry tick, and returns how many fired.
+    // Callbacks may schedule and cancel timers, but not advance.
+    std::size_t advance(Clock::time_point now) {
+        assert(now >= fNow);
+        fNow = now;
+        auto target = static_cast<std::uint64_t>((now - fStart) / fResolution);
+        std::size_t fired = 0;
+        while (fTick <= target) {
+            auto tick = fTick;
+            if ((tick & (Slots - 1)) == 0) {
+                // Every level whose slot changes at this tick is spread over the levels below, highest first
+                std::size_t level = 1;
+                while (level + 1 < Levels && ((tick >> (Bits * level)) & (Slots - 1)) == 0) {
+                    level++;
+                }
+                for (; level > 0; level--) {
+                    cascade(level, tick);
+                }
+            }
+            if (fCounts[0] == 0) {
+                // Nothing fires until the lowest level holding timers spreads its next slot, skip to that tick
+                std::size_t level = 1;
+                while (level < Levels && fCounts[level] == 0) {
+                    level++;
+                }
+                auto next = level < Levels ? ((tick >> (Bits * level)) + 1) << (Bits * level) : target + 1;
+                fTick = std::min(next, target + 1);
+                continue;
+            }
+            fTick = tick + 1;
+            // Set aside, since timers scheduled by the callbacks may land in this slot again for a later round
+            auto slot = static_cast<std::uint32_t>(tick & (Slots - 1));
+            while (fNodes[slot].fNext != slot) {
+                auto index = fNodes[slot].fNext;
+                unlink(index);
+                link(Draining, index);
+            }
+            while (fNodes[Draining].fNext != Draining) {
+                auto index = fNodes[Draining].fNext;
+                assert(fNodes[index].fExpiry == tick);
+                unlink(index);
+                auto callback = fNodes[index].fCallback;
+                release(index);
+                fSize--;
+                callback();
+                fired++;
+            }
+        }
+        return fired;
+    }
+
+    // The number of timers waiting to fire
+    std::size_t size() const {
+        return fSize;
+    }
+
+    Clock::time_point now() const {
+        return fNow;
+    }
+
+    Clock::duration getResolution() const {
+        return fResolution;
+    }
+
+private:
+    static constexpr std::size_t Bits = 8;
+    static constexpr std::size_t Slots = std::size_t(1) << Bits;
+    static constexpr std::size_t Levels = 4;
+    // Nodes below Sentinels head the circular list of each slot, plus the list being fired
+    static constexpr std::uint32_t Draining = Levels * Slots;
+    static constexpr std::uint32_t Sentinels = Draining + 1;
+    static constexpr std::uint32_t Unused = std::numeric_limits<std::uint32_t>::max();
+
+    struct Node {
+        std::uint64_t   fExpiry = 0;        // Tick at which the timer fires
+        std::uint32_t   fPrev = Unused;     // Unused for free nodes
+        std::uint32_t   fNext = Unused;     // Next free node for free nodes
+        std::uint32_t   fGeneration = 0;    // Incremented when the node is freed, invalidating handles
+        std::uint32_t   fSlot = Unused;     // Sentinel of the list holding the node
+        Callback        fCallback;
+    };
+
+    std::uint32_t allocate() {
+        if (fFree != Unused) {
+            auto index = fFree;
+            fFree = fNodes[index].fNext;
+            return index;
+        }
+        assert(fNodes.size() < Unused);
+        fNodes.emplace_back();
+        return static_cast<std::uint32_t>(fNodes.size() - 1);
+    }
+
+    void release(std::uint32_t index) {
+        auto &node = fNodes[index];
+        node.fCallback = nullptr;
+        node.fGeneration++;
+        node.fPrev = Unused;
+        node.fNext = fFree;
+        fFree = index;
+    }
+
+    // Links the node into the slot covering its expiry, relative to the current tick
+    void insert(std::uint32_t index) {
+        auto expiry = fNodes[index].fExpiry;
+        auto delta = expiry - fTick;
+        std::size_t level = 0;
+        while (level + 1 < Levels && delta >= (std::uint64_t(1) << (Bits * (level + 1)))) {
+            level++;
+        }
+        // Beyond the span of the wheel, the timer waits in the furthest slot and is placed again from there
+        if (delta >= (std::uint64_t(1) << (Bits * Levels))) {
+            expiry = fTick + (std::uint64_t(1) << (Bits * Levels)) - 1;
+        }
+        link(static_cast<std::uint32_t>(level * Slots + ((expiry >> (Bits * level)) & (Slots - 1))), index);
+    }
+
+    // Places the timers of the current slot of the level again, which moves them to lower levels
+    void cascade(std::size_t level, std::uint64_t tick) {
+        auto slot = static_cast<std::uint32_t>(level * Slots + ((tick >> (Bits * level)) & (Slots - 1)));
+        while (fNodes[slot].fNext != slot) {
+            auto index = fNodes[slot].fNext;
+            unlink(index);
+            insert(index);
+        }
+    }
+
+    void link(std::uint32_t sentinel, std::uint32_t index) {
+        auto last = fNodes[sentinel].fPrev;
+        auto &node = fNodes[index];
+        node.fSlot = sentinel;
+        node.fPrev = last;
+        node.fNext = sentinel;
+        fNodes[last].fNext = index;
+        fNodes[sentinel].fPrev = index;
+        if (sentinel < Draining) {
+            fCounts[sentinel / Slots]++;
+        }
+    }
+
+    void unlink(std::uint32_t index) {
+        auto &node = fNodes[index];
+        fNodes[node.fPrev].fNext = node.fNext;
+        fNodes[node.fNext].fPrev = node.fPrev;
+        if (node.fSlot < Draining) {
+            fCounts[node.fSlot / Slots]--;
+        }
+    }
+
+    Clock::duration     fResolution;
+    Clock::time_point   fStart;
+    Clock::time_point   fNow;           // Time of the last advance
+    std::uint64_t       fTick = 0;      // Next tick to fire
+    std::vector<Node>   fNodes;
+    std::uint32_t       fFree = Unused; // First free node
+    std::size_t         fSize = 0;
+    std::array<std::size_t, Levels>     fCounts{}; // Timers linked in each level, advance skips over empty ones
+};
+
+// A Machine whose states may have timeouts, configured with permitAfter. The timers of a state are scheduled on
+// the wheel when the state is entered, and cancelled when it is exited, including through substates. Timers fire
+// their trigger from the advance of the wheel like any other fire. The wheel may be shared by many machines and
+// has to outlive them. The initial state isn't entered, its timers and those of its ancestors are scheduled by
+// freeze, once they are configured.
+template <typename S, typename T>
+class TimedMachine : public Machine<S, T> {
+public:
+    using Base = Machine<S, T>;
+    using typename Base::Definition;
+    using typename Base::StateHandle;
+    using Timeout = typename Definition::Timeout;
+
+    TimedMachine(TimingWheel &wheel, S initialState) :
+    Base(initialState),
+    fWheel(wheel) {
+        this->onTimeoutState([this](typename Definition::Instance &, StateHandle state, const std::vector<Timeout> &timeouts, bool entered) {
+            if (entered) {
+                arm(state, timeouts);
+            }
+            else {
+                disarm(state);
+            }
+        });
+    }
+
+    TimedMachine(const TimedMachine &) = delete;
+    TimedMachine &operator=(const TimedMachine &) = delete;
+
+    ~TimedMachine() {
+        disarmAll();
+    }
+
+    // Freezes the definition and schedules the timers of the initial state and its ancestors, from the current time
+    // of the wheel. See Machine::freeze.
+    bool freeze() {
+        auto frozen = Base::freeze();
+        this->enterTimeouts();
+        return frozen;
+    }
+
+    // Timers aren't part of snapshots. Those of the states left are cancelled, and those of the restored state and
+    // its ancestors are scheduled again from the current time of the wheel, as if they had just been entered.
+    bool restore(std::istream &stream) {
+        if (!Base::restore(stream)) {
+            return false;
+        }
+        disarmAll();
+        this->enterTimeouts();
+        return true;
+    }
+
+    // Timers armed by the active states, including those which have fired already
+    std::size_t getTimerCount() const {
+        std::size_t count = 0;
+        for (auto &timers : fTimers) {
+            count += timers.size();
+        }
+        return count;
+    }
+
+private:
+    void arm(StateHandle state, const std::vector<Timeout> &timeouts) {
+        if (state.fIndex >= fTimers.size()) {
+            fTimers.resize(state.fIndex + 1);
+        }
+        // Entered before freeze, its timers are already running
+        if (!fTimers[state.fIndex].empty()) {
+            return;
+        }
+        for (auto &timeout : timeouts) {
+            auto trigger = timeout.fTrigger;
+            fTimers[state.fIndex].push_back(fWheel.schedule(timeout.fDelay, [this, trigger](){ this->fire(trigger); }));
+        }
+    }
+
+    void disarm(StateHandle state) {
+        // The initial state is exited without having been entered
+        if (state.fIndex >= fTimers.size()) {
+            return;
+        }
+        for (auto timer : fTimers[state.fIndex]) {
+            fWheel.cancel(timer);
+        }
+        fTimers[state.fIndex].clear();
+    }
+
+    void disarmAll() {
+        for (auto &timers : fTimers) {
+            for (auto timer : timers) {
+                fWheel.cancel(timer);
+            }
+            timers.clear();
+        }
+    }
+
+    TimingWheel                                         &fWheel;
+    std::vector<std::vector<TimingWheel::TimerHandle>>  fTimers; // Armed by each active state with timeouts
+};
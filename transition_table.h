@@ -0,0 +1,205 @@
+#pragma once
+
+#include "machine.h"
+
+#include <limits>
+
+// Vectorized kernels are available with GCC and Clang on x86, define MACHINE_NO_SIMD to only use the scalar kernel
+#if !defined(MACHINE_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MACHINE_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// A packed (state x trigger) table for machines which only change state when a trigger is fired, made of permit,
+// permitReentry and ignore without conditions or callbacks. Advancing a population of such machines is a gather,
+//
+//   states[i] = table[states[i]][triggers[i]]
+//
+// done with AVX-512 or AVX2 gathers when the CPU has them. States and triggers are the indices of the definition,
+// the underlying values for enums, packed in arrays of Index, std::uint8_t or std::uint16_t.
+// Unhandled triggers leave the state unchanged, without calling the unhandled trigger callback.
+template <typename Index>
+class TransitionTable {
+    static_assert(std::is_same_v<Index, std::uint8_t> || std::is_same_v<Index, std::uint16_t>, "Index has to be std::uint8_t or std::uint16_t");
+
+public:
+    enum class Kernel {
+        Scalar,
+        AVX2,
+        AVX512
+    };
+
+    // Returns std::nullopt when the definition has conditions, callbacks or arguments, which can't be expressed in a
+    // table, or more states than Index holds
+    template <typename S, typename T>
+    static std::optional<TransitionTable> tryCreate(const MachineDefinition<S, T> &definition) {
+        TransitionTable table(definition.getStateCount(), definition.getTriggerCount());
+        if (table.fStateCount > std::size_t(std::numeric_limits<Index>::max()) + 1) {
+            return std::nullopt;
+        }
+        for (std::size_t state = 0; state < table.fStateCount; state++) {
+            for (std::size_t trigger = 0; trigger < table.fTriggerCount; trigger++) {
+                auto next = definition.getDirectTransition({state}, {trigger});
+                if (!next) {
+                    return std::nullopt;
+                }
+                table.fTable[state * table.fTriggerCount + trigger] = static_cast<std::int32_t>(next->fIndex);
+            }
+        }
+        return table;
+    }
+
+    // The fastest kernel the CPU supports
+    static Kernel bestKernel() {
+#ifdef MACHINE_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return Kernel::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return Kernel::AVX2;
+        }
+#endif
+        return Kernel::Scalar;
+    }
+
+    static bool isSupported(Kernel kernel) {
+        return kernel <= bestKernel();
+    }
+
+    // Forces a kernel, for testing and benchmarking
+    void setKernel(Kernel kernel) {
+        assert(isSupported(kernel));
+        fKernel = kernel;
+    }
+
+    Kernel getKernel() const {
+        return fKernel;
+    }
+
+    // Fires triggers[i] on states[i] for every state in the array
+    void fireAll(Index *states, const Index *triggers, std::size_t count) const {
+        run<true>(states, triggers, 0, count);
+    }
+
+    // Fires the trigger on every state in the array
+    void fireAll(Index *states, Index trigger, std::size_t count) const {
+        run<false>(states, nullptr, trigger, count);
+    }
+
+private:
+    TransitionTable(std::size_t stateCount, std::size_t triggerCount) :
+    fStateCount(stateCount),
+    fTriggerCount(triggerCount),
+    fTable(stateCount * triggerCount),
+    fKernel(bestKernel()) {
+
+    }
+
+    template <bool PerState>
+    void run(Index *states, const Index *triggers, Index trigger, std::size_t count) const {
+        assert(PerState || trigger < fTriggerCount);
+        switch (fKernel) {
+#ifdef MACHINE_SIMD_X86
+            case Kernel::AVX512:
+                fireAVX512<PerState>(fTable.data(), fTriggerCount, states, triggers, trigger, count);
+                return;
+            case Kernel::AVX2:
+                fireAVX2<PerState>(fTable.data(), fTriggerCount, states, triggers, trigger, count);
+                return;
+#endif
+            default:
+                fireScalar<PerState>(fTable.data(), fTriggerCount, states, triggers, trigger, count);
+                return;
+        }
+    }
+
+    template <bool PerState>
+    static void fireScalar(const std::int32_t *table, std::size_t triggerCount, Index *states, const Index *triggers, Index trigger, std::size_t count) {
+        for (std::size_t i = 0; i < count; i++) {
+            states[i] = static_cast<Index>(table[states[i] * triggerCount + (PerState ? triggers[i] : trigger)]);
+        }
+    }
+
+#ifdef MACHINE_SIMD_X86
+    // 8 states at a time, widened to 32 bit indices for the gather and packed back afterwards
+    template <bool PerState>
+    __attribute__((target("avx2")))
+    static void fireAVX2(const std::int32_t *table, std::size_t triggerCount, Index *states, const Index *triggers, Index trigger, std::size_t count) {
+        const __m256i stride = _mm256_set1_epi32(static_cast<int>(triggerCount));
+        __m256i column = _mm256_set1_epi32(trigger);
+        std::size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i state;
+            if constexpr (sizeof(Index) == 1) {
+                state = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(states + i)));
+                if constexpr (PerState) {
+                    column = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(triggers + i)));
+                }
+            }
+            else {
+                state = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(states + i)));
+                if constexpr (PerState) {
+                    column = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(triggers + i)));
+                }
+            }
+            auto index = _mm256_add_epi32(_mm256_mullo_epi32(state, stride), column);
+            auto next = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), index, 4);
+            auto packed = _mm_packus_epi32(_mm256_castsi256_si128(next), _mm256_extracti128_si256(next, 1));
+            if constexpr (sizeof(Index) == 1) {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(states + i), _mm_packus_epi16(packed, packed));
+            }
+            else {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(states + i), packed);
+            }
+        }
+        fireScalar<PerState>(table, triggerCount, states + i, PerState ? triggers + i : nullptr, trigger, count - i);
+    }
+
+    // 16 states at a time, AVX-512F narrows the result without packing. GCC takes the undefined vectors which the
+    // intrinsics start from for uninitialized variables.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+    template <bool PerState>
+    __attribute__((target("avx512f")))
+    static void fireAVX512(const std::int32_t *table, std::size_t triggerCount, Index *states, const Index *triggers, Index trigger, std::size_t count) {
+        const __m512i stride = _mm512_set1_epi32(static_cast<int>(triggerCount));
+        __m512i column = _mm512_set1_epi32(trigger);
+        std::size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m512i state;
+            if constexpr (sizeof(Index) == 1) {
+                state = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(states + i)));
+                if constexpr (PerState) {
+                    column = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(triggers + i)));
+                }
+            }
+            else {
+                state = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(states + i)));
+                if constexpr (PerState) {
+                    column = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(triggers + i)));
+                }
+            }
+            auto index = _mm512_add_epi32(_mm512_mullo_epi32(state, stride), column);
+            auto next = _mm512_i32gather_epi32(index, table, 4);
+            if constexpr (sizeof(Index) == 1) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(states + i), _mm512_cvtepi32_epi8(next));
+            }
+            else {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(states + i), _mm512_cvtepi32_epi16(next));
+            }
+        }
+        fireScalar<PerState>(table, triggerCount, states + i, PerState ? triggers + i : nullptr, trigger, count - i);
+    }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+    std::size_t                 fStateCount;
+    std::size_t                 fTriggerCount;
+    std::vector<std::int32_t>   fTable; // Next state for each (state, trigger), 32 bit for the gathers
+    Kernel                      fKernel;
+};